@@ -25,6 +25,14 @@
 #include "miner.h"
 #include "util.h"
 #include "klist.h"
+#include "trace.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <poll.h>
+#else
+#define poll(fds, nfds, timeout) WSAPoll(fds, nfds, timeout)
+#endif
 
 #if defined(USE_BFLSC) || defined(USE_AVALON) || defined(USE_AVALON2) || defined(USE_AVALON4) || \
   defined(USE_HASHFAST) || defined(USE_BITFURY) || defined(USE_BITFURY16) || defined(USE_BLOCKERUPTER) || defined(USE_KLONDIKE) || \
@@ -276,6 +284,7 @@ static const char *OSINFO =
 #define _SETCONFIG	"SETCONFIG"
 #define _USBSTATS	"USBSTATS"
 #define _LCD		"LCD"
+#define _TRACE		"TRACE"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -320,6 +329,7 @@ static const char ISJSON = '{';
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
 #define JSON_USBSTATS	JSON1 _USBSTATS JSON2
 #define JSON_LCD	JSON1 _LCD JSON2
+#define JSON_TRACE	JSON1 _TRACE JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 #define JSON_BETWEEN_JOIN	","
@@ -453,6 +463,10 @@ static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_DEPRECATED 127
 
+#define MSG_TRACE 128
+#define MSG_TRACEINV 129
+#define MSG_TRACEERR 130
+
 enum code_severity {
 	SEVERITY_ERR,
 	SEVERITY_WARN,
@@ -621,13 +635,18 @@ struct CODES {
  { SEVERITY_SUCC,  MSG_LCD,	PARAM_NONE,	"LCD" },
  { SEVERITY_SUCC,  MSG_LOCKOK,	PARAM_NONE,	"Lock stats created" },
  { SEVERITY_WARN,  MSG_LOCKDIS,	PARAM_NONE,	"Lock stats not enabled" },
+ { SEVERITY_SUCC,  MSG_TRACE,	PARAM_NONE,	"Trace" },
+ { SEVERITY_ERR,   MSG_TRACEINV, PARAM_STR,	"Invalid trace parameter '%s' must be on, off or dump" },
+ { SEVERITY_ERR,   MSG_TRACEERR, PARAM_STR,	"Failed to write trace to '%s'" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
 static const char *localaddr = "127.0.0.1";
 
+static SOCKETTYPE metrics_sock = INVSOCK;
+
 static int my_thr_id = 0;
-static bool bye;
+static atomic_bool bye;
 
 // Used to control quit restart access to shutdown variables
 static pthread_mutex_t quit_restart_lock;
@@ -635,8 +654,6 @@ static pthread_mutex_t quit_restart_lock;
 static bool do_a_quit;
 static bool do_a_restart;
 
-static time_t when = 0;	// when the request occurred
-
 struct IPACCESS {
 	struct in6_addr ip;
 	struct in6_addr mask;
@@ -666,16 +683,9 @@ struct io_data {
 	char *cur;
 	bool sock;
 	bool close;
+	time_t when;	// when the request occurred
 };
 
-struct io_list {
-	struct io_data *io_data;
-	struct io_list *prev;
-	struct io_list *next;
-};
-
-static struct io_list *io_head = NULL;
-
 #define SOCKBUFALLOCSIZ 65536
 
 #define io_new(init) _io_new(init, false)
@@ -707,29 +717,14 @@ static void io_reinit(struct io_data *io_data)
 static struct io_data *_io_new(size_t initial, bool socket_buf)
 {
 	struct io_data *io_data;
-	struct io_list *io_list;
 
 	io_data = cgmalloc(sizeof(*io_data));
 	io_data->ptr = cgmalloc(initial);
 	io_data->siz = initial;
 	io_data->sock = socket_buf;
+	io_data->when = time(NULL);
 	io_reinit(io_data);
 
-	io_list = cgmalloc(sizeof(*io_list));
-
-	io_list->io_data = io_data;
-
-	if (io_head) {
-		io_list->next = io_head;
-		io_list->prev = io_head->prev;
-		io_list->next->prev = io_list;
-		io_list->prev->next = io_list;
-	} else {
-		io_list->prev = io_list;
-		io_list->next = io_list;
-		io_head = io_list;
-	}
-
 	return io_data;
 }
 
@@ -770,26 +765,6 @@ static void io_close(struct io_data *io_data)
 	io_data->close = true;
 }
 
-static void io_free()
-{
-	struct io_list *io_list, *io_next;
-
-	if (io_head) {
-		io_list = io_head;
-		do {
-			io_next = io_list->next;
-
-			free(io_list->io_data->ptr);
-			free(io_list->io_data);
-			free(io_list);
-
-			io_list = io_next;
-		} while (io_list != io_head);
-
-		io_head = NULL;
-	}
-}
-
 // This is only called when expected to be needed (rarely)
 // i.e. strings outside of the codes control (input from the user)
 static char *escape_string(char *str, bool isjson)
@@ -1514,7 +1489,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 			}
 
 			root = api_add_string(root, _STATUS, severity, false);
-			root = api_add_time(root, "When", &when, false);
+			root = api_add_time(root, "When", &io_data->when, false);
 			root = api_add_int(root, "Code", &messageid, false);
 			root = api_add_escape(root, "Msg", buf, false);
 			/* Do not give out description for random probes to
@@ -1530,7 +1505,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 	}
 
 	root = api_add_string(root, _STATUS, "F", false);
-	root = api_add_time(root, "When", &when, false);
+	root = api_add_time(root, "When", &io_data->when, false);
 	int id = -1;
 	root = api_add_int(root, "Code", &id, false);
 	sprintf(buf, "%d", messageid);
@@ -2263,7 +2238,7 @@ static void edevstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 			if (cgpu->usbinfo.nodev) {
 				if (howoldsec <= 0)
 					continue;
-				if ((when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
+				if ((io_data->when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
 					continue;
 			}
 #endif
@@ -2291,7 +2266,7 @@ static void edevstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 			if (cgpu->usbinfo.nodev) {
 				if (howoldsec <= 0)
 					continue;
-				if ((when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
+				if ((io_data->when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
 					continue;
 			}
 #endif
@@ -2604,6 +2579,7 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	struct api_data *root = NULL;
 	bool io_open;
 	double utility, mhs, work_utility;
+	unsigned int lw, nb;
 
 	message(io_data, MSG_SUMM, 0, NULL, isjson);
 	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
@@ -2632,9 +2608,11 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	root = api_add_int64(root, "Discarded", &(total_discarded), true);
 	root = api_add_int64(root, "Stale", &(total_stale), true);
 	root = api_add_uint(root, "Get Failures", &(total_go), true);
-	root = api_add_uint(root, "Local Work", &(local_work), true);
+	lw = atomic_load(&local_work);
+	root = api_add_uint(root, "Local Work", &lw, true);
 	root = api_add_uint(root, "Remote Failures", &(total_ro), true);
-	root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
+	nb = atomic_load(&new_blocks);
+	root = api_add_uint(root, "Network Blocks", &nb, true);
 	root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
 	root = api_add_utility(root, "Work Utility", &(work_utility), false);
 	root = api_add_diff(root, "Difficulty Accepted", &(total_diff_accepted), true);
@@ -3213,6 +3191,8 @@ void dosave(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, b
 static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_stats *stats, struct cgminer_pool_stats *pool_stats, struct api_data *extra, struct cgpu_info *cgpu, bool isjson)
 {
 	struct api_data *root = NULL;
+	uint64_t lat_count;
+	double lat_ms;
 
 	root = api_add_int(root, "STATS", &i, false);
 	root = api_add_string(root, "ID", id, false);
@@ -3243,7 +3223,19 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 		root = api_add_uint64(root, "Times Recv", &(pool_stats->times_received), false);
 		root = api_add_uint64(root, "Bytes Recv", &(pool_stats->bytes_received), false);
 		root = api_add_uint64(root, "Net Bytes Sent", &(pool_stats->net_bytes_sent), false);
+		root = api_add_uint64(root, "Net Times Recv", &(pool_stats->net_times_received), false);
 		root = api_add_uint64(root, "Net Bytes Recv", &(pool_stats->net_bytes_received), false);
+
+		lat_count = atomic_load(&pool_stats->submit_latency.count);
+		root = api_add_uint64(root, "Submit Latency Count", &lat_count, true);
+		lat_ms = lat_hist_percentile(&pool_stats->submit_latency, 50) / 1000.0;
+		root = api_add_double(root, "Submit Latency P50 ms", &lat_ms, true);
+		lat_ms = lat_hist_percentile(&pool_stats->submit_latency, 90) / 1000.0;
+		root = api_add_double(root, "Submit Latency P90 ms", &lat_ms, true);
+		lat_ms = lat_hist_percentile(&pool_stats->submit_latency, 99) / 1000.0;
+		root = api_add_double(root, "Submit Latency P99 ms", &lat_ms, true);
+		lat_ms = atomic_load(&pool_stats->submit_latency.max_us) / 1000.0;
+		root = api_add_double(root, "Submit Latency Max ms", &lat_ms, true);
 	}
 
 	if (extra)
@@ -3314,9 +3306,11 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 
 static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
+	struct api_data *root = NULL;
 	struct cgpu_info *cgpu;
 	bool io_open = false;
 	struct api_data *extra;
+	uint64_t hits, misses;
 	char id[20];
 	int i, j;
 
@@ -3347,6 +3341,14 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		i = itemstats(io_data, i, id, &(pool->cgminer_stats), &(pool->cgminer_pool_stats), NULL, NULL, isjson);
 	}
 
+	hits = atomic_load(&work_pool_hits);
+	misses = atomic_load(&work_pool_misses);
+	root = api_add_int(root, "STATS", &i, false);
+	root = api_add_string(root, "ID", "WORK", false);
+	root = api_add_uint64(root, "Work Pool Hits", &hits, true);
+	root = api_add_uint64(root, "Work Pool Misses", &misses, true);
+	root = print_data(io_data, root, isjson, isjson && (i > 0));
+
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3419,7 +3421,7 @@ static void minerestats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 		if (cgpu->usbinfo.nodev) {
 			if (howoldsec <= 0)
 				continue;
-			if ((when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
+			if ((io_data->when - cgpu->usbinfo.last_nodev.tv_sec) >= howoldsec)
 				continue;
 		}
 #endif
@@ -4063,6 +4065,50 @@ static void lcddata(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 		io_close(io_data);
 }
 
+static void dotrace(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	bool io_open, enabled;
+	int64_t events = -1;
+	int threads;
+
+	// no parameter just reports the trace state
+	if (param != NULL && *param != '\0') {
+		if (strcasecmp(param, "on") == 0)
+			trace_start();
+		else if (strcasecmp(param, "off") == 0)
+			trace_stop();
+		else if (strcasecmp(param, "dump") == 0) {
+			events = trace_dump(opt_trace_file);
+			if (events < 0) {
+				applog(LOG_WARNING, "API: trace dump to '%s' failed: %s",
+				       opt_trace_file, strerror(errno));
+				message(io_data, MSG_TRACEERR, 0, opt_trace_file, isjson);
+				return;
+			}
+		} else {
+			message(io_data, MSG_TRACEINV, 0, param, isjson);
+			return;
+		}
+	}
+
+	enabled = atomic_load(&trace_on);
+	threads = trace_threads();
+
+	message(io_data, MSG_TRACE, 0, NULL, isjson);
+	io_open = io_add(io_data, isjson ? COMSTR JSON_TRACE : _TRACE COMSTR);
+
+	root = api_add_bool(root, "Enabled", &enabled, false);
+	root = api_add_int(root, "Threads", &threads, false);
+	root = api_add_escape(root, "File", opt_trace_file, false);
+	if (events >= 0)
+		root = api_add_int64(root, "Events", &events, false);
+
+	root = print_data(io_data, root, isjson, false);
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
 
 struct CMDS {
@@ -4121,6 +4167,7 @@ struct CMDS {
 	{ "asccount",		asccount,	false,	true },
 	{ "lcd",		lcddata,	false,	true },
 	{ "lockstats",		lockstats,	true,	true },
+	{ "trace",		dotrace,	true,	false },
 	{ NULL,			NULL,		false,	false }
 };
 
@@ -4205,21 +4252,11 @@ static void tail_join(struct io_data *io_data, bool isjson)
 	}
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+static void send_buf(SOCKETTYPE c, char *buf, int len)
 {
-	int count, sendc, res, tosend, len, n;
-	char *buf = io_data->ptr;
-
-	strcpy(buf, io_data->ptr);
-
-	if (io_data->close)
-		strcat(buf, JSON_CLOSE);
-
-	if (isjson)
-		strcat(buf, JSON_END);
+	int count, sendc, res, tosend, n;
 
-	len = strlen(buf);
-	tosend = len+1;
+	tosend = len;
 
 	applog(LOG_DEBUG, "API: send reply: (%d) '%.10s%s'", tosend, buf, len > 10 ? "..." : BLANK);
 
@@ -4244,7 +4281,7 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 			if (sock_blocks())
 				continue;
 
-			applog(LOG_WARNING, "API: send (%d:%d) failed: %s", len+1, (len+1 - tosend), SOCKERRMSG);
+			applog(LOG_WARNING, "API: send (%d:%d) failed: %s", len, (len - tosend), SOCKERRMSG);
 
 			return;
 		} else {
@@ -4269,6 +4306,20 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 	}
 }
 
+static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+{
+	char *buf = io_data->ptr;
+
+	if (io_data->close)
+		strcat(buf, JSON_CLOSE);
+
+	if (isjson)
+		strcat(buf, JSON_END);
+
+	// The reply includes the '\0'
+	send_buf(c, buf, strlen(buf) + 1);
+}
+
 static void tidyup(__maybe_unused void *arg)
 {
 	mutex_lock(&quit_restart_lock);
@@ -4283,13 +4334,16 @@ static void tidyup(__maybe_unused void *arg)
 		*apisock = INVSOCK;
 	}
 
+	if (metrics_sock != INVSOCK) {
+		CLOSESOCKET(metrics_sock);
+		metrics_sock = INVSOCK;
+	}
+
 	if (ipaccess != NULL) {
 		free(ipaccess);
 		ipaccess = NULL;
 	}
 
-	io_free();
-
 	mutex_unlock(&quit_restart_lock);
 }
 
@@ -4869,39 +4923,781 @@ void mcast_init()
 		quit(1, "API mcast thread create failed");
 }
 
-void api(int api_thr_id)
+/* The listener only accepts connections and waits for their command to
+ * arrive, everything else is done by a fixed pool of workers so one slow
+ * command doesn't hold up every other client. Commands flagged iswritemode
+ * take api_cmd_lock exclusively, the rest run in parallel under the read
+ * lock */
+#define API_WORKERS 4
+#define API_CLIENTS 64
+#define API_POLL_MS 500
+// How long a client has to send its command after connecting
+#define API_RECV_TIMEOUT 10
+// How long to wait on shutdown for workers to send their last replies
+#define API_DRAIN_MS 2000
+
+struct api_conn {
+	SOCKETTYPE c;
+	char *connectaddr;
+	char group;
+	bool metrics;
+	time_t accepted;
+	int len;
+	/* Accept only half the TMPBUFSIZ to account for space
+	 * potentially used by escaping chars. */
+	char buf[TMPBUFSIZ / 2];
+};
+
+static struct thread_q *api_tq;
+static atomic_int api_inflight;
+static pthread_rwlock_t api_cmd_lock;
+
+static void api_conn_free(struct api_conn *conn)
+{
+	CLOSESOCKET(conn->c);
+	free(conn->connectaddr);
+	free(conn);
+}
+
+/* The read-mostly commands monitoring polls are rendered every
+ * opt_api_snapshot ms by api_publisher() into an immutable snapshot, which
+ * the workers then copy out without taking any locks. A worker publishes the
+ * snapshot it is using in its api_snap_hazard slot, and a replaced snapshot
+ * is only freed once no slot still points at it. Write commands drop the
+ * current snapshot so their effect shows straight away */
+static const struct {
+	void (*func)(struct io_data *, SOCKETTYPE, char *, bool, char);
+} api_snap_cmds[] = {
+	{ summary },
+	{ devstatus },
+	{ poolstatus },
+	{ minerstats },
+};
+
+#define API_SNAP_CMDS (int)(sizeof(api_snap_cmds) / sizeof(api_snap_cmds[0]))
+
+struct api_snapshot {
+	uint64_t version;
+	struct api_snapshot *next;
+	// [cmd][isjson] reply body, ready to io_add()
+	char *reply[API_SNAP_CMDS][2];
+};
+
+static struct api_snapshot *_Atomic api_snap;
+static struct api_snapshot *_Atomic api_snap_hazard[API_WORKERS];
+static pthread_mutex_t api_snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct api_snapshot *api_snap_retired;
+static cgsem_t api_snap_sem;
+
+static struct api_snapshot *api_snap_get(int worker)
+{
+	struct api_snapshot *snap;
+
+	do {
+		snap = atomic_load(&api_snap);
+		atomic_store(&api_snap_hazard[worker], snap);
+	} while (snap != atomic_load(&api_snap));
+
+	return snap;
+}
+
+static void api_snap_put(int worker)
+{
+	atomic_store(&api_snap_hazard[worker], NULL);
+}
+
+static char *api_snap_reply(struct api_snapshot *snap, void (*func)(struct io_data *, SOCKETTYPE, char *, bool, char), bool isjson)
+{
+	int i;
+
+	if (!snap)
+		return NULL;
+	for (i = 0; i < API_SNAP_CMDS; i++) {
+		if (api_snap_cmds[i].func == func)
+			return snap->reply[i][isjson];
+	}
+	return NULL;
+}
+
+static void api_snap_free(struct api_snapshot *snap)
+{
+	int i;
+
+	for (i = 0; i < API_SNAP_CMDS; i++) {
+		free(snap->reply[i][0]);
+		free(snap->reply[i][1]);
+	}
+	free(snap);
+}
+
+static void api_snap_retire(struct api_snapshot *snap)
+{
+	if (!snap)
+		return;
+
+	mutex_lock(&api_snap_lock);
+	snap->next = api_snap_retired;
+	api_snap_retired = snap;
+	mutex_unlock(&api_snap_lock);
+}
+
+// Free every retired snapshot that no worker can still be reading
+static void api_snap_reclaim(void)
+{
+	struct api_snapshot *snap, **prev;
+	bool inuse;
+	int i;
+
+	mutex_lock(&api_snap_lock);
+	prev = &api_snap_retired;
+	while ((snap = *prev) != NULL) {
+		inuse = false;
+		for (i = 0; i < API_WORKERS; i++) {
+			if (atomic_load(&api_snap_hazard[i]) == snap) {
+				inuse = true;
+				break;
+			}
+		}
+		if (inuse)
+			prev = &snap->next;
+		else {
+			*prev = snap->next;
+			api_snap_free(snap);
+		}
+	}
+	mutex_unlock(&api_snap_lock);
+}
+
+static void api_snap_invalidate(void)
+{
+	if (opt_api_snapshot <= 0)
+		return;
+
+	api_snap_retire(atomic_exchange(&api_snap, NULL));
+	cgsem_post(&api_snap_sem);
+}
+
+static char *api_snap_render(struct io_data *io_data, int cmd, bool isjson)
+{
+	io_reinit(io_data);
+	(api_snap_cmds[cmd].func)(io_data, INVSOCK, NULL, isjson, PRIVGROUP);
+	if (io_data->close)
+		io_add(io_data, JSON_CLOSE);
+	return strdup(io_data->ptr);
+}
+
+static void *api_publisher(__maybe_unused void *userdata)
 {
+	struct api_snapshot *snap;
 	struct io_data *io_data;
-	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
+	uint64_t version = 0;
+	int i;
+
+	pthread_detach(pthread_self());
+	RenameThread("APISnapshot");
+
+	io_data = sock_io_new();
+
+	while (42) {
+		snap = cgcalloc(1, sizeof(*snap));
+		snap->version = ++version;
+
+		fold_stats();
+		/* Held across the swap so a write command can't complete
+		 * between rendering and publishing, leaving its
+		 * invalidation undone */
+		rd_lock(&api_cmd_lock);
+		io_data->when = time(NULL);
+		for (i = 0; i < API_SNAP_CMDS; i++) {
+			snap->reply[i][0] = api_snap_render(io_data, i, false);
+			snap->reply[i][1] = api_snap_render(io_data, i, true);
+		}
+		api_snap_retire(atomic_exchange(&api_snap, snap));
+		rd_unlock(&api_cmd_lock);
+
+		api_snap_reclaim();
+
+		cgsem_mswait(&api_snap_sem, opt_api_snapshot);
+	}
+
+	return NULL;
+}
+
+static void api_command(struct io_data *io_data, struct api_conn *conn, int worker)
+{
+	struct api_snapshot *snap;
+	char *reply;
 	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
-	char *binderror;
-	time_t bindstart;
-	short int port = opt_api_port;
-	char port_s[10];
-	struct sockaddr_storage cli;
-	socklen_t clisiz;
+	SOCKETTYPE c = conn->c;
+	char *buf = conn->buf;
+	char group = conn->group;
 	char cmdbuf[100];
 	char *cmd = NULL;
 	char *param;
-	bool addrok;
-	char group;
 	json_error_t json_err;
-	json_t *json_config;
+	json_t *json_config = NULL;
 	json_t *json_val;
 	bool isjson;
-	bool did, isjoin, firstjoin;
+	bool did, isjoin = false, firstjoin;
+	int i;
+
+	// the time of the request in now
+	io_data->when = time(NULL);
+	io_reinit(io_data);
+
+	// Joined commands all come from the one snapshot
+	snap = api_snap_get(worker);
+
+	did = false;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+		json_config = json_loadb(buf, conn->len, 0, &json_err);
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			send_result(io_data, c, isjson);
+			did = true;
+		} else {
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				send_result(io_data, c, isjson);
+				did = true;
+			} else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					send_result(io_data, c, isjson);
+					did = true;
+				} else {
+					cmd = (char *)json_string_value(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+		}
+	}
+
+	if (!did) {
+		char *cmdptr, *cmdsbuf = NULL;
+
+		if (strchr(cmd, CMDJOIN)) {
+			firstjoin = isjoin = true;
+			// cmd + leading+tailing '|' + '\0'
+			cmdsbuf = cgmalloc(strlen(cmd) + 3);
+			strcpy(cmdsbuf, "|");
+			param = NULL;
+		} else
+			firstjoin = isjoin = false;
+
+		cmdptr = cmd;
+		do {
+			did = false;
+			if (isjoin) {
+				cmd = strchr(cmdptr, CMDJOIN);
+				if (cmd)
+					*(cmd++) = '\0';
+				if (!*cmdptr)
+					goto inochi;
+			}
+
+			for (i = 0; cmds[i].name != NULL; i++) {
+				if (strcmp(cmdptr, cmds[i].name) == 0) {
+					sprintf(cmdbuf, "|%s|", cmdptr);
+					if (isjoin) {
+						if (strstr(cmdsbuf, cmdbuf)) {
+							did = true;
+							break;
+						}
+						strcat(cmdsbuf, cmdptr);
+						strcat(cmdsbuf, "|");
+						head_join(io_data, cmdptr, isjson, &firstjoin);
+						if (!cmds[i].joinable) {
+							message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+							did = true;
+							tail_join(io_data, isjson);
+							break;
+						}
+					}
+					if (!ISPRIVGROUP(group) && !strstr(COMMANDS(group), cmdbuf)) {
+						message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+						applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", conn->connectaddr, cmds[i].name);
+					} else if ((reply = api_snap_reply(snap, cmds[i].func, isjson))) {
+						io_add(io_data, reply);
+					} else if (cmds[i].iswritemode) {
+						fold_stats();
+						wr_lock(&api_cmd_lock);
+						(cmds[i].func)(io_data, c, param, isjson, group);
+						wr_unlock(&api_cmd_lock);
+						api_snap_invalidate();
+					} else {
+						fold_stats();
+						rd_lock(&api_cmd_lock);
+						(cmds[i].func)(io_data, c, param, isjson, group);
+						rd_unlock(&api_cmd_lock);
+					}
+
+
+					did = true;
+					if (!isjoin)
+						send_result(io_data, c, isjson);
+					else
+						tail_join(io_data, isjson);
+					break;
+				}
+			}
+
+			if (!did) {
+				if (isjoin)
+					head_join(io_data, cmdptr, isjson, &firstjoin);
+				message(io_data, MSG_INVCMD, 0, NULL, isjson);
+				if (isjoin)
+					tail_join(io_data, isjson);
+				else
+					send_result(io_data, c, isjson);
+			}
+inochi:
+			if (isjoin)
+				cmdptr = cmd;
+		} while (isjoin && cmdptr);
+
+		free(cmdsbuf);
+	}
+
+	if (isjoin)
+		send_result(io_data, c, isjson);
+
+	if (isjson && json_is_object(json_config))
+		json_decref(json_config);
+
+	api_snap_put(worker);
+}
+
+/* Prometheus text exposition served over plain HTTP on --api-metrics-port.
+ * Counters come from the same totals as summary/devs/pools, histograms from
+ * the lat_hist samples the hot paths record lock free */
+static void metrics_add(struct io_data *io_data, const char *fmt, ...)
+{
+	char buf[TMPBUFSIZ];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	io_add(io_data, buf);
+}
+
+static void metrics_head(struct io_data *io_data, const char *name, const char *type, const char *help)
+{
+	metrics_add(io_data, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Buckets are emitted an octave apart, each le is the first whole
+ * microsecond above the bucket so it also bounds every sample in it */
+static void metrics_hist(struct io_data *io_data, const char *name, const char *labels, struct lat_hist *hist)
+{
+	const char *sep = *labels ? "," : "";
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		total += atomic_load_explicit(&hist->bucket[i], memory_order_relaxed);
+		if (i % 4 == 3 && i < LAT_HIST_BUCKETS - 4) {
+			metrics_add(io_data, "%s_bucket{%s%sle=\"%.10g\"} %"PRIu64"\n",
+				    name, labels, sep, (lat_hist_bound(i) + 1) / 1000000.0, total);
+		}
+	}
+	metrics_add(io_data, "%s_bucket{%s%sle=\"+Inf\"} %"PRIu64"\n", name, labels, sep, total);
+	metrics_add(io_data, "%s_sum%s%s%s %f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+		    atomic_load_explicit(&hist->sum_us, memory_order_relaxed) / 1000000.0);
+	metrics_add(io_data, "%s_count%s%s%s %"PRIu64"\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", total);
+}
+
+static void metrics_chips(struct io_data *io_data, const char *name, const char *type, const char *help, int field)
+{
+	struct chip_metrics chip;
+	int i, j;
+
+	metrics_head(io_data, name, type, help);
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		if (!cgpu->drv->get_chip_metrics)
+			continue;
+		for (j = 0; cgpu->drv->get_chip_metrics(cgpu, j, &chip); j++) {
+			uint64_t val;
+
+			switch (field) {
+				case 0:
+					val = chip.nonces;
+					break;
+				case 1:
+					val = chip.hw_errors;
+					break;
+				case 2:
+					val = chip.stales;
+					break;
+				case 3:
+					val = chip.mhz;
+					break;
+				default:
+					val = chip.disabled;
+					break;
+			}
+			metrics_add(io_data, "%s{device=\"%s%d\",chip=\"%d\"} %"PRIu64"\n",
+				    name, cgpu->drv->name, cgpu->device_id, chip.chip_id, val);
+		}
+	}
+}
+
+static void api_metrics_render(struct io_data *io_data)
+{
+	int64_t accepted, rejected, stale, diff1;
+	double diff_accepted, diff_rejected, mhs;
+	char labels[32];
+	int hw, i;
+
+	fold_stats();
+
+	mutex_lock(&stats_lock);
+	accepted = total_accepted;
+	rejected = total_rejected;
+	stale = total_stale;
+	diff1 = total_diff1;
+	diff_accepted = total_diff_accepted;
+	diff_rejected = total_diff_rejected;
+	hw = hw_errors;
+	mutex_unlock(&stats_lock);
+
+	mutex_lock(&hash_lock);
+	mhs = total_rolling;
+	mutex_unlock(&hash_lock);
+
+	metrics_head(io_data, "cgminer_accepted_total", "counter", "Accepted shares");
+	metrics_add(io_data, "cgminer_accepted_total %"PRId64"\n", accepted);
+	metrics_head(io_data, "cgminer_rejected_total", "counter", "Rejected shares");
+	metrics_add(io_data, "cgminer_rejected_total %"PRId64"\n", rejected);
+	metrics_head(io_data, "cgminer_stale_total", "counter", "Stale shares");
+	metrics_add(io_data, "cgminer_stale_total %"PRId64"\n", stale);
+	metrics_head(io_data, "cgminer_hw_errors_total", "counter", "Hardware errors");
+	metrics_add(io_data, "cgminer_hw_errors_total %d\n", hw);
+	metrics_head(io_data, "cgminer_diff1_total", "counter", "Difficulty 1 shares found");
+	metrics_add(io_data, "cgminer_diff1_total %"PRId64"\n", diff1);
+	metrics_head(io_data, "cgminer_diff_accepted_total", "counter", "Difficulty of accepted shares");
+	metrics_add(io_data, "cgminer_diff_accepted_total %f\n", diff_accepted);
+	metrics_head(io_data, "cgminer_diff_rejected_total", "counter", "Difficulty of rejected shares");
+	metrics_add(io_data, "cgminer_diff_rejected_total %f\n", diff_rejected);
+	metrics_head(io_data, "cgminer_hashrate_mhs", "gauge", "Rolling hash rate over the log interval");
+	metrics_add(io_data, "cgminer_hashrate_mhs %f\n", mhs);
+	metrics_head(io_data, "cgminer_log_dropped_total", "counter", "Log messages dropped with the log ring full");
+	metrics_add(io_data, "cgminer_log_dropped_total %"PRIu64"\n",
+		    (uint64_t)atomic_load_explicit(&log_dropped, memory_order_relaxed));
+
+	metrics_head(io_data, "cgminer_device_accepted_total", "counter", "Accepted shares per device");
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		metrics_add(io_data, "cgminer_device_accepted_total{device=\"%s%d\"} %d\n",
+			    cgpu->drv->name, cgpu->device_id, cgpu->accepted);
+	}
+	metrics_head(io_data, "cgminer_device_rejected_total", "counter", "Rejected shares per device");
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		metrics_add(io_data, "cgminer_device_rejected_total{device=\"%s%d\"} %d\n",
+			    cgpu->drv->name, cgpu->device_id, cgpu->rejected);
+	}
+	metrics_head(io_data, "cgminer_device_hw_errors_total", "counter", "Hardware errors per device");
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		metrics_add(io_data, "cgminer_device_hw_errors_total{device=\"%s%d\"} %d\n",
+			    cgpu->drv->name, cgpu->device_id, cgpu->hw_errors);
+	}
+	metrics_head(io_data, "cgminer_device_diff1_total", "counter", "Difficulty 1 shares found per device");
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+
+		metrics_add(io_data, "cgminer_device_diff1_total{device=\"%s%d\"} %"PRId64"\n",
+			    cgpu->drv->name, cgpu->device_id, cgpu->diff1);
+	}
+
+	metrics_chips(io_data, "cgminer_chip_nonces_total", "counter", "Nonces found per chip", 0);
+	metrics_chips(io_data, "cgminer_chip_hw_errors_total", "counter", "Hardware errors per chip", 1);
+	metrics_chips(io_data, "cgminer_chip_stales_total", "counter", "Stale nonces per chip", 2);
+	metrics_chips(io_data, "cgminer_chip_mhz", "gauge", "Chip clock", 3);
+	metrics_chips(io_data, "cgminer_chip_disabled", "gauge", "Chip disabled", 4);
+
+	metrics_head(io_data, "cgminer_pool_accepted_total", "counter", "Accepted shares per pool");
+	for (i = 0; i < total_pools; i++) {
+		metrics_add(io_data, "cgminer_pool_accepted_total{pool=\"%d\"} %"PRId64"\n",
+			    pools[i]->pool_no, pools[i]->accepted);
+	}
+	metrics_head(io_data, "cgminer_pool_rejected_total", "counter", "Rejected shares per pool");
+	for (i = 0; i < total_pools; i++) {
+		metrics_add(io_data, "cgminer_pool_rejected_total{pool=\"%d\"} %"PRId64"\n",
+			    pools[i]->pool_no, pools[i]->rejected);
+	}
+	metrics_head(io_data, "cgminer_pool_stale_total", "counter", "Stale shares per pool");
+	for (i = 0; i < total_pools; i++) {
+		metrics_add(io_data, "cgminer_pool_stale_total{pool=\"%d\"} %u\n",
+			    pools[i]->pool_no, pools[i]->stale_shares);
+	}
+
+	metrics_head(io_data, "cgminer_share_submit_seconds", "histogram",
+		     "Time from queueing a stratum share to the pool's reply");
+	for (i = 0; i < total_pools; i++) {
+		snprintf(labels, sizeof(labels), "pool=\"%d\"", pools[i]->pool_no);
+		metrics_hist(io_data, "cgminer_share_submit_seconds", labels,
+			     &pools[i]->cgminer_pool_stats.submit_latency);
+	}
+	metrics_head(io_data, "cgminer_notify_first_job_seconds", "histogram",
+		     "Time from a stratum notify to its first work reaching a device");
+	for (i = 0; i < total_pools; i++) {
+		snprintf(labels, sizeof(labels), "pool=\"%d\"", pools[i]->pool_no);
+		metrics_hist(io_data, "cgminer_notify_first_job_seconds", labels,
+			     &pools[i]->cgminer_pool_stats.notify_latency);
+	}
+	metrics_head(io_data, "cgminer_work_nonce_seconds", "histogram",
+		     "Time from a work reaching a device to each nonce found on it");
+	metrics_hist(io_data, "cgminer_work_nonce_seconds", "", &work_nonce_latency);
+	metrics_head(io_data, "cgminer_spi_transfer_seconds", "histogram",
+		     "Time taken by each SPI transfer");
+	metrics_hist(io_data, "cgminer_spi_transfer_seconds", "", &spi_xfer_latency);
+}
+
+static void api_metrics(struct io_data *io_data, struct api_conn *conn)
+{
+	char head[256];
+	char *path;
+	int len;
+
+	io_reinit(io_data);
+
+	path = conn->buf + 4;
+	if (strncmp(conn->buf, "GET ", 4) || strncmp(path, "/metrics", 8) ||
+	    (path[8] != ' ' && path[8] != '?' && path[8] != '\r' && path[8] != '\n')) {
+		static const char notfound[] =
+			"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+		send_buf(conn->c, (char *)notfound, sizeof(notfound) - 1);
+		return;
+	}
+
+	rd_lock(&api_cmd_lock);
+	api_metrics_render(io_data);
+	rd_unlock(&api_cmd_lock);
+	len = io_data->cur - io_data->ptr;
+	snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %d\r\nConnection: close\r\n\r\n", len);
+	send_buf(conn->c, head, strlen(head));
+	send_buf(conn->c, io_data->ptr, len);
+}
+
+/* Each worker owns the io_data its replies are built in, so a connection
+ * has it to itself for as long as the command runs */
+static void *api_worker(void *userdata)
+{
+	int worker = (int)(intptr_t)userdata;
+	struct io_data *io_data;
+	struct api_conn *conn;
+
+	pthread_detach(pthread_self());
+	RenameThread("APIWorker");
+
+	io_data = sock_io_new();
+
+	while (42) {
+		conn = tq_pop(api_tq);
+		if (unlikely(!conn))
+			continue;
+
+		if (conn->metrics)
+			api_metrics(io_data, conn);
+		else
+			api_command(io_data, conn, worker);
+		api_conn_free(conn);
+		atomic_fetch_sub(&api_inflight, 1);
+	}
+
+	return NULL;
+}
+
+static void api_workers_init(void)
+{
+	pthread_t pth;
+	int i;
+
+	api_tq = tq_new();
+	rwlock_init(&api_cmd_lock);
+
+	for (i = 0; i < API_WORKERS; i++) {
+		if (unlikely(pthread_create(&pth, NULL, api_worker, (void *)(intptr_t)i)))
+			quit(1, "API worker thread create failed");
+	}
+
+	if (opt_api_snapshot > 0) {
+		cgsem_init(&api_snap_sem);
+		if (unlikely(pthread_create(&pth, NULL, api_publisher, NULL)))
+			quit(1, "API snapshot thread create failed");
+	}
+}
+
+static void api_accept(SOCKETTYPE apisock, bool metrics, struct api_conn **conns, int *nconns)
+{
+	struct sockaddr_storage cli;
+	struct api_conn *conn;
+	socklen_t clisiz;
+	char *connectaddr;
+	bool addrok;
+	char group;
+	SOCKETTYPE c;
+
+	clisiz = sizeof(cli);
+	if (SOCKETFAIL(c = accept(apisock, (struct sockaddr *)(&cli), &clisiz))) {
+		// The client may have gone again before we got to it
+		applog(LOG_DEBUG, "API: accept failed (%s) (%d)", SOCKERRMSG, (int)apisock);
+		return;
+	}
+
+	addrok = check_connect((struct sockaddr_storage *)&cli, &connectaddr, &group);
+	applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
+
+	if (!addrok) {
+		CLOSESOCKET(c);
+		free(connectaddr);
+		return;
+	}
+
+	conn = cgmalloc(sizeof(*conn));
+	conn->c = c;
+	conn->connectaddr = connectaddr;
+	conn->group = group;
+	conn->metrics = metrics;
+	conn->accepted = time(NULL);
+	conn->len = 0;
+	conns[(*nconns)++] = conn;
+}
+
+/* Read the command a client sent and queue it for the workers. Like before
+ * only what arrives in the first recv is used */
+static void api_recv(struct api_conn *conn)
+{
+	int n;
+
+	n = recv(conn->c, conn->buf, sizeof(conn->buf) - 1, 0);
+	if (SOCKETFAIL(n))
+		conn->buf[0] = '\0';
+	else
+		conn->buf[n] = '\0';
+
+	if (opt_debug) {
+		if (SOCKETFAIL(n))
+			applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		else
+			applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, conn->buf);
+	}
+
+	if (SOCKETFAIL(n)) {
+		api_conn_free(conn);
+		return;
+	}
+
+	conn->len = n;
+	atomic_fetch_add(&api_inflight, 1);
+	if (unlikely(!tq_push(api_tq, conn))) {
+		atomic_fetch_sub(&api_inflight, 1);
+		api_conn_free(conn);
+	}
+}
+
+/* The metrics port shares the API's host, access list and workers, failing
+ * to open it leaves the rest of the API running */
+static void api_metrics_listen(void)
+{
+	struct addrinfo hints, *res;
+	char port_s[10];
+	SOCKETTYPE sock;
+
+	sprintf(port_s, "%d", opt_api_metrics_port);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(opt_api_host, port_s, &hints, &res) != 0) {
+		applog(LOG_ERR, "API metrics failed to resolve %s", opt_api_host);
+		return;
+	}
+
+	sock = socket(res->ai_family, SOCK_STREAM, 0);
+	if (sock == INVSOCK) {
+		applog(LOG_ERR, "API metrics socket failed (%s)", SOCKERRMSG);
+		freeaddrinfo(res);
+		return;
+	}
+
+#ifndef WIN32
+	int optval = 1;
+	if (SOCKETFAIL(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval))))
+		applog(LOG_DEBUG, "API metrics setsockopt SO_REUSEADDR failed (ignored): %s", SOCKERRMSG);
+#endif
+
+	if (SOCKETFAIL(bind(sock, res->ai_addr, res->ai_addrlen)) ||
+	    SOCKETFAIL(listen(sock, QUEUE))) {
+		applog(LOG_ERR, "API metrics on port %d failed (%s)", opt_api_metrics_port, SOCKERRMSG);
+		CLOSESOCKET(sock);
+		freeaddrinfo(res);
+		return;
+	}
+	freeaddrinfo(res);
+
+#ifndef WIN32
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+	metrics_sock = sock;
+	applog(LOG_WARNING, "API metrics running on port %d (%d)", opt_api_metrics_port, (int)sock);
+}
+
+void api(int api_thr_id)
+{
+	struct pollfd pfds[API_CLIENTS + 2];
+	struct api_conn *conns[API_CLIENTS];
+	int nconns = 0;
+	struct thr_info bye_thr;
+	int n, bound;
+	char *binderror;
+	time_t bindstart;
+	short int port = opt_api_port;
+	char port_s[10];
 	int i;
 	struct addrinfo hints, *res, *host;
 	SOCKETTYPE *apisock;
 
 	apisock = cgmalloc(sizeof(*apisock));
 	*apisock = INVSOCK;
-	json_config = NULL;
-	isjoin = false;
 
 	if (!opt_api_listen) {
 		applog(LOG_DEBUG, "API not running%s", UNAVAILABLE);
@@ -4909,8 +5705,6 @@ void api(int api_thr_id)
 		return;
 	}
 
-	io_data = sock_io_new();
-
 	mutex_init(&quit_restart_lock);
 
 	pthread_cleanup_push(tidyup, (void *)apisock);
@@ -4999,6 +5793,11 @@ void api(int api_thr_id)
 		return;
 	}
 
+#ifndef WIN32
+	// A client that goes away between poll and accept mustn't block us
+	fcntl(*apisock, F_SETFL, fcntl(*apisock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
 	if (opt_api_allow)
 		applog(LOG_WARNING, "API running in IP access mode on port %d (%d)", port, (int)*apisock);
 	else {
@@ -5013,174 +5812,84 @@ void api(int api_thr_id)
 
 	strbufs = k_new_list("StrBufs", sizeof(SBITEM), ALLOC_SBITEMS, LIMIT_SBITEMS, false);
 
+	if (opt_api_metrics_port)
+		api_metrics_listen();
+
+	api_workers_init();
+
 	while (!bye) {
-		clisiz = sizeof(cli);
-		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
+		bool listening;
+		time_t now;
+		int nfds, base;
+
+		/* Stop accepting while every worker slot is taken, new clients
+		 * then just wait in the listen backlog */
+		listening = nconns < API_CLIENTS && atomic_load(&api_inflight) < API_CLIENTS;
+
+		nfds = 0;
+		if (listening) {
+			pfds[nfds].fd = *apisock;
+			pfds[nfds].events = POLLIN;
+			pfds[nfds++].revents = 0;
+			if (metrics_sock != INVSOCK) {
+				pfds[nfds].fd = metrics_sock;
+				pfds[nfds].events = POLLIN;
+				pfds[nfds++].revents = 0;
+			}
+		}
+		base = nfds;
+		for (i = 0; i < nconns; i++) {
+			pfds[nfds].fd = conns[i]->c;
+			pfds[nfds].events = POLLIN;
+			pfds[nfds++].revents = 0;
+		}
+
+		n = poll(pfds, nfds, API_POLL_MS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 			applog(LOG_ERR, "API failed (%s)%s (%d)", SOCKERRMSG, UNAVAILABLE, (int)*apisock);
 			goto die;
 		}
 
-		addrok = check_connect((struct sockaddr_storage *)&cli, &connectaddr, &group);
-		applog(LOG_DEBUG, "API: connection from %s - %s",
-					connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
-			/* Accept only half the TMPBUFSIZ to account for space
-			 * potentially used by escaping chars. */
-			n = recv(c, &buf[0], TMPBUFSIZ / 2 - 1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
-
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
+		now = time(NULL);
+		// Backwards so dropping a connection doesn't move any not yet seen
+		for (i = nconns - 1; i >= 0; i--) {
+			struct api_conn *conn = conns[i];
+
+			if (pfds[base + i].revents) {
+				conns[i] = conns[--nconns];
+				api_recv(conn);
+			} else if (now - conn->accepted > API_RECV_TIMEOUT) {
+				applog(LOG_DEBUG, "API: no command from %s after %ds",
+						conn->connectaddr, API_RECV_TIMEOUT);
+				conns[i] = conns[--nconns];
+				api_conn_free(conn);
 			}
+		}
 
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-					json_config = json_loadb(buf, n, 0, &json_err);
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					} else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						} else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							} else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did) {
-					char *cmdptr, *cmdsbuf = NULL;
-
-					if (strchr(cmd, CMDJOIN)) {
-						firstjoin = isjoin = true;
-						// cmd + leading+tailing '|' + '\0'
-						cmdsbuf = cgmalloc(strlen(cmd) + 3);
-						strcpy(cmdsbuf, "|");
-						param = NULL;
-					} else
-						firstjoin = isjoin = false;
-
-					cmdptr = cmd;
-					do {
-						did = false;
-						if (isjoin) {
-							cmd = strchr(cmdptr, CMDJOIN);
-							if (cmd)
-								*(cmd++) = '\0';
-							if (!*cmdptr)
-								goto inochi;
-						}
-
-						for (i = 0; cmds[i].name != NULL; i++) {
-							if (strcmp(cmdptr, cmds[i].name) == 0) {
-								sprintf(cmdbuf, "|%s|", cmdptr);
-								if (isjoin) {
-									if (strstr(cmdsbuf, cmdbuf)) {
-										did = true;
-										break;
-									}
-									strcat(cmdsbuf, cmdptr);
-									strcat(cmdsbuf, "|");
-									head_join(io_data, cmdptr, isjson, &firstjoin);
-									if (!cmds[i].joinable) {
-										message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-										did = true;
-										tail_join(io_data, isjson);
-										break;
-									}
-								}
-								if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-									(cmds[i].func)(io_data, c, param, isjson, group);
-								else {
-									message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-									applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-								}
-
-								did = true;
-								if (!isjoin)
-									send_result(io_data, c, isjson);
-								else
-									tail_join(io_data, isjson);
-								break;
-							}
-						}
-
-						if (!did) {
-							if (isjoin)
-								head_join(io_data, cmdptr, isjson, &firstjoin);
-							message(io_data, MSG_INVCMD, 0, NULL, isjson);
-							if (isjoin)
-								tail_join(io_data, isjson);
-							else
-								send_result(io_data, c, isjson);
-						}
-inochi:
-						if (isjoin)
-							cmdptr = cmd;
-					} while (isjoin && cmdptr);
-				}
-
-				if (isjoin)
-					send_result(io_data, c, isjson);
-
-				if (isjson && json_is_object(json_config))
-					json_decref(json_config);
+		if (listening && pfds[0].revents) {
+			if (pfds[0].revents & (POLLERR | POLLNVAL)) {
+				applog(LOG_ERR, "API failed (listen socket error)%s (%d)", UNAVAILABLE, (int)*apisock);
+				goto die;
 			}
+			api_accept(*apisock, false, conns, &nconns);
 		}
-		CLOSESOCKET(c);
+		if (listening && base > 1 && pfds[1].revents && nconns < API_CLIENTS)
+			api_accept(metrics_sock, true, conns, &nconns);
 	}
 die:
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
 	 * macro that gets confused by a label existing immediately before it
 	 */
 	;
+	for (i = 0; i < nconns; i++)
+		api_conn_free(conns[i]);
+
+	// Let the reply to a quit or restart get out before we act on it
+	for (i = 0; i < API_DRAIN_MS / 10 && atomic_load(&api_inflight) > 0; i++)
+		cgsleep_ms(10);
+
 	pthread_cleanup_pop(true);
 
 	free(apisock);
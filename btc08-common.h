@@ -4,17 +4,107 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <linux/spi/spidev.h>
 
-/********** work queue */
-struct work_ent {
-	struct work *work;
-	struct list_head head;
+/********** single producer / single consumer ring */
+/*
+ * Lock-free as long as exactly one thread pushes and one thread pops.
+ * head and tail run freely and are masked on access, so the ring holds
+ * up to (1 << order) fixed-size elements.
+ */
+struct spsc_ring {
+	unsigned int mask;
+	size_t elem_size;
+	uint8_t *slots;
+	atomic_uint head;	/* written by the producer only */
+	atomic_uint tail;	/* written by the consumer only */
 };
 
-struct work_queue {
-	int num_elems;
-	struct list_head head;
-};
+static inline bool spsc_ring_init(struct spsc_ring *ring, unsigned int order, size_t elem_size)
+{
+	ring->mask = (1U << order) - 1;
+	ring->elem_size = elem_size;
+	ring->slots = calloc(ring->mask + 1, elem_size);
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return ring->slots != NULL;
+}
+
+static inline void spsc_ring_free(struct spsc_ring *ring)
+{
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+static inline unsigned int spsc_ring_count(struct spsc_ring *ring)
+{
+	return atomic_load_explicit(&ring->head, memory_order_acquire) -
+	       atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+static inline bool spsc_ring_full(struct spsc_ring *ring)
+{
+	return spsc_ring_count(ring) > ring->mask;
+}
+
+static inline bool spsc_ring_push(struct spsc_ring *ring, const void *elem)
+{
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail > ring->mask)
+		return false;
+	memcpy(ring->slots + (head & ring->mask) * ring->elem_size, elem, ring->elem_size);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+static inline bool spsc_ring_pop(struct spsc_ring *ring, void *elem)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+	memcpy(elem, ring->slots + (tail & ring->mask) * ring->elem_size, ring->elem_size);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+/********** seqlock */
+/*
+ * One writer publishes a small struct, readers copy it out and retry if
+ * the sequence moved (or was odd, i.e. mid-update) while they copied.
+ */
+static inline void seq_write_begin(atomic_uint *seq)
+{
+	atomic_fetch_add_explicit(seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void seq_write_end(atomic_uint *seq)
+{
+	atomic_fetch_add_explicit(seq, 1, memory_order_release);
+}
+
+static inline unsigned int seq_read_begin(atomic_uint *seq)
+{
+	unsigned int start;
+
+	while ((start = atomic_load_explicit(seq, memory_order_acquire)) & 1)
+		sched_yield();
+	return start;
+}
+
+static inline bool seq_read_retry(atomic_uint *seq, unsigned int start)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
 
 // Used for a bytes align
 #define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
@@ -39,6 +129,22 @@ struct work_queue {
 
 #define MAX_JOB_FIFO			4
 
+/********** work queue */
+/*
+ * Backlog of works waiting for the chip FIFO. It is a fixed ring inside
+ * btc08_chain, so queueing a work never touches the allocator.
+ */
+#define WORK_QUEUE_DEPTH		(MAX_JOB_FIFO*10)
+#define WORK_QUEUE_ORDER		6
+_Static_assert((1 << WORK_QUEUE_ORDER) >= WORK_QUEUE_DEPTH,
+	       "work queue ring too small for WORK_QUEUE_DEPTH");
+
+struct work_queue {
+	int num_elems;
+	unsigned int head;	/* slot of the oldest work */
+	struct work *slots[1 << WORK_QUEUE_ORDER];
+};
+
 #define CMD_CHIP_ID_LEN			2
 #define BCAST_CHIP_ID			0
 
@@ -149,10 +255,10 @@ enum BTC08_command {
 
 struct btc08_chip {
 	int num_cores;
-	/* stats */
-	int hw_errors;
+	/* stats, nonce counts bumped by the verifier threads */
+	atomic_int hw_errors;
 	int stales;
-	int nonces_found;
+	atomic_int nonces_found;
 	int nonce_ranges_done;
 	int hash_depth;
 	int rev;
@@ -161,6 +267,22 @@ struct btc08_chip {
 	uint32_t start_nonce;
 	uint32_t end_nonce;
 
+	/* adaptive nonce range, jobs timed from the READ_JOB_ID polls */
+	double weight;		/* share of the nonce space, perf until measured */
+	double rate_mhs;	/* hash rate over the jobs timed last window */
+	uint8_t oon_job_id;	/* last job the chip reported done */
+	uint64_t done_ns;	/* poll that saw oon_job_id first */
+	uint64_t done_gap_ns;	/* since the poll before, the error of done_ns */
+	uint64_t busy_ns;	/* summed duration of the timed jobs */
+	int timed_jobs;
+	int last_nonces_found;
+	int last_hw_errors;
+
+	/* PLL autotune */
+	int tune_max_mhz;	/* lowered each time the chip errs at a clock */
+	int tune_mhz;		/* next clock, 0 if it stays */
+	int tune_clean_windows;	/* consecutive error free windows */
+
 	/* systime in ms when chip was disabled */
 	int cooldown_begin;
 	/* number of consecutive failures to access the chip */
@@ -169,6 +291,51 @@ struct btc08_chip {
 	bool disabled;
 };
 
+/********** SPI thread to miner thread results */
+enum btc08_result_type {
+	BTC08_RES_NONCE,	/* GN result of a job still owned by the chain */
+	BTC08_RES_OON,		/* nonce ranges finished */
+	BTC08_RES_DONE,		/* chain dropped the work, miner thread frees it */
+};
+
+struct btc08_result {
+	enum btc08_result_type type;
+	struct work *work;
+	uint32_t nonce[ASIC_BOOST_CORE_NUM];
+	uint8_t chip_id;
+	uint8_t job_id;
+	uint8_t micro_job_id;
+	int nonce_ranges;
+};
+
+/********** cached board sensors, published by the monitor thread */
+struct btc08_sensors {
+	int mvolt;
+	int high_temp_val;
+	int high_temp_id;
+};
+
+/* what the API and metrics see of the SPI thread's state */
+struct btc08_chip_stats {
+	uint32_t start_nonce;
+	uint32_t end_nonce;
+	double rate_mhs;
+	uint64_t mhz;
+	int stales;
+	bool disabled;
+};
+
+struct btc08_stats {
+	int num_chips;
+	int last_chip;
+	int soft_flushes;
+	int hard_flushes;
+	int flush_last_ms;
+	int flush_max_ms;
+	double flush_avg_ms;
+	int nonce_rebalances;
+};
+
 struct btc08_chain {
 	int chain_id;
 	struct cgpu_info *cgpu;
@@ -183,10 +350,25 @@ struct btc08_chain {
 	uint8_t spi_rx[MAX_CMD_LENGTH+2];	// 2 for response
 	uint8_t *spi_tx_a;
 	uint8_t *spi_rx_a;
+	int num_batch_slots;
 	struct spi_ioc_transfer *xfr;
+	/* prebuilt job frames in the mmap'd TX buffer, see init_job_slot() */
+	uint8_t *job_target;
+	uint8_t *job_run;
+	struct spi_ioc_transfer job_xfr[3];	/* WRITE_PARM, WRITE_TARGET, RUN_JOB */
+	struct spi_ioc_transfer job_xfr_nt[2];	/* WRITE_PARM, RUN_JOB */
 	struct spi_ctx *spi_ctx;
 	struct btc08_chip *chips;
-	pthread_mutex_t lock;
+
+	/* SPI thread owns the spidev and everything below up to the stats */
+	struct thr_info spi_thr;
+	struct spsc_ring work_ring;	/* struct work *, miner -> SPI thread */
+	struct spsc_ring result_ring;	/* struct btc08_result, SPI -> miner thread */
+	cgsem_t result_ready;
+	atomic_bool spi_starved;
+	atomic_bool flush_req;
+	atomic_bool failed;
+	atomic_int verify_hw_errors;	/* verifier -> miner thread */
 
 	struct work_queue active_wq;
 	struct work *work[JOB_ID_NUM_MASK+1];
@@ -197,22 +379,48 @@ struct btc08_chain {
 
 	/* mark chain disabled, do not try to re-enable it */
 	bool disabled;
-	int temp[MAX_CHAIN_LEN];
-	int high_temp_val;
-	float high_temp_val_f;
-	int high_temp_id;
-	int last_temp_time;
 	int pinnum_gpio_gn;
 	int pinnum_gpio_oon;
 	int pinnum_gpio_reset;
 	int fd_gpio_gn;
 	int fd_gpio_oon;
+	int fd_wakeup;
 	int volt_ch;
-	int mvolt;
-	float volt_f;
+
+	/* monitor thread */
+	struct thr_info monitor_thr;
+	cgsem_t monitor_wake;
+	int fd_volt;
+	int fd_temp;
+	atomic_uint sensors_seq;
+	struct btc08_sensors sensors;	/* read with read_sensors() */
+
 	int last_chip;
 	int timeout_oon;
 	cgtimer_t oon_begin;
+
+	/* flush accounting, latency is flush request to first fresh job */
+	int soft_flushes;
+	int hard_flushes;
+	bool flush_pending;
+	atomic_uint_fast64_t flush_begin_ns;	/* miner thread -> SPI thread */
+	int flush_last_ms;
+	int flush_max_ms;
+	int64_t flush_total_ms;
+	int flush_samples;
+
+	/* adaptive nonce range, owned by the SPI thread */
+	uint64_t job_sent_ns[JOB_ID_NUM_MASK+1];
+	uint64_t last_poll_ns;
+	int rebalance_oons;
+	bool tune_drain;	/* FIFO left to drain for a PLL relock */
+	int nonce_rebalances;
+
+	/* published by the SPI thread, read with read_stats() */
+	cgtimer_t stats_begin;
+	atomic_uint stats_seq;
+	struct btc08_stats stats;
+	struct btc08_chip_stats *chip_stats;
 };
 
 struct btc08_board {
@@ -233,6 +441,10 @@ struct btc08_config_options {
 	int test_mode;
 	int num_chips;
 	int num_cores;
+	/* per-chip PLL autotune, enabled if autotune_max_mhz is set */
+	int autotune_min_mhz;
+	int autotune_max_mhz;
+	int autotune_max_temp;
 };
 
 /* global configuration instance */
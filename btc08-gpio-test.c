@@ -0,0 +1,177 @@
+/*
+ * Test of the BTC08 GN/OON waits against btc08_gpio_sim stand-in pins
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* An injector thread plays the chips and raises GN and OON while the test
+ * loops on btc08_gpio_pending() like the SPI thread's service_chain(): the
+ * wait has to return on the edge, the raised pin is reported exactly once and
+ * the other pin not at all. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "miner.h"
+#include "btc08-gpio.h"
+
+/* the parts of cgminer btc08-gpio.c uses */
+bool opt_debug;
+bool opt_log_output;
+bool use_syslog;
+int opt_log_level = LOG_ERR;
+
+void _applog(int prio, const char *str, bool __maybe_unused force)
+{
+	fprintf(stderr, "%d: %s\n", prio, str);
+}
+
+void cgsleep_ms(int ms)
+{
+	usleep(ms * 1000);
+}
+
+#define WAIT_MS		100
+#define INJECT_MS	20
+#define ROUNDS		50
+
+static int failures;
+
+#define check(cond, fmt, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+		failures++; \
+	} \
+} while (0)
+
+struct injector {
+	int fd;
+	int delay_ms;
+	int rounds;
+};
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *inject_thread(void *userdata)
+{
+	struct injector *inj = userdata;
+
+	for (int i = 0; i < inj->rounds; i++) {
+		usleep(inj->delay_ms * 1000);
+		btc08_gpio_sim_raise(inj->fd);
+	}
+	return NULL;
+}
+
+static int pending(int fd_gn, int fd_oon, int fd_wakeup, int timeout_ms)
+{
+	return btc08_gpio_pending(fd_gn, 0, fd_oon, 0, fd_wakeup, timeout_ms);
+}
+
+/* service one injected edge on fd as service_chain() would */
+static void wait_edge(int fd_gn, int fd_oon, int fd_wakeup, bool gn)
+{
+	int64_t start = now_ms(), elapsed;
+	int pins;
+
+	do {
+		pins = pending(fd_gn, fd_oon, fd_wakeup, WAIT_MS);
+		elapsed = now_ms() - start;
+	} while (!pins && elapsed < WAIT_MS * 2);
+
+	check(elapsed < WAIT_MS, "%s edge took %dms", gn ? "GN" : "OON", (int)elapsed);
+	check(pins == (gn ? BTC08_PIN_GN : BTC08_PIN_OON), "pins %d", pins);
+
+	/* reading the level acked the edge */
+	check(btc08_gpio_irq_value(fd_gn, 0) == 1, "GN not acked");
+	check(btc08_gpio_irq_value(fd_oon, 0) == 1, "OON not acked");
+}
+
+static void test_edges(int fd_gn, int fd_oon, int fd_wakeup, bool gn)
+{
+	struct injector inj = { gn ? fd_gn : fd_oon, INJECT_MS, ROUNDS };
+	pthread_t pth;
+
+	if (pthread_create(&pth, NULL, inject_thread, &inj)) {
+		check(0, "injector thread create failed");
+		return;
+	}
+	for (int i = 0; i < ROUNDS; i++)
+		wait_edge(fd_gn, fd_oon, fd_wakeup, gn);
+	pthread_join(pth, NULL);
+}
+
+int main(void)
+{
+	int fd_gn, fd_oon, fd_wakeup;
+	int64_t start, elapsed;
+	int pins;
+
+	btc08_gpio_sim = true;
+	fd_gn = btc08_gpio_open_irq(0);
+	fd_oon = btc08_gpio_open_irq(0);
+	fd_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (fd_gn < 0 || fd_oon < 0 || fd_wakeup < 0) {
+		fprintf(stderr, "FAIL: no eventfd stand-in pins\n");
+		return 1;
+	}
+
+	check(btc08_gpio_irq_value(fd_gn, 0) == 1, "idle GN reads low");
+	check(btc08_gpio_irq_value(fd_oon, 0) == 1, "idle OON reads low");
+
+	/* nothing raised, the wait runs into its timeout */
+	start = now_ms();
+	pins = pending(fd_gn, fd_oon, fd_wakeup, INJECT_MS);
+	elapsed = now_ms() - start;
+	check(!pins, "idle wait reported pins %d", pins);
+	check(elapsed >= INJECT_MS - 2, "idle wait returned after %dms", (int)elapsed);
+
+	test_edges(fd_gn, fd_oon, fd_wakeup, true);
+	test_edges(fd_gn, fd_oon, fd_wakeup, false);
+
+	/* GN and OON together are both serviced in one pass, without a wait */
+	btc08_gpio_sim_raise(fd_gn);
+	btc08_gpio_sim_raise(fd_oon);
+	start = now_ms();
+	pins = pending(fd_gn, fd_oon, fd_wakeup, WAIT_MS);
+	elapsed = now_ms() - start;
+	check(pins == (BTC08_PIN_GN | BTC08_PIN_OON), "GN+OON pins %d", pins);
+	check(elapsed < WAIT_MS / 2, "GN+OON took %dms", (int)elapsed);
+
+	/* a kick on the wakeup fd ends the wait without asserting a pin */
+	btc08_signal_eventfd(fd_wakeup);
+	start = now_ms();
+	pins = pending(fd_gn, fd_oon, fd_wakeup, WAIT_MS);
+	elapsed = now_ms() - start;
+	check(!pins, "wakeup reported pins %d", pins);
+	check(elapsed < WAIT_MS / 2, "wakeup took %dms", (int)elapsed);
+	check(btc08_gpio_irq_value(fd_gn, 0) == 1, "wakeup asserted GN");
+	check(btc08_gpio_irq_value(fd_oon, 0) == 1, "wakeup asserted OON");
+
+	close(fd_gn);
+	close(fd_oon);
+	close(fd_wakeup);
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("btc08 gpio sim: all checks passed\n");
+	return 0;
+}
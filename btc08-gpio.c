@@ -0,0 +1,194 @@
+/*
+ * GPIO and GN/OON interrupt handling for BTC08 chains
+ *
+ * Copyright 2018 Jinyong, Lee <justin@nexell.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "miner.h"
+#include "btc08-gpio.h"
+
+#define GPIO_IRQ_EDGE			"falling"
+#define GPIO_IRQ_MAX_WAIT_MS	100
+
+bool btc08_gpio_sim;
+
+int32_t btc08_gpio_get_value(int pin)
+{
+	int fd;
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "/sys/class/gpio/gpio%d/value", pin);
+
+	fd = open(buf, O_RDONLY);
+	if (0 > fd)
+	{
+		applog(LOG_ERR, "gpio%d: Failed to open", pin);
+		return -1;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	if (0 > read(fd, buf, sizeof(buf)))
+	{
+		close(fd);
+		applog(LOG_ERR, "gpio%d: Failed to read", pin);
+		return -1;
+	}
+
+	close(fd);
+
+	return atoi(buf);
+}
+
+void btc08_signal_eventfd(int fd)
+{
+	uint64_t one = 1;
+
+	if (0 > write(fd, &one, sizeof(one)))
+		applog(LOG_ERR, "eventfd%d: Failed to signal", fd);
+}
+
+void btc08_wait_eventfd(int fd, int timeout_ms)
+{
+	struct pollfd pfd;
+	uint64_t cnt;
+
+	if (0 > fd)
+	{
+		cgsleep_ms(1);
+		return;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN))
+		read(fd, &cnt, sizeof(cnt));
+}
+
+void btc08_gpio_sim_raise(int fd)
+{
+	btc08_signal_eventfd(fd);
+}
+
+int btc08_gpio_open_irq(int pin)
+{
+	int fd;
+	char buf[64];
+
+	if (btc08_gpio_sim)
+		return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	snprintf(buf, sizeof(buf), "/sys/class/gpio/gpio%d/edge", pin);
+
+	fd = open(buf, O_WRONLY);
+	if (0 > fd)
+	{
+		applog(LOG_ERR, "gpio%d: Failed to open edge", pin);
+		return -1;
+	}
+
+	if (0 > write(fd, GPIO_IRQ_EDGE, strlen(GPIO_IRQ_EDGE)))
+	{
+		close(fd);
+		applog(LOG_ERR, "gpio%d: Failed to set %s edge", pin, GPIO_IRQ_EDGE);
+		return -1;
+	}
+	close(fd);
+
+	snprintf(buf, sizeof(buf), "/sys/class/gpio/gpio%d/value", pin);
+
+	fd = open(buf, O_RDONLY | O_CLOEXEC);
+	if (0 > fd)
+		applog(LOG_ERR, "gpio%d: Failed to open", pin);
+
+	return fd;
+}
+
+/* falls back to a sysfs reopen without a persistent fd */
+int32_t btc08_gpio_irq_value(int fd, int pin)
+{
+	char buf[8];
+	uint64_t cnt;
+
+	if (0 > fd)
+		return btc08_gpio_get_value(pin);
+
+	/* a pending stand-in edge reads as an asserted (low) pin */
+	if (btc08_gpio_sim)
+		return (read(fd, &cnt, sizeof(cnt)) == sizeof(cnt)) ? 0 : 1;
+
+	memset(buf, 0, sizeof(buf));
+	lseek(fd, 0, SEEK_SET);
+	if (0 > read(fd, buf, sizeof(buf) - 1))
+	{
+		applog(LOG_ERR, "gpio%d: Failed to read", pin);
+		return -1;
+	}
+
+	return atoi(buf);
+}
+
+void btc08_gpio_wait_irq(int fd_gn, int fd_oon, int fd_wakeup, int timeout_ms)
+{
+	struct pollfd pfd[3];
+	short events = btc08_gpio_sim ? POLLIN : (POLLPRI | POLLERR);
+	uint64_t cnt;
+
+	if ((0 > fd_gn) || (0 > fd_oon))
+	{
+		/* no edge support, poll the levels at a bounded rate */
+		cgsleep_ms(1);
+		return;
+	}
+
+	if (timeout_ms > GPIO_IRQ_MAX_WAIT_MS)
+		timeout_ms = GPIO_IRQ_MAX_WAIT_MS;
+	if (timeout_ms < 0)
+		timeout_ms = 0;
+
+	pfd[0].fd = fd_gn;
+	pfd[0].events = events;
+	pfd[1].fd = fd_oon;
+	pfd[1].events = events;
+	pfd[2].fd = fd_wakeup;
+	pfd[2].events = POLLIN;
+
+	if (poll(pfd, (0 > fd_wakeup) ? 2 : 3, timeout_ms) > 0 &&
+	    (pfd[2].revents & POLLIN))
+		read(fd_wakeup, &cnt, sizeof(cnt));
+}
+
+int btc08_gpio_pending(int fd_gn, int pin_gn, int fd_oon, int pin_oon,
+		       int fd_wakeup, int timeout_ms)
+{
+	int gn_level, oon_level, pins = 0;
+
+	gn_level  = btc08_gpio_irq_value(fd_gn,  pin_gn);
+	oon_level = btc08_gpio_irq_value(fd_oon, pin_oon);
+	if ((0 != gn_level) && (0 != oon_level))
+	{
+		btc08_gpio_wait_irq(fd_gn, fd_oon, fd_wakeup, timeout_ms);
+		return 0;
+	}
+
+	if (0 == gn_level)
+		pins |= BTC08_PIN_GN;
+	if (0 == oon_level)
+		pins |= BTC08_PIN_OON;
+
+	return pins;
+}
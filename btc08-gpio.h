@@ -0,0 +1,43 @@
+#ifndef BTC08_GPIO_H
+#define BTC08_GPIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/********** BTC08 GPIO and GN/OON interrupt handling */
+/*
+ * GN and OON are active low. Once an input GPIO has an edge configured its
+ * sysfs value node raises POLLPRI on that edge, so each chain keeps both
+ * nodes open and sleeps in poll() instead of reopening them in a loop.
+ * Reading the node acks the pending edge.
+ *
+ * btc08-gpio-test sets btc08_gpio_sim to back every pin with an eventfd
+ * instead, and btc08_gpio_sim_raise() stands in for the chip pulling the
+ * line low.
+ */
+
+/* pins btc08_gpio_pending() found asserted */
+#define BTC08_PIN_GN	(1 << 0)
+#define BTC08_PIN_OON	(1 << 1)
+
+extern bool btc08_gpio_sim;
+
+/* read a pin level through sysfs, -1 on error */
+int32_t btc08_gpio_get_value(int pin);
+/* open a pin for edge waits, -1 if edges are unavailable */
+int btc08_gpio_open_irq(int pin);
+/* read pin level through the fd of btc08_gpio_open_irq(), acking its edge */
+int32_t btc08_gpio_irq_value(int fd, int pin);
+/* block until either pin fires, fd_wakeup is signalled or timeout_ms elapses */
+void btc08_gpio_wait_irq(int fd_gn, int fd_oon, int fd_wakeup, int timeout_ms);
+/* BTC08_PIN_* of the asserted pins, or 0 after waiting up to timeout_ms for
+ * an edge when neither was */
+int btc08_gpio_pending(int fd_gn, int pin_gn, int fd_oon, int pin_oon,
+		       int fd_wakeup, int timeout_ms);
+void btc08_signal_eventfd(int fd);
+/* block until fd is signalled or timeout_ms elapses, consuming the signal */
+void btc08_wait_eventfd(int fd, int timeout_ms);
+/* assert a btc08_gpio_sim stand-in pin as if the chip pulled it low */
+void btc08_gpio_sim_raise(int fd);
+
+#endif /* BTC08_GPIO_H */
@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <signal.h>
 #include <limits.h>
+#include <stdatomic.h>
 
 #ifdef USE_USBUTILS
 #include <semaphore.h>
@@ -60,6 +61,13 @@ char *curly = ":D";
 #include "compat.h"
 #include "miner.h"
 #include "bench_block.h"
+#include "trace.h"
+#ifdef USE_STRATUM_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#endif
 #ifdef USE_USBUTILS
 #include "usbutils.h"
 #endif
@@ -222,8 +230,11 @@ bool opt_noadl;
 char *opt_api_allow = NULL;
 char *opt_api_groups;
 char *opt_api_description = PACKAGE_STRING;
+int opt_api_metrics_port;
 int opt_api_port = 4028;
+int opt_api_snapshot = 1000;
 char *opt_api_host = API_LISTEN_ADDR;
+char *opt_trace_file = "cgminer.trace";
 bool opt_api_listen;
 bool opt_api_mcast;
 char *opt_api_mcast_addr = API_MCAST_ADDR;
@@ -292,6 +303,10 @@ char *opt_btc08_min_chips = NULL;
 char *opt_btc08_chiptest = NULL;
 char *opt_btc08_test = NULL;
 bool opt_btc08_dump;
+bool opt_btc08_hard_flush;
+char *opt_btc08_autotune = NULL;
+char *opt_btc08_pll_profile = NULL;
+char *opt_btc08_temp_sensor = NULL;
 #endif
 #ifdef USE_BITMINE_A1
 char *opt_bitmine_a1_options = NULL;
@@ -427,16 +442,18 @@ int hw_errors;
 int64_t total_accepted, total_rejected, total_diff1;
 int64_t total_getworks, total_stale, total_discarded;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
-static int staged_rollable;
-unsigned int new_blocks;
-static unsigned int work_block;
+/* Counters touched while generating or staging work are atomic so that work
+ * generation never needs the control_lock */
+atomic_uint new_blocks;
+static atomic_uint work_block;
 unsigned int found_blocks;
 
-unsigned int local_work;
+atomic_uint local_work;
 unsigned int total_go, total_ro;
 
 struct pool **pools;
-static struct pool *currentpool = NULL;
+/* Only changed under the control_lock but read locklessly */
+static struct pool *_Atomic currentpool = NULL;
 
 int total_pools, enabled_pools;
 enum pool_strategy pool_strategy = POOL_FAILOVER;
@@ -482,6 +499,13 @@ struct stratum_share {
 	int id;
 	time_t sshare_time;
 	time_t sshare_sent;
+
+	/* Submission state while waiting to be sent */
+	struct list_head list;
+	char *submit;
+	int submit_len;
+	time_t retry_time;
+	struct timeval tv_queued;
 };
 
 static struct stratum_share *stratum_shares = NULL;
@@ -508,8 +532,29 @@ struct sigaction termhandler, inthandler, abrthandler;
 
 struct thread_q *getq;
 
-static uint32_t total_work;
-struct work *staged_work = NULL;
+static atomic_uint_fast64_t total_work;
+
+/* Staged work waits in one of two FIFOs, in the order it was staged, under
+ * stgd_lock. hash_pop prefers the non-rollable one so rollable masters stay
+ * staged for roll_work to clone from. Each list keeps its work in buckets of
+ * one pool, block and stratum job, which all go stale together, so a purge
+ * checks and splices out a bucket at a time. */
+struct staged_bucket {
+	struct list_head list;		/* in staged_list.buckets, oldest first */
+	struct list_head works;
+	struct pool *pool;
+	unsigned int work_block;
+	char *job_id;			/* only compared, the works hold the refs */
+	int count;
+};
+
+struct staged_list {
+	struct list_head buckets;
+	int count;
+};
+
+static struct staged_list staged_roll = { LIST_HEAD_INIT(staged_roll.buckets), 0 };
+static struct staged_list staged_noroll = { LIST_HEAD_INIT(staged_noroll.buckets), 0 };
 
 struct schedtime {
 	bool enable;
@@ -646,6 +691,72 @@ struct cgpu_info *get_devices(int id)
 	return cgpu;
 }
 
+/* Time from a work reaching a device to each nonce found on it, and of each
+ * SPI transfer, exported on the metrics port */
+struct lat_hist work_nonce_latency;
+struct lat_hist spi_xfer_latency;
+
+/* Folds the share counters of every device and pool shard into their own
+ * and the total stats. Anything reading those calls this first, otherwise
+ * they lag by up to one hashmeter log interval. */
+void fold_stats(void)
+{
+	int i;
+
+	mutex_lock(&stats_lock);
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_devices(i);
+		struct stats_shard *shard = &cgpu->shard;
+		int accepted = atomic_exchange(&shard->accepted, 0);
+		int rejected = atomic_exchange(&shard->rejected, 0);
+		int stale = atomic_exchange(&shard->stale, 0);
+		int hw = atomic_exchange(&shard->hw_errors, 0);
+		double diff1 = atomic_exchange(&shard->diff1, 0.0);
+		double diff_accepted = atomic_exchange(&shard->diff_accepted, 0.0);
+		double diff_rejected = atomic_exchange(&shard->diff_rejected, 0.0);
+		double diff_stale = atomic_exchange(&shard->diff_stale, 0.0);
+
+		cgpu->accepted += accepted;
+		cgpu->rejected += rejected;
+		cgpu->hw_errors += hw;
+		cgpu->diff1 += diff1;
+		cgpu->diff_accepted += diff_accepted;
+		cgpu->diff_rejected += diff_rejected;
+		total_accepted += accepted;
+		total_rejected += rejected;
+		total_stale += stale;
+		hw_errors += hw;
+		total_diff1 += diff1;
+		total_diff_accepted += diff_accepted;
+		total_diff_rejected += diff_rejected;
+		total_diff_stale += diff_stale;
+	}
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		struct stats_shard *shard = &pool->shard;
+
+		pool->accepted += atomic_exchange(&shard->accepted, 0);
+		pool->rejected += atomic_exchange(&shard->rejected, 0);
+		pool->stale_shares += atomic_exchange(&shard->stale, 0);
+		pool->diff1 += atomic_exchange(&shard->diff1, 0.0);
+		pool->diff_accepted += atomic_exchange(&shard->diff_accepted, 0.0);
+		pool->diff_rejected += atomic_exchange(&shard->diff_rejected, 0.0);
+		pool->diff_stale += atomic_exchange(&shard->diff_stale, 0.0);
+	}
+	mutex_unlock(&stats_lock);
+}
+
+static void add_stale_share(const struct work *work)
+{
+	struct cgpu_info *cgpu = get_thr_cgpu(work->thr_id);
+	struct pool *pool = work->pool;
+
+	cgpu->shard.stale++;
+	shard_add_diff(&cgpu->shard.diff_stale, work->work_difficulty);
+	pool->shard.stale++;
+	shard_add_diff(&pool->shard.diff_stale, work->work_difficulty);
+}
+
 static void sharelog(const char*disposition, const struct work*work)
 {
 	char *target, *hash, *data;
@@ -820,13 +931,7 @@ bool pool_tclear(struct pool *pool, bool *var)
 
 struct pool *current_pool(void)
 {
-	struct pool *pool;
-
-	cg_rlock(&control_lock);
-	pool = currentpool;
-	cg_runlock(&control_lock);
-
-	return pool;
+	return atomic_load_explicit(&currentpool, memory_order_acquire);
 }
 
 char *set_int_range(const char *arg, int *i, int min, int max)
@@ -1314,12 +1419,18 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--api-mcast-port",
 		     set_int_1_to_65535, opt_show_intval, &opt_api_mcast_port,
 		     "API Multicast listen port"),
+	OPT_WITH_ARG("--api-metrics-port",
+		     set_int_1_to_65535, opt_show_intval, &opt_api_metrics_port,
+		     "Port for a Prometheus /metrics HTTP endpoint, default: disabled"),
 	OPT_WITHOUT_ARG("--api-network",
 			opt_set_bool, &opt_api_network,
 			"Allow API (if enabled) to listen on/for any address, default: only 127.0.0.1"),
 	OPT_WITH_ARG("--api-port",
 		     set_int_1_to_65535, opt_show_intval, &opt_api_port,
 		     "Port number of miner API"),
+	OPT_WITH_ARG("--api-snapshot",
+		     set_int_0_to_9999, opt_show_intval, &opt_api_snapshot,
+		     "Milliseconds between API stats snapshots, 0 to always read live stats"),
 	OPT_WITH_ARG("--api-host",
 		     opt_set_charp, NULL, &opt_api_host,
 		     "Specify API listen address, default: 0.0.0.0"),
@@ -1649,6 +1760,18 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--btc08-dump",
 			opt_set_bool, &opt_btc08_dump,
 			"Verbose dump of btc08 spi protocol"),
+	OPT_WITHOUT_ARG("--btc08-hard-flush",
+			opt_set_bool, &opt_btc08_hard_flush,
+			"Reset, re-clock and BIST BTC08 chains on every work flush"),
+	OPT_WITH_ARG("--btc08-autotune",
+			opt_set_charp, NULL, &opt_btc08_autotune,
+			"Tune BTC08 PLL per chip min_mhz:max_mhz:max_temp (0 for default)"),
+	OPT_WITH_ARG("--btc08-pll-profile",
+			opt_set_charp, NULL, &opt_btc08_pll_profile,
+			"File keeping the tuned BTC08 PLL of each chip across restarts"),
+	OPT_WITH_ARG("--btc08-temp-sensor",
+			opt_set_charp, NULL, &opt_btc08_temp_sensor,
+			"Sysfs file with the BTC08 board temperature in millidegrees C, %d is replaced by the chain id"),
 	OPT_WITH_ARG("--btc08-test",
 			opt_set_charp, NULL, &opt_btc08_test,
 			"Set the number of chips and cores to be used num_chips:num_cores"),
@@ -2096,6 +2219,9 @@ static struct opt_table opt_config_table[] = {
 			opt_hidden
 #endif
 	),
+	OPT_WITH_ARG("--trace-file",
+		     opt_set_charp, opt_show_charp, &opt_trace_file,
+		     "File the API trace command writes the pipeline event trace to"),
 	OPT_WITH_ARG("--url|-o",
 		     set_url, NULL, &opt_set_null,
 		     "URL for bitcoin JSON-RPC server"),
@@ -2119,6 +2245,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--verbose",
 			opt_set_bool, &opt_log_output,
 			"Log verbose output to stderr as well as status output"),
+	OPT_WITH_ARG("--verify-threads",
+		     set_int_0_to_10, opt_show_intval, &opt_verify_threads,
+		     "Number of share verification threads, 0 verifies on the device threads"),
 	OPT_WITHOUT_ARG("--widescreen",
 			opt_set_bool, &opt_widescreen,
 			"Use extra wide display without toggling"),
@@ -2390,6 +2519,44 @@ char *display_devs(int *ndevs)
 }
 #endif
 
+#define SHA256_BENCH_HASHES 400000
+
+static char *opt_sha256_bench_and_exit(void __maybe_unused *arg)
+{
+	unsigned char swap[SHA256_MB_LANES][80], hashes[SHA256_MB_LANES][32];
+	const unsigned char *msg[SHA256_MB_LANES];
+	unsigned char *digest[SHA256_MB_LANES];
+	struct timeval tv_start, tv_end;
+	unsigned char hash1[32];
+	double scalar, mb;
+	int i;
+
+	for (i = 0; i < SHA256_MB_LANES; i++) {
+		hex2bin(swap[i], bench_hidiffs[i], 80);
+		msg[i] = swap[i];
+		digest[i] = hashes[i];
+	}
+
+	cgtime(&tv_start);
+	for (i = 0; i < SHA256_BENCH_HASHES; i++) {
+		sha256(swap[i % SHA256_MB_LANES], 80, hash1);
+		sha256(hash1, 32, hashes[i % SHA256_MB_LANES]);
+	}
+	cgtime(&tv_end);
+	scalar = SHA256_BENCH_HASHES / tdiff(&tv_end, &tv_start);
+
+	cgtime(&tv_start);
+	for (i = 0; i < SHA256_BENCH_HASHES; i += SHA256_MB_LANES)
+		sha256d_80_mb(msg, digest, SHA256_MB_LANES);
+	cgtime(&tv_end);
+	mb = SHA256_BENCH_HASHES / tdiff(&tv_end, &tv_start);
+
+	printf("Double SHA-256 of 80 byte headers: scalar %.0f/s, %d lanes %.0f/s (%.2fx)\n",
+	       scalar, SHA256_MB_LANES, mb, mb / scalar);
+	fflush(stdout);
+	exit(0);
+}
+
 /* These options are available from commandline only */
 static struct opt_table opt_cmdline_table[] = {
 	OPT_WITH_ARG("--config|-c",
@@ -2408,79 +2575,183 @@ static struct opt_table opt_cmdline_table[] = {
 			display_devs, &nDevs,
 			"Display all USB devices and exit"),
 #endif
+	OPT_WITHOUT_ARG("--sha256-bench",
+			opt_sha256_bench_and_exit, NULL,
+			"Run the SHA-256 benchmark then exit"),
 	OPT_WITHOUT_ARG("--version|-V",
 			opt_version_and_exit, packagename,
 			"Display version and exit"),
 	OPT_ENDTABLE
 };
 
+/* With a vmask the three ASICBoost midstates are compressed in the same
+ * multi-buffer pass as the base one */
 static void calc_midstate(struct pool *pool, struct work *work)
 {
-	unsigned char data[64];
-	uint32_t *data32 = (uint32_t *)data;
-	sha256_ctx ctx;
+	static const int vmask_ids[4] = {2, 4, 8, 0};
+	unsigned char *midstates[4] = {work->midstate1, work->midstate2,
+				       work->midstate3, work->midstate};
+	unsigned char data[4][64];
+	const unsigned char *blocks[4];
+	uint32_t state[4][8];
+	int i, first = 3;
+
+	/* This would only be set if the driver requested a vmask and the pool
+	 * has a valid version mask. */
+	if (pool->vmask)
+		first = 0;
+	for (i = first; i < 4; i++) {
+		if (pool->vmask)
+			memcpy(work->data, &(pool->vmask_001[vmask_ids[i]]), 4);
+		flip64(data[i], work->data);
+		cg_memcpy(state[i], sha256_h0, 32);
+		blocks[i] = data[i];
+	}
+	sha256_transf_mb(&state[first], &blocks[first], 4 - first);
+	for (i = first; i < 4; i++) {
+		cg_memcpy(midstates[i], state[i], 32);
+		endian_flip32(midstates[i], midstates[i]);
+	}
+}
+
+/* Returns the current value of total_work and increments it. Work ids only
+ * keep the low 32 bits, which drivers and the queued work hashtables key on. */
+static uint32_t total_work_inc(void)
+{
+	return atomic_fetch_add_explicit(&total_work, 1, memory_order_relaxed);
+}
+
+/* Retired work structs are kept for reuse in a small per thread cache backed
+ * by a capped global free list. Work is typically made by one thread and
+ * freed by another so the caches trade batches of WORK_CACHE_BATCH through
+ * the global list. Cached work has already been cleaned so it is zeroed bar
+ * the list head used to chain it. */
+#define WORK_CACHE_SIZE 32
+#define WORK_CACHE_BATCH (WORK_CACHE_SIZE / 2)
+#define WORK_POOL_MAX 4096
+
+struct work_cache {
+	struct list_head works;
+	int count;
+};
 
-	if (pool->vmask) {
-		/* This would only be set if the driver requested a vmask and
-		 * the pool has a valid version mask. */
-		memcpy(work->data, &(pool->vmask_001[2]), 4);
-		flip64(data32, work->data);
-		sha256_init(&ctx);
-		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate1, ctx.h, 32);
-		endian_flip32(work->midstate1, work->midstate1);
-
-		memcpy(work->data, &(pool->vmask_001[4]), 4);
-		flip64(data32, work->data);
-		sha256_init(&ctx);
-		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate2, ctx.h, 32);
-		endian_flip32(work->midstate2, work->midstate2);
-
-		memcpy(work->data, &(pool->vmask_001[8]), 4);
-		flip64(data32, work->data);
-		sha256_init(&ctx);
-		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate3, ctx.h, 32);
-		endian_flip32(work->midstate3, work->midstate3);
-
-		memcpy(work->data, &(pool->vmask_001[0]), 4);
-	}
-	flip64(data32, work->data);
-	sha256_init(&ctx);
-	sha256_update(&ctx, data, 64);
-	cg_memcpy(work->midstate, ctx.h, 32);
-	endian_flip32(work->midstate, work->midstate);
-}
-
-/* Returns the current value of total_work and increments it */
-static int total_work_inc(void)
+static pthread_key_t work_cache_key;
+static pthread_once_t work_cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t work_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(work_pool);
+static int work_pool_count;
+
+_Atomic uint64_t work_pool_hits, work_pool_misses;
+
+/* Return a departing thread's cached work to the global list */
+static void work_cache_flush(void *arg)
 {
-	int ret;
+	struct work_cache *cache = arg;
+	struct work *work, *tmp;
 
-	cg_wlock(&control_lock);
-	ret = total_work++;
-	cg_wunlock(&control_lock);
+	mutex_lock(&work_pool_lock);
+	list_for_each_entry_safe(work, tmp, &cache->works, list) {
+		list_del(&work->list);
+		if (work_pool_count < WORK_POOL_MAX) {
+			list_add(&work->list, &work_pool);
+			work_pool_count++;
+		} else
+			free(work);
+	}
+	mutex_unlock(&work_pool_lock);
+	free(cache);
+}
 
-	return ret;
+static void work_cache_key_init(void)
+{
+	if (unlikely(pthread_key_create(&work_cache_key, work_cache_flush)))
+		quit(1, "Failed to pthread_key_create in work_cache_key_init");
+}
+
+static struct work_cache *work_cache_get(void)
+{
+	struct work_cache *cache;
+
+	pthread_once(&work_cache_once, work_cache_key_init);
+	cache = pthread_getspecific(work_cache_key);
+	if (unlikely(!cache)) {
+		cache = cgcalloc(1, sizeof(struct work_cache));
+		INIT_LIST_HEAD(&cache->works);
+		pthread_setspecific(work_cache_key, cache);
+	}
+	return cache;
+}
+
+static struct work *alloc_work(void)
+{
+	struct work_cache *cache = work_cache_get();
+	struct work *work;
+
+	if (!cache->count) {
+		mutex_lock(&work_pool_lock);
+		while (work_pool_count && cache->count < WORK_CACHE_BATCH) {
+			work = list_entry(work_pool.next, struct work, list);
+			list_move(&work->list, &cache->works);
+			work_pool_count--;
+			cache->count++;
+		}
+		mutex_unlock(&work_pool_lock);
+	}
+	if (unlikely(!cache->count)) {
+		atomic_fetch_add_explicit(&work_pool_misses, 1, memory_order_relaxed);
+		return cgcalloc(1, sizeof(struct work));
+	}
+	atomic_fetch_add_explicit(&work_pool_hits, 1, memory_order_relaxed);
+	work = list_entry(cache->works.next, struct work, list);
+	list_del(&work->list);
+	cache->count--;
+	memset(&work->list, 0, sizeof(work->list));
+	return work;
+}
+
+/* Takes an already cleaned work struct */
+static void release_work(struct work *work)
+{
+	struct work_cache *cache = work_cache_get();
+
+	if (cache->count >= WORK_CACHE_SIZE) {
+		mutex_lock(&work_pool_lock);
+		while (cache->count > WORK_CACHE_SIZE - WORK_CACHE_BATCH) {
+			struct work *old = list_entry(cache->works.prev, struct work, list);
+
+			list_del(&old->list);
+			cache->count--;
+			if (work_pool_count < WORK_POOL_MAX) {
+				list_add(&old->list, &work_pool);
+				work_pool_count++;
+			} else
+				free(old);
+		}
+		mutex_unlock(&work_pool_lock);
+	}
+	list_add(&work->list, &cache->works);
+	cache->count++;
 }
 
 static struct work *make_work(void)
 {
-	struct work *work = cgcalloc(1, sizeof(struct work));
+	struct work *work = alloc_work();
 
 	work->id = total_work_inc();
+	work->trace_id = work->id;
 	return work;
 }
 
 /* This is the central place all work that is about to be retired should be
- * cleaned to remove any dynamically allocated arrays within the struct */
+ * cleaned to remove any dynamically allocated arrays within the struct. The
+ * job_id, nonce1 and ntime strings are refcounted and usually shared with the
+ * pool and other work from the same notify. */
 void clean_work(struct work *work)
 {
-	free(work->job_id);
-	free(work->ntime);
+	rcstr_put(work->job_id);
+	rcstr_put(work->ntime);
 	free(work->coinbase);
-	free(work->nonce1);
+	rcstr_put(work->nonce1);
 	memset(work, 0, sizeof(struct work));
 }
 
@@ -2498,7 +2769,7 @@ void _free_work(struct work **workptr, const char *file, const char *func, const
 	}
 
 	clean_work(work);
-	free(work);
+	release_work(work);
 	*workptr = NULL;
 }
 
@@ -2604,7 +2875,7 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	work->gbt_txns = pool->gbt_txns + 1;
 
 	if (pool->gbt_workid)
-		work->job_id = strdup(pool->gbt_workid);
+		work->job_id = rcstr_new(pool->gbt_workid);
 	cg_runlock(&pool->gbt_lock);
 
 	flip32(work->data + 4 + 32, merkleroot);
@@ -2621,12 +2892,12 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	}
 
 	calc_midstate(pool, work);
-	local_work++;
+	atomic_fetch_add_explicit(&local_work, 1, memory_order_relaxed);
 	work->pool = pool;
 	work->gbt = true;
 	work->longpoll = false;
 	work->getwork_mode = GETWORK_MODE_GBT;
-	work->work_block = work_block;
+	work->work_block = atomic_load_explicit(&work_block, memory_order_relaxed);
 	/* Nominally allow a driver to ntime roll 60 seconds */
 	work->drv_rolllimit = 60;
 	calc_diff(work, 0);
@@ -3149,7 +3420,7 @@ void decay_time(double *f, double fadd, double fsecs, double interval)
 
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return staged_roll.count + staged_noroll.count;
 }
 #if defined(HAVE_LIBCURL) || defined(HAVE_CURSES)
 static int total_staged(void)
@@ -3352,10 +3623,10 @@ static void curses_print_status(void)
 			     " ST: %d  SS: %"PRId64"  NB: %d  LW: %d  GF: %d  RF: %d",
 			     total_diff_accepted, total_diff_rejected, hw_errors,
 			     total_diff1 / total_secs * 60,
-			     total_staged(), total_stale, new_blocks, local_work, total_go, total_ro);
+			     total_staged(), total_stale, atomic_load(&new_blocks), atomic_load(&local_work), total_go, total_ro);
 	} else if (alt_status) {
 		cg_mvwprintw(statuswin, 3, 0, " ST: %d  SS: %"PRId64"  NB: %d  LW: %d  GF: %d  RF: %d",
-			     total_staged(), total_stale, new_blocks, local_work, total_go, total_ro);
+			     total_staged(), total_stale, atomic_load(&new_blocks), atomic_load(&local_work), total_go, total_ro);
 	} else {
 		cg_mvwprintw(statuswin, 3, 0, " A:%.0f  R:%.0f  HW:%d  WU:%.1f/m",
 			     total_diff_accepted, total_diff_rejected, hw_errors,
@@ -3680,14 +3951,10 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 	cgpu = get_thr_cgpu(work->thr_id);
 
 	if (json_is_true(res) || (work->gbt && json_is_null(res))) {
-		mutex_lock(&stats_lock);
-		cgpu->accepted++;
-		total_accepted++;
-		pool->accepted++;
-		cgpu->diff_accepted += work->work_difficulty;
-		total_diff_accepted += work->work_difficulty;
-		pool->diff_accepted += work->work_difficulty;
-		mutex_unlock(&stats_lock);
+		cgpu->shard.accepted++;
+		shard_add_diff(&cgpu->shard.diff_accepted, work->work_difficulty);
+		pool->shard.accepted++;
+		shard_add_diff(&pool->shard.diff_accepted, work->work_difficulty);
 
 		pool->seq_rejects = 0;
 		cgpu->last_share_pool = pool->pool_no;
@@ -3705,6 +3972,8 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 				       hashshow, cgpu->drv->name, cgpu->device_id, resubmit ? "(resubmit)" : "", worktime);
 		}
 		sharelog("accept", work);
+		if (opt_shares)
+			fold_stats();
 		if (opt_shares && total_diff_accepted >= opt_shares) {
 			applog(LOG_WARNING, "Successfully mined %d accepted shares as requested and exiting.", opt_shares);
 			kill_work();
@@ -3725,15 +3994,11 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		if (unlikely(work->block))
 			restart_threads();
 	} else {
-		mutex_lock(&stats_lock);
-		cgpu->rejected++;
-		total_rejected++;
-		pool->rejected++;
-		cgpu->diff_rejected += work->work_difficulty;
-		total_diff_rejected += work->work_difficulty;
-		pool->diff_rejected += work->work_difficulty;
+		cgpu->shard.rejected++;
+		shard_add_diff(&cgpu->shard.diff_rejected, work->work_difficulty);
+		pool->shard.rejected++;
+		shard_add_diff(&pool->shard.diff_rejected, work->work_difficulty);
 		pool->seq_rejects++;
-		mutex_unlock(&stats_lock);
 
 		applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
 		if (!QUIET) {
@@ -4563,6 +4828,7 @@ void app_restart(void)
 	}
 #endif
 
+	log_flush();
 	execv(initial_args[0], (EXECV_2ND_ARG_TYPE)initial_args);
 	applog(LOG_WARNING, "Failed to restart application");
 }
@@ -4583,7 +4849,8 @@ static void _stage_work(struct work *work);
 	WORK = NULL; \
 } while (0)
 
-/* Adjust an existing char ntime field with a relative noffset */
+/* Adjust an existing char ntime field with a relative noffset. The string
+ * must not be shared with any other work. */
 static void modify_ntime(char *ntime, int noffset)
 {
 	unsigned char bin[4];
@@ -4604,13 +4871,15 @@ void roll_work(struct work *work)
 	ntime = be32toh(*work_ntime);
 	ntime++;
 	*work_ntime = htobe32(ntime);
-	local_work++;
+	atomic_fetch_add_explicit(&local_work, 1, memory_order_relaxed);
 	work->rolls++;
 	work->nonce = 0;
 	applog(LOG_DEBUG, "Successfully rolled work");
 	/* Change the ntime field if this is stratum work */
-	if (work->ntime)
+	if (work->ntime) {
+		work->ntime = rcstr_unshare(work->ntime);
 		modify_ntime(work->ntime, 1);
+	}
 
 	/* This is now a different work item so it needs a different ID for the
 	 * hashtable */
@@ -4626,14 +4895,16 @@ void roll_work_ntime(struct work *work, int noffset)
 	ntime = be32toh(*work_ntime);
 	ntime += noffset;
 	*work_ntime = htobe32(ntime);
-	local_work++;
+	atomic_fetch_add_explicit(&local_work, 1, memory_order_relaxed);
 	work->rolls += noffset;
 	work->nonce = 0;
 	applog(LOG_DEBUG, "Successfully rolled work");
 
 	/* Change the ntime field if this is stratum work */
-	if (work->ntime)
+	if (work->ntime) {
+		work->ntime = rcstr_unshare(work->ntime);
 		modify_ntime(work->ntime, noffset);
+	}
 
 	/* This is now a different work item so it needs a different ID for the
 	 * hashtable */
@@ -4770,12 +5041,7 @@ static void *submit_work_thread(void *userdata)
 		if (stale_work(work, true)) {
 			applog(LOG_NOTICE, "Pool %d share became stale while retrying submit, discarding", pool->pool_no);
 
-			mutex_lock(&stats_lock);
-			total_stale++;
-			pool->stale_shares++;
-			total_diff_stale += work->work_difficulty;
-			pool->diff_stale += work->work_difficulty;
-			mutex_unlock(&stats_lock);
+			add_stale_share(work);
 
 			free_work(work);
 			break;
@@ -4832,22 +5098,25 @@ static void *submit_work_thread(void __maybe_unused *userdata)
 }
 #endif /* HAVE_LIBCURL */
 
-/* Return an adjusted ntime if we're submitting work that a device has
- * internally offset the ntime. */
+/* Return an adjusted refcounted ntime if we're submitting work that a device
+ * has internally offset the ntime. */
 static char *offset_ntime(const char *ntime, int noffset)
 {
 	unsigned char bin[4];
 	uint32_t h32, *be32 = (uint32_t *)bin;
+	char hex[9];
 
 	hex2bin(bin, ntime, 4);
 	h32 = be32toh(*be32) + noffset;
 	*be32 = htobe32(h32);
+	__bin2hex(hex, bin, 4);
 
-	return bin2hex(bin, 4);
+	return rcstr_new(hex);
 }
 
-/* Duplicates any dynamically allocated arrays within the work struct to
- * prevent a copied work struct from freeing ram belonging to another struct */
+/* Duplicates any dynamically allocated arrays within the work struct, or takes
+ * a reference to refcounted ones, to prevent a copied work struct from
+ * freeing ram belonging to another struct */
 static void _copy_work(struct work *work, const struct work *base_work, int noffset)
 {
 	uint32_t id = work->id;
@@ -4857,10 +5126,8 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
-	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
-	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
+	work->job_id = rcstr_get(base_work->job_id);
+	work->nonce1 = rcstr_get(base_work->nonce1);
 	if (base_work->ntime) {
 		/* If we are passed an noffset the binary work->data ntime and
 		 * the work->ntime hex string need to be adjusted. */
@@ -4872,7 +5139,7 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 			*work_ntime = htobe32(ntime);
 			work->ntime = offset_ntime(base_work->ntime, noffset);
 		} else
-			work->ntime = strdup(base_work->ntime);
+			work->ntime = rcstr_get(base_work->ntime);
 	} else if (noffset) {
 		uint32_t *work_ntime = (uint32_t *)(work->data + 68);
 		uint32_t ntime = be32toh(*work_ntime);
@@ -4890,8 +5157,11 @@ void set_work_ntime(struct work *work, int ntime)
 
 	*work_ntime = htobe32(ntime);
 	if (work->ntime) {
-		free(work->ntime);
-		work->ntime = bin2hex((unsigned char *)work_ntime, 4);
+		char hex[9];
+
+		__bin2hex(hex, (unsigned char *)work_ntime, 4);
+		rcstr_put(work->ntime);
+		work->ntime = rcstr_new(hex);
 	}
 }
 
@@ -4920,30 +5190,14 @@ void pool_died(struct pool *pool)
 	}
 }
 
-static bool stale_work(struct work *work, bool share)
+/* Staleness that all work of one block and stratum job shares */
+static bool stale_job(struct pool *pool, unsigned int block, const char *job_id, bool share)
 {
-	struct timeval now;
-	time_t work_expiry;
-	struct pool *pool;
-
-	if (opt_benchmark || opt_benchfile)
-		return false;
-
-	if (work->work_block != work_block) {
+	if (block != atomic_load_explicit(&work_block, memory_order_relaxed)) {
 		applog(LOG_DEBUG, "Work stale due to block mismatch");
 		return true;
 	}
 
-	/* Technically the rolltime should be correct but some pools
-	 * advertise a broken expire= that is lower than a meaningful
-	 * scantime */
-	if (work->rolltime > max_scantime)
-		work_expiry = work->rolltime;
-	else
-		work_expiry = max_expiry;
-
-	pool = work->pool;
-
 	if (!share && pool->has_stratum) {
 		bool same_job;
 
@@ -4955,7 +5209,7 @@ static bool stale_work(struct work *work, bool share)
 		same_job = true;
 
 		cg_rlock(&pool->data_lock);
-		if (strcmp(work->job_id, pool->swork.job_id))
+		if (strcmp(job_id, pool->swork.job_id))
 			same_job = false;
 		cg_runlock(&pool->data_lock);
 
@@ -4965,6 +5219,28 @@ static bool stale_work(struct work *work, bool share)
 		}
 	}
 
+	return false;
+}
+
+static bool stale_work(struct work *work, bool share)
+{
+	struct timeval now;
+	time_t work_expiry;
+
+	if (opt_benchmark || opt_benchfile)
+		return false;
+
+	if (stale_job(work->pool, work->work_block, work->job_id, share))
+		return true;
+
+	/* Technically the rolltime should be correct but some pools
+	 * advertise a broken expire= that is lower than a meaningful
+	 * scantime */
+	if (work->rolltime > max_scantime)
+		work_expiry = work->rolltime;
+	else
+		work_expiry = max_expiry;
+
 	if (unlikely(work_expiry < 5))
 		work_expiry = 5;
 
@@ -5018,7 +5294,34 @@ static void regen_hash(struct work *work)
 	sha256(hash1, 32, (unsigned char *)(work->hash));
 }
 
+/* Hashes count (at most SHA256_MB_LANES) headers of work that differ only in
+ * their nonce and, with ASICBoost, their micro job's version in one
+ * multi-buffer pass. Each hash has the layout of work->hash. */
+static void regen_hashes(struct work *work, const int *micro_job_ids,
+			 const uint32_t *nonces, unsigned char hashes[][32], int count)
+{
+	unsigned char swap[SHA256_MB_LANES][80];
+	const unsigned char *msg[SHA256_MB_LANES];
+	unsigned char *digest[SHA256_MB_LANES];
+	uint32_t data32[20];
+	int i;
+
+	cg_memcpy(data32, work->data, 80);
+	for (i = 0; i < count; i++) {
+		if (micro_job_ids && work->pool->vmask)
+			memcpy(data32, &(work->pool->vmask_001[micro_job_ids[i]]), 4);
+		data32[19] = htole32(nonces[i]);
+		flip80(swap[i], data32);
+		msg[i] = swap[i];
+		digest[i] = hashes[i];
+	}
+	sha256d_80_mb(msg, digest, count);
+}
+
 static bool cnx_needed(struct pool *pool);
+#ifdef USE_STRATUM_EPOLL
+static void stratum_ev_unpark(void);
+#endif
 
 /* Find the pool that currently has the highest priority */
 static struct pool *priority_pool(int choice)
@@ -5112,6 +5415,9 @@ void switch_pools(struct pool *selected)
 	mutex_lock(&lp_lock);
 	pthread_cond_broadcast(&lp_cond);
 	mutex_unlock(&lp_lock);
+#ifdef USE_STRATUM_EPOLL
+	stratum_ev_unpark();
+#endif
 }
 
 void _discard_work(struct work **workptr, const char *file, const char *func, const int line)
@@ -5143,22 +5449,115 @@ static void wake_gws(void)
 	mutex_unlock(stgd_lock);
 }
 
+static void __staged_add(struct staged_list *sl, struct work *work)
+{
+	struct staged_bucket *bucket = NULL;
+	struct list_head *pos;
+
+	/* Nearly always the newest bucket, or one of the few before it */
+	list_for_each_prev(pos, &sl->buckets) {
+		struct staged_bucket *b = list_entry(pos, struct staged_bucket, list);
+
+		if (b->pool == work->pool && b->work_block == work->work_block &&
+		    b->job_id == work->job_id) {
+			bucket = b;
+			break;
+		}
+	}
+	if (!bucket) {
+		bucket = cgmalloc(sizeof(*bucket));
+		INIT_LIST_HEAD(&bucket->works);
+		bucket->pool = work->pool;
+		bucket->work_block = work->work_block;
+		bucket->job_id = work->job_id;
+		bucket->count = 0;
+		list_add_tail(&bucket->list, &sl->buckets);
+	}
+	list_add_tail(&work->list, &bucket->works);
+	bucket->count++;
+	sl->count++;
+}
+
+/* Moves the whole bucket onto the list head, and frees the bucket */
+static int __staged_splice(struct staged_list *sl, struct staged_bucket *bucket,
+			   struct list_head *head)
+{
+	int count = bucket->count;
+
+	list_splice(&bucket->works, head);
+	list_del(&bucket->list);
+	sl->count -= count;
+	free(bucket);
+
+	return count;
+}
+
+static struct work *__staged_pop(struct staged_list *sl)
+{
+	struct staged_bucket *bucket = list_entry(sl->buckets.next, struct staged_bucket, list);
+	struct work *work = list_entry(bucket->works.next, struct work, list);
+
+	list_del(&work->list);
+	sl->count--;
+	if (!--bucket->count) {
+		list_del(&bucket->list);
+		free(bucket);
+	}
+
+	return work;
+}
+
+/* A bucket whose block or job went stale goes in one splice. Otherwise only
+ * work at its head can have expired, as each bucket is kept in the order it
+ * was staged. The stale work is moved onto the list head. */
+static int __discard_stale(struct staged_list *sl, struct list_head *head)
+{
+	struct staged_bucket *bucket, *tmp;
+	int stale = 0;
+
+	list_for_each_entry_safe(bucket, tmp, &sl->buckets, list) {
+		if (stale_job(bucket->pool, bucket->work_block, bucket->job_id, false)) {
+			stale += __staged_splice(sl, bucket, head);
+			continue;
+		}
+		while (bucket->count) {
+			struct work *work = list_entry(bucket->works.next, struct work, list);
+
+			if (!stale_work(work, false))
+				break;
+			list_move_tail(&work->list, head);
+			bucket->count--;
+			sl->count--;
+			stale++;
+		}
+		if (!bucket->count) {
+			list_del(&bucket->list);
+			free(bucket);
+		}
+	}
+
+	return stale;
+}
+
 static void discard_stale(void)
 {
 	struct work *work, *tmp;
+	LIST_HEAD(stale_works);
 	int stale = 0;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
-			discard_work(work);
-			stale++;
-		}
+	if (!opt_benchmark && !opt_benchfile) {
+		stale = __discard_stale(&staged_noroll, &stale_works);
+		stale += __discard_stale(&staged_roll, &stale_works);
 	}
 	pthread_cond_signal(&gws_cond);
 	mutex_unlock(stgd_lock);
 
+	list_for_each_entry_safe(work, tmp, &stale_works, list) {
+		list_del(&work->list);
+		discard_work(work);
+	}
+
 	if (stale)
 		applog(LOG_DEBUG, "Discarded %d stales that didn't match current hash", stale);
 }
@@ -5307,7 +5706,7 @@ static bool block_exists(const char *hexstr, const unsigned char *bedata, const
 		if (unlikely(!s))
 			quit (1, "block_exists OOM");
 		strcpy(s->hash, hexstr);
-		s->block_no = new_blocks++;
+		s->block_no = atomic_fetch_add_explicit(&new_blocks, 1, memory_order_relaxed);
 
 		ret = false;
 		/* Only keep the last hour's worth of blocks in memory since
@@ -5376,12 +5775,12 @@ static bool test_work_current(struct work *work)
 		/* Copy the information to this pool's prev_block since it
 		 * knows the new block exists. */
 		cg_memcpy(pool->prev_block, bedata, 32);
-		if (unlikely(new_blocks == 1)) {
+		if (unlikely(atomic_load_explicit(&new_blocks, memory_order_relaxed) == 1)) {
 			ret = false;
 			goto out;
 		}
 
-		work->work_block = ++work_block;
+		work->work_block = atomic_fetch_add_explicit(&work_block, 1, memory_order_relaxed) + 1;
 
 		if (work->longpoll) {
 			if (work->stratum) {
@@ -5423,7 +5822,7 @@ static bool test_work_current(struct work *work)
 			applog(LOG_DEBUG, "Pool %d still on old block", pool->pool_no);
 #endif
 		if (work->longpoll) {
-			work->work_block = ++work_block;
+			work->work_block = atomic_fetch_add_explicit(&work_block, 1, memory_order_relaxed) + 1;
 			if (shared_strategy() || work->pool == current_pool()) {
 				if (work->stratum) {
 					applog(LOG_NOTICE, "Stratum from pool %d requested work restart",
@@ -5442,11 +5841,6 @@ out:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
-{
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
-}
-
 static bool work_rollable(struct work *work)
 {
 	return (!work->clone && work->rolltime);
@@ -5457,11 +5851,8 @@ static bool hash_push(struct work *work)
 	bool rc = true;
 
 	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
 	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
+		__staged_add(work_rollable(work) ? &staged_roll : &staged_noroll, work);
 	} else
 		rc = false;
 	pthread_cond_broadcast(&getq->cond);
@@ -5473,9 +5864,11 @@ static bool hash_push(struct work *work)
 static void _stage_work(struct work *work)
 {
 	applog(LOG_DEBUG, "Pushing work from pool %d to hash queue", work->pool->pool_no);
-	work->work_block = work_block;
+	work->work_block = atomic_load_explicit(&work_block, memory_order_relaxed);
 	test_work_current(work);
 	work->pool->works++;
+	trace_event(TRACE_WORK_STAGED, work->trace_id, TRACE_NONE, TRACE_NONE,
+		    TRACE_NONE, work->pool->pool_no);
 	hash_push(work);
 }
 
@@ -5723,6 +6116,8 @@ void zero_stats(void)
 {
 	int i;
 
+	/* Drop anything still pending in the shards along with the totals */
+	fold_stats();
 	cgtime(&total_tv_start);
 	copy_time(&tv_hashmeter, &total_tv_start);
 	total_rolling = 0;
@@ -5736,7 +6131,7 @@ void zero_stats(void)
 	hw_errors = 0;
 	total_stale = 0;
 	total_discarded = 0;
-	local_work = 0;
+	atomic_store(&local_work, 0);
 	total_go = 0;
 	total_ro = 0;
 	total_secs = 1.0;
@@ -6459,6 +6854,9 @@ static void hashmeter(int thr_id, uint64_t hashes_done)
 	}
 	copy_time(&tv_hashmeter, &total_tv_end);
 
+	if (showlog)
+		fold_stats();
+
 	if (thr_id >= 0) {
 		struct thr_info *thr = get_thread(thr_id);
 		struct cgpu_info *cgpu = thr->cgpu;
@@ -6567,21 +6965,25 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 		applog(LOG_INFO, "Pool %d stratum share result lag time %d seconds",
 		       work->pool->pool_no, srdiff);
 	}
+	trace_event(json_is_true(res_val) ? TRACE_SHARE_ACCEPT : TRACE_SHARE_REJECT,
+		    work->trace_id, TRACE_NONE, TRACE_NONE, TRACE_NONE,
+		    work->pool->pool_no);
 	show_hash(work, hashshow);
 	share_result(val, res_val, err_val, work, hashshow, false, "");
 }
 
-/* Parses stratum json responses and tries to find the id that the request
- * matched to and treat it accordingly. */
-static bool parse_stratum_response(struct pool *pool, char *s)
+/* Parses stratum json responses of len bytes and tries to find the id that
+ * the request matched to and treat it accordingly. */
+static bool parse_stratum_response(struct pool *pool, char *s, size_t len)
 {
 	json_t *val = NULL, *err_val, *res_val, *id_val;
 	struct stratum_share *sshare;
+	struct timeval now;
 	json_error_t err;
 	bool ret = false;
 	int id;
 
-	val = JSON_LOADS(s, &err);
+	val = JSON_LOADB(s, len, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -6650,6 +7052,9 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 		}
 		goto out;
 	}
+	cgtime(&now);
+	lat_hist_add(&pool->cgminer_pool_stats.submit_latency,
+		     tdiff(&now, &sshare->tv_queued) * 1000000);
 	stratum_share_result(val, res_val, err_val, sshare);
 	free_work(sshare->work);
 	free(sshare);
@@ -6690,34 +7095,43 @@ void clear_stratum_shares(struct pool *pool)
 	}
 }
 
+static int __clear_pool_work(struct staged_list *sl, struct pool *pool,
+			     struct list_head *head)
+{
+	struct staged_bucket *bucket, *tmp;
+	int cleared = 0;
+
+	list_for_each_entry_safe(bucket, tmp, &sl->buckets, list) {
+		if (bucket->pool == pool)
+			cleared += __staged_splice(sl, bucket, head);
+	}
+
+	return cleared;
+}
+
 void clear_pool_work(struct pool *pool)
 {
 	struct work *work, *tmp;
-	int cleared = 0;
+	LIST_HEAD(pool_works);
+	int cleared;
 
 	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
-			free_work(work);
-			cleared++;
-		}
-	}
+	cleared = __clear_pool_work(&staged_noroll, pool, &pool_works);
+	cleared += __clear_pool_work(&staged_roll, pool, &pool_works);
 	mutex_unlock(stgd_lock);
 
+	list_for_each_entry_safe(work, tmp, &pool_works, list) {
+		list_del(&work->list);
+		free_work(work);
+	}
+
 	if (cleared)
 		applog(LOG_INFO, "Cleared %d work items due to stratum disconnect on pool %d", cleared, pool->pool_no);
 }
 
 static int cp_prio(void)
 {
-	int prio;
-
-	cg_rlock(&control_lock);
-	prio = currentpool->prio;
-	cg_runlock(&control_lock);
-
-	return prio;
+	return current_pool()->prio;
 }
 
 /* We only need to maintain a secondary pool connection when we need the
@@ -6757,6 +7171,7 @@ static bool cnx_needed(struct pool *pool)
 	return false;
 }
 
+static bool lp_waiting(struct pool *pool);
 static void wait_lpcurrent(struct pool *pool);
 static void pool_resus(struct pool *pool);
 static void gen_stratum_work(struct pool *pool, struct work *work);
@@ -6780,268 +7195,785 @@ static bool supports_resume(struct pool *pool)
 	return ret;
 }
 
-/* One stratum receive thread per pool that has stratum waits on the socket
- * checking for new messages and for the integrity of the socket connection. We
- * reset the connection based on the integrity of the receive side only as the
- * send side will eventually expire data it fails to send. */
-static void *stratum_rthread(void *userdata)
+/* Dispatches one line received from a stratum pool. The line lives in the
+ * pool sockbuf, which a handled method may have reset, so it is not looked
+ * at again once parse_method_len() recognised a method. */
+static void stratum_dispatch(struct pool *pool, char *s, size_t len)
 {
-	struct pool *pool = (struct pool *)userdata;
-	char threadname[16];
+	enum stratum_method method;
 
-	pthread_detach(pthread_self());
+	/* Check this pool hasn't died while being a backup pool and
+	 * has not had its idle flag cleared */
+	stratum_resumed(pool);
 
-	snprintf(threadname, sizeof(threadname), "%d/RStratum", pool->pool_no);
-	RenameThread(threadname);
+	method = parse_method_len(pool, s, len);
+	if (method == STRATUM_METHOD_FAILED)
+		return;
+	if (method == STRATUM_NOT_METHOD && !parse_stratum_response(pool, s, len))
+		applog(LOG_INFO, "Unknown stratum msg: %s", s);
+	else if (pool->swork.clean) {
+		struct work *work = make_work();
 
-	while (42) {
-		struct timeval timeout;
-		int sel_ret;
-		fd_set rd;
-		char *s;
+		/* Generate a single work item to update the current
+		 * block database */
+		gen_stratum_work(pool, work);
+		/* Return value doesn't matter. We're just informing
+		 * that we may need to restart. */
+		test_work_current(work);
+		free_work(work);
+	}
+}
 
-		if (unlikely(pool->removed)) {
-			suspend_stratum(pool);
-			break;
-		}
+static void stratum_interrupted(struct pool *pool)
+{
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
 
-		/* Check to see whether we need to maintain this connection
-		 * indefinitely or just bring it up when we switch to this
-		 * pool */
-		if (!sock_full(pool) && !cnx_needed(pool)) {
-			suspend_stratum(pool);
-			clear_stratum_shares(pool);
-			clear_pool_work(pool);
+	/* If the socket to our stratum pool disconnects, all
+	 * tracked submitted shares are lost and we will leak
+	 * the memory if we don't discard their records. */
+	if (!supports_resume(pool) || opt_lowmem)
+		clear_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
+}
 
-			wait_lpcurrent(pool);
-			while (!restart_stratum(pool)) {
-				pool_died(pool);
-				if (pool->removed)
-					goto out;
-				cgsleep_ms(5000);
-			}
-		}
+/* The protocol specifies that notify messages should be sent every minute
+ * so if we fail to receive any for 90 seconds we assume the connection has
+ * been dropped and treat this pool as dead */
+#define STRATUM_RECV_TIMEOUT 90
 
-		FD_ZERO(&rd);
-		FD_SET(pool->sock, &rd);
-		timeout.tv_sec = 90;
-		timeout.tv_usec = 0;
+/* Maximum number of shares sent together in one write */
+#define STRATUM_SUBMIT_BATCH 64
+/* Shares that fail to send are retried at this interval in seconds for up
+ * to STRATUM_SUBMIT_EXPIRY seconds after they were queued */
+#define STRATUM_RESUBMIT_INTERVAL 5
+#define STRATUM_SUBMIT_EXPIRY 120
 
-		/* The protocol specifies that notify messages should be sent
-		 * every minute so if we fail to receive any for 90 seconds we
-		 * assume the connection has been dropped and treat this pool
-		 * as dead */
-		if (!sock_full(pool) && (sel_ret = select(pool->sock + 1, &rd, NULL, NULL, &timeout)) < 1) {
-			applog(LOG_DEBUG, "Stratum select failed on pool %d with value %d", pool->pool_no, sel_ret);
-			s = NULL;
-		} else
-			s = recv_line(pool);
-		if (!s) {
-			applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
-
-			/* If the socket to our stratum pool disconnects, all
-			 * tracked submitted shares are lost and we will leak
-			 * the memory if we don't discard their records. */
-			if (!supports_resume(pool) || opt_lowmem)
-				clear_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
+/* Turns a work item off the stratum_q into a share with its mining.submit
+ * line formatted, or returns NULL if the work is not to be submitted */
+static struct stratum_share *prepare_stratum_share(struct pool *pool, struct work *work,
+						   uint32_t *last_nonce, uint64_t *last_nonce2)
+{
+	char noncehex[12], nonce2hex[20], s[1024];
+	struct stratum_share *sshare;
+	uint32_t *hash32, nonce;
+	unsigned char nonce2[8];
+	uint64_t *nonce2_64;
+	int len;
+
+	if (unlikely(work->nonce2_len > 8)) {
+		applog(LOG_ERR, "Pool %d asking for inappropriately long nonce2 length %d",
+		       pool->pool_no, (int)work->nonce2_len);
+		applog(LOG_ERR, "Not attempting to submit shares");
+		free_work(work);
+		return NULL;
+	}
 
-			while (!restart_stratum(pool)) {
-				pool_died(pool);
-				if (pool->removed)
-					goto out;
-				cgsleep_ms(5000);
-			}
+	nonce = *((uint32_t *)(work->data + 76));
+	nonce2_64 = (uint64_t *)nonce2;
+	*nonce2_64 = htole64(work->nonce2);
+	/* Filter out duplicate shares */
+	if (unlikely(nonce == *last_nonce && *nonce2_64 == *last_nonce2)) {
+		applog(LOG_INFO, "Filtering duplicate share to pool %d",
+		       pool->pool_no);
+		free_work(work);
+		return NULL;
+	}
+	*last_nonce = nonce;
+	*last_nonce2 = *nonce2_64;
+	__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
+	__bin2hex(nonce2hex, nonce2, work->nonce2_len);
+
+	sshare = cgcalloc(sizeof(struct stratum_share), 1);
+	hash32 = (uint32_t *)work->hash;
+
+	sshare->sshare_time = time(NULL);
+	cgtime(&sshare->tv_queued);
+	/* This work item is freed in parse_stratum_response */
+	sshare->work = work;
+
+	mutex_lock(&sshare_lock);
+	/* Give the stratum share a unique id */
+	sshare->id = swork_id++;
+	mutex_unlock(&sshare_lock);
+
+	/* Leave room for the \n line terminator */
+	if (pool->vmask) {
+		snprintf(s, sizeof(s) - 1,
+			 "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, pool->vmask_002[work->micro_job_id], sshare->id);
+	} else {
+		snprintf(s, sizeof(s) - 1,
+			"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
+	}
+	len = strlen(s);
+	s[len++] = '\n';
+	sshare->submit = cgmalloc(len);
+	cg_memcpy(sshare->submit, s, len);
+	sshare->submit_len = len;
+
+	applog(LOG_INFO, "Submitting share %08lx to pool %d",
+				(long unsigned int)htole32(hash32[6]), pool->pool_no);
+
+	return sshare;
+}
+
+static void discard_stratum_share(struct stratum_share *sshare)
+{
+	applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
+	add_stale_share(sshare->work);
+	free(sshare->submit);
+	free_work(sshare->work);
+	free(sshare);
+}
+
+/* A share that failed to send is only worth retrying if the stratum pool
+ * nonce1 still matches suggesting we may be able to resume. */
+static bool stratum_share_resumable(struct pool *pool, struct stratum_share *sshare)
+{
+	bool sessionid_match;
+
+	if (opt_lowmem) {
+		applog(LOG_DEBUG, "Lowmem option prevents resubmitting stratum share");
+		return false;
+	}
+
+	cg_rlock(&pool->data_lock);
+	sessionid_match = (pool->nonce1 && !strcmp(sshare->work->nonce1, pool->nonce1));
+	cg_runlock(&pool->data_lock);
+
+	if (!sessionid_match) {
+		applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
+		return false;
+	}
+	return true;
+}
+
+/* Prepares the works taken off the stratum_q and sends every share that is
+ * due in a single write. Shares that fail to send wait for their own retry
+ * time without holding up newer shares. Returns the ms until the earliest
+ * retry is due, or -1 if no share is waiting. */
+static int stratum_send_shares(struct pool *pool, void **works, int nworks)
+{
+	struct stratum_share *batch[STRATUM_SUBMIT_BATCH];
+	char *lines[STRATUM_SUBMIT_BATCH];
+	int lens[STRATUM_SUBMIT_BATCH];
+	struct stratum_share *sshare, *tmp;
+	time_t now, next = LONG_MAX;
+	int i, n = 0, sent;
+
+	for (i = 0; i < nworks; i++) {
+		sshare = prepare_stratum_share(pool, works[i], &pool->stratum_last_nonce,
+					       &pool->stratum_last_nonce2);
+		if (sshare)
+			list_add_tail(&sshare->list, &pool->stratum_pending);
+	}
+
+	now = time(NULL);
+	list_for_each_entry_safe(sshare, tmp, &pool->stratum_pending, list) {
+		if (n >= STRATUM_SUBMIT_BATCH)
+			break;
+		if (now >= sshare->sshare_time + STRATUM_SUBMIT_EXPIRY) {
+			list_del(&sshare->list);
+			discard_stratum_share(sshare);
 			continue;
 		}
+		if (sshare->retry_time > now)
+			continue;
+		batch[n] = sshare;
+		lines[n] = sshare->submit;
+		lens[n] = sshare->submit_len;
+		n++;
+	}
+	if (!n)
+		goto out;
 
-		/* Check this pool hasn't died while being a backup pool and
-		 * has not had its idle flag cleared */
-		stratum_resumed(pool);
+	/* Lines sent before a failure are in flight and must not be
+	 * resent with the rest of the batch */
+	sent = stratum_sendv(pool, lines, lens, n);
+	for (i = 0; i < sent; i++) {
+		int ssdiff;
+
+		sshare = batch[i];
+		list_del(&sshare->list);
+		free(sshare->submit);
+		sshare->submit = NULL;
+		sshare->sshare_sent = now;
+		trace_event(TRACE_SHARE_SUBMIT, sshare->work->trace_id,
+			    TRACE_NONE, TRACE_NONE, TRACE_NONE,
+			    pool->pool_no);
+		ssdiff = sshare->sshare_sent - sshare->sshare_time;
+		if (opt_debug || ssdiff > 0) {
+			applog(LOG_INFO, "Pool %d stratum share submission lag time %d seconds",
+			       pool->pool_no, ssdiff);
+		}
+	}
+
+	/* The shares belong to parse_stratum_response once
+	 * they are in the db so are not touched after this */
+	if (sent) {
+		mutex_lock(&sshare_lock);
+		for (i = 0; i < sent; i++) {
+			HASH_ADD_INT(stratum_shares, id, batch[i]);
+			pool->sshares++;
+		}
+		mutex_unlock(&sshare_lock);
+		applog(LOG_DEBUG, "Successfully submitted %d shares, adding to stratum_shares db", sent);
+	}
 
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		else if (pool->swork.clean) {
-			struct work *work = make_work();
+	if (likely(sent == n)) {
+		if (pool_tclear(pool, &pool->submit_fail))
+				applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
+		goto out;
+	}
 
-			/* Generate a single work item to update the current
-			 * block database */
-			gen_stratum_work(pool, work);
-			/* Return value doesn't matter. We're just informing
-			 * that we may need to restart. */
-			test_work_current(work);
-			free_work(work);
+	if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
+		applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
+		total_ro++;
+		pool->remotefail_occasions++;
+	}
+
+	for (i = sent; i < n; i++) {
+		sshare = batch[i];
+		if (stratum_share_resumable(pool, sshare))
+			sshare->retry_time = now + STRATUM_RESUBMIT_INTERVAL;
+		else {
+			list_del(&sshare->list);
+			discard_stratum_share(sshare);
 		}
-		free(s);
 	}
 
 out:
-	return NULL;
+	list_for_each_entry(sshare, &pool->stratum_pending, list) {
+		if (sshare->retry_time < next)
+			next = sshare->retry_time;
+	}
+	if (next == LONG_MAX)
+		return -1;
+	return MAX(next - time(NULL), 0) * 1000;
+}
+
+/* Discards the shares still waiting to be sent to a removed pool. The work
+ * queue is frozen but not freed in case there is work still trying to be
+ * submitted to it. */
+static void stratum_drop_shares(struct pool *pool)
+{
+	struct stratum_share *sshare, *tmp;
+
+	list_for_each_entry_safe(sshare, tmp, &pool->stratum_pending, list) {
+		list_del(&sshare->list);
+		discard_stratum_share(sshare);
+	}
+	tq_freeze(pool->stratum_q);
 }
 
+#ifndef USE_STRATUM_EPOLL
 /* Each pool has one stratum send thread for sending shares to avoid many
  * threads being created for submission since all sends need to be serialised
- * anyway. */
+ * anyway. Everything queued on the stratum_q is drained at once. */
 static void *stratum_sthread(void *userdata)
 {
 	struct pool *pool = (struct pool *)userdata;
-	uint64_t last_nonce2 = 0;
-	uint32_t last_nonce = 0;
 	char threadname[16];
+	int wait_ms = -1;
 
 	pthread_detach(pthread_self());
 
 	snprintf(threadname, sizeof(threadname), "%d/SStratum", pool->pool_no);
 	RenameThread(threadname);
 
-	pool->stratum_q = tq_new();
-	if (!pool->stratum_q)
-		quit(1, "Failed to create stratum_q in stratum_sthread");
-
 	while (42) {
-		char noncehex[12], nonce2hex[20], s[1024];
-		struct stratum_share *sshare;
-		uint32_t *hash32, nonce;
-		unsigned char nonce2[8];
-		uint64_t *nonce2_64;
-		struct work *work;
-		bool submitted;
+		void *works[STRATUM_SUBMIT_BATCH];
+		int n;
 
 		if (unlikely(pool->removed))
 			break;
 
-		work = tq_pop(pool->stratum_q);
-		if (unlikely(!work))
-			quit(1, "Stratum q returned empty work");
+		/* Wait no longer than until the earliest retry is due */
+		n = tq_pop_batch(pool->stratum_q, works, STRATUM_SUBMIT_BATCH, wait_ms);
+		wait_ms = stratum_send_shares(pool, works, n);
+	}
+
+	stratum_drop_shares(pool);
 
-		if (unlikely(work->nonce2_len > 8)) {
-			applog(LOG_ERR, "Pool %d asking for inappropriately long nonce2 length %d",
-			       pool->pool_no, (int)work->nonce2_len);
-			applog(LOG_ERR, "Not attempting to submit shares");
-			free_work(work);
-			continue;
+	return NULL;
+}
+#endif /* USE_STRATUM_EPOLL */
+
+#ifdef USE_STRATUM_EPOLL
+/* One thread receives from and sends shares to every stratum pool, waiting on
+ * all their sockets with epoll. Each pool also has a timerfd in the epoll set
+ * for its receive timeout and share retries, which is also used to prompt the
+ * thread to look at the pool, and an eventfd signalled when shares are queued
+ * on its stratum_q. We reset the connection based on the integrity of the
+ * receive side only as the send side will eventually expire data it fails to
+ * send. A pool whose socket is full is only sent to again once epoll reports
+ * it writable. Connecting is not done here: name lookup, proxy negotiation
+ * and the subscribe and authorise exchange in initiate_stratum() and
+ * auth_stratum() all block, so reconnecting a pool is handed to a thread of
+ * its own for as long as that takes and the pool is only in the epoll set
+ * while its connection is up. A pool we only connect to once we switch to it
+ * waits parked in the loop, without a thread. */
+#define STRATUM_MAX_EVENTS 16
+
+static int stratum_epfd = -1;
+static pthread_once_t stratum_ev_once = PTHREAD_ONCE_INIT;
+
+static void stratum_ev_timer_set(struct pool *pool, time_t secs, long nsecs)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = secs;
+	its.it_value.tv_nsec = nsecs;
+	timerfd_settime(pool->stratum_timerfd, 0, &its, NULL);
+}
+
+/* Makes the event loop look at the pool straight away */
+static void stratum_ev_kick(struct pool *pool)
+{
+	stratum_ev_timer_set(pool, 0, 1);
+}
+
+/* Brings the timer forward to go off within ms, never pushing it back */
+static void stratum_ev_timer_min(struct pool *pool, int ms)
+{
+	struct itimerspec its;
+
+	if (!timerfd_gettime(pool->stratum_timerfd, &its) &&
+	    (its.it_value.tv_sec || its.it_value.tv_nsec) &&
+	    its.it_value.tv_sec * 1000 + its.it_value.tv_nsec / 1000000 <= ms)
+		return;
+	if (ms)
+		stratum_ev_timer_set(pool, ms / 1000, (long)(ms % 1000) * 1000000);
+	else
+		stratum_ev_kick(pool);
+}
+
+/* Tells the event loop there are shares queued on the pool's stratum_q */
+static void stratum_ev_queued(struct pool *pool)
+{
+	uint64_t cnt = 1;
+
+	if (write(pool->stratum_sendfd, &cnt, sizeof(cnt)) < 0)
+		applog(LOG_DEBUG, "Failed to signal stratum send on pool %d", pool->pool_no);
+}
+
+/* Takes the pool socket out of the event loop. Must be called with the
+ * stratum_lock held and before the socket is closed. */
+void __stratum_ev_del(struct pool *pool)
+{
+	if (!pool->stratum_evsock)
+		return;
+	epoll_ctl(stratum_epfd, EPOLL_CTL_DEL, pool->stratum_evsock, NULL);
+	pool->stratum_evsock = 0;
+	stratum_ev_kick(pool);
+}
+
+static void stratum_ev_del(struct pool *pool)
+{
+	mutex_lock(&pool->stratum_lock);
+	__stratum_ev_del(pool);
+	mutex_unlock(&pool->stratum_lock);
+}
+
+static bool stratum_ev_registered(struct pool *pool)
+{
+	bool ret;
+
+	mutex_lock(&pool->stratum_lock);
+	ret = pool->stratum_evsock && pool->stratum_evsock == pool->sock;
+	mutex_unlock(&pool->stratum_lock);
+
+	return ret;
+}
+
+/* Puts a freshly connected pool socket into the event loop. Lines may
+ * already be waiting in the sockbuf from the handshake, which epoll won't
+ * report, so the event loop is kicked to look at the pool anyway. */
+static void stratum_ev_add(struct pool *pool)
+{
+	struct epoll_event ev;
+
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_reconnecting = false;
+	pool->stratum_wantout = false;
+	pool->stratum_last_rx = time(NULL);
+	if (pool->stratum_active && pool->sock && !pool->stratum_evsock) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &pool->sock_ev;
+		if (!epoll_ctl(stratum_epfd, EPOLL_CTL_ADD, pool->sock, &ev))
+			pool->stratum_evsock = pool->sock;
+	}
+	stratum_ev_kick(pool);
+	mutex_unlock(&pool->stratum_lock);
+}
+
+static void *stratum_reconnect_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, sizeof(threadname), "%d/CStratum", pool->pool_no);
+	RenameThread(threadname);
+
+	while (!restart_stratum(pool)) {
+		pool_died(pool);
+		if (pool->removed)
+			return NULL;
+		cgsleep_ms(5000);
+	}
+	stratum_ev_add(pool);
+
+	return NULL;
+}
+
+/* Takes the pool out of the event loop until it is connected again. An idle
+ * pool is only brought back up when we switch to it, and until then waits
+ * parked in the event loop rather than on a thread of its own. */
+static void stratum_reconnect(struct pool *pool, bool idle)
+{
+	stratum_ev_del(pool);
+	pool->stratum_reconnecting = true;
+	if (idle) {
+		suspend_stratum(pool);
+		clear_stratum_shares(pool);
+		clear_pool_work(pool);
+		pool->stratum_parked = true;
+		/* In case we switched to it meanwhile */
+		stratum_ev_kick(pool);
+		return;
+	}
+	if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_reconnect_thread, (void *)pool)))
+		quit(1, "Failed to create stratum reconnect thread");
+}
+
+/* Prompts the parked pools to check whether they are needed again, for
+ * anything that would have woken wait_lpcurrent() */
+static void stratum_ev_unpark(void)
+{
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (pool->stratum_parked && pool->stratum_timerfd >= 0)
+			stratum_ev_kick(pool);
+	}
+}
+
+/* Handles any complete lines the pool has received. Returns false if the
+ * pool connection was dealt with and needs no more attention. */
+static bool stratum_ev_lines(struct pool *pool)
+{
+	size_t len;
+	char *s;
+
+	while ((s = sockbuf_line(pool, &len))) {
+		pool->stratum_last_rx = time(NULL);
+		stratum_dispatch(pool, s, len);
+		/* A client.reconnect or a failed send closed the socket */
+		if (!stratum_ev_registered(pool)) {
+			stratum_interrupted(pool);
+			stratum_reconnect(pool, false);
+			return false;
 		}
+	}
+	return true;
+}
 
-		nonce = *((uint32_t *)(work->data + 76));
-		nonce2_64 = (uint64_t *)nonce2;
-		*nonce2_64 = htole64(work->nonce2);
-		/* Filter out duplicate shares */
-		if (unlikely(nonce == last_nonce && *nonce2_64 == last_nonce2)) {
-			applog(LOG_INFO, "Filtering duplicate share to pool %d",
-			       pool->pool_no);
-			free_work(work);
-			continue;
+static void stratum_ev_remove(struct pool *pool)
+{
+	stratum_ev_del(pool);
+	suspend_stratum(pool);
+	epoll_ctl(stratum_epfd, EPOLL_CTL_DEL, pool->stratum_timerfd, NULL);
+	close(pool->stratum_timerfd);
+	pool->stratum_timerfd = -1;
+	epoll_ctl(stratum_epfd, EPOLL_CTL_DEL, pool->stratum_sendfd, NULL);
+	close(pool->stratum_sendfd);
+	pool->stratum_sendfd = -1;
+	stratum_drop_shares(pool);
+}
+
+/* Returns whether the pool socket can take a write now. If it is full the
+ * socket is watched for EPOLLOUT until it can, and the shares stay queued. */
+static bool stratum_ev_writable(struct pool *pool)
+{
+	struct epoll_event ev;
+	struct pollfd pfd;
+	bool ret = true;
+
+	mutex_lock(&pool->stratum_lock);
+	if (!pool->stratum_evsock || pool->stratum_evsock != pool->sock)
+		goto out;
+
+	pfd.fd = pool->sock;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	ret = poll(&pfd, 1, 0) > 0;
+	if (ret == !pool->stratum_wantout)
+		goto out;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ret ? EPOLLIN : EPOLLIN | EPOLLOUT;
+	ev.data.ptr = &pool->sock_ev;
+	if (!epoll_ctl(stratum_epfd, EPOLL_CTL_MOD, pool->sock, &ev))
+		pool->stratum_wantout = !ret;
+out:
+	mutex_unlock(&pool->stratum_lock);
+
+	return ret;
+}
+
+/* Sends what is queued and due for the pool, setting the timer for the
+ * earliest share retry. Sends while the pool is reconnecting fail like any
+ * other and the shares are retried or discarded. */
+static void stratum_ev_send(struct pool *pool)
+{
+	void *works[STRATUM_SUBMIT_BATCH];
+	int n, retry_ms;
+
+	if (!stratum_ev_writable(pool))
+		return;
+
+	do {
+		n = tq_pop_batch(pool->stratum_q, works, STRATUM_SUBMIT_BATCH, 0);
+		retry_ms = stratum_send_shares(pool, works, n);
+	} while (n == STRATUM_SUBMIT_BATCH);
+
+	if (retry_ms >= 0)
+		stratum_ev_timer_min(pool, retry_ms);
+}
+
+/* Timer events only prompt a look at the pool. Whether it has timed out is
+ * judged by when it last received a line. */
+static void stratum_ev_recv(struct pool *pool, bool timer)
+{
+	time_t idle;
+
+	if (pool->stratum_parked) {
+		if (lp_waiting(pool))
+			return;
+		pool->stratum_parked = false;
+		stratum_reconnect(pool, false);
+		return;
+	}
+	if (pool->stratum_reconnecting)
+		return;
+
+	if (!stratum_ev_registered(pool)) {
+		applog(LOG_DEBUG, "Stratum socket closed on pool %d", pool->pool_no);
+		stratum_interrupted(pool);
+		stratum_reconnect(pool, false);
+		return;
+	}
+
+	if (!timer && !recv_sockbuf(pool)) {
+		stratum_interrupted(pool);
+		stratum_reconnect(pool, false);
+		return;
+	}
+	if (!stratum_ev_lines(pool))
+		return;
+
+	idle = time(NULL) - pool->stratum_last_rx;
+	if (idle >= STRATUM_RECV_TIMEOUT) {
+		applog(LOG_DEBUG, "Stratum receive timed out on pool %d", pool->pool_no);
+		stratum_interrupted(pool);
+		stratum_reconnect(pool, false);
+		return;
+	}
+	if (timer)
+		stratum_ev_timer_set(pool, STRATUM_RECV_TIMEOUT - idle, 0);
+
+	/* Check to see whether we need to maintain this connection
+	 * indefinitely or just bring it up when we switch to this pool */
+	if (!cnx_needed(pool))
+		stratum_reconnect(pool, true);
+}
+
+static void stratum_ev_pool(struct stratum_ev *ev, uint32_t events)
+{
+	struct pool *pool = ev->pool;
+
+	if (ev->type != STRATUM_EV_SOCK) {
+		int fd = ev->type == STRATUM_EV_TIMER ? pool->stratum_timerfd : pool->stratum_sendfd;
+		uint64_t cnt;
+
+		if (read(fd, &cnt, sizeof(cnt)) < 0)
+			return;
+	}
+
+	if (unlikely(pool->removed)) {
+		stratum_ev_remove(pool);
+		return;
+	}
+
+	if (ev->type == STRATUM_EV_TIMER || (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		stratum_ev_recv(pool, ev->type == STRATUM_EV_TIMER);
+	if (ev->type != STRATUM_EV_SOCK || (events & EPOLLOUT))
+		stratum_ev_send(pool);
+}
+
+static void *stratum_evthread(void __maybe_unused *userdata)
+{
+	struct epoll_event events[STRATUM_MAX_EVENTS];
+
+	pthread_detach(pthread_self());
+
+	RenameThread("RStratum");
+
+	while (42) {
+		int i, n;
+
+		n = epoll_wait(stratum_epfd, events, STRATUM_MAX_EVENTS, -1);
+		if (unlikely(n < 0)) {
+			if (interrupted())
+				continue;
+			quit(1, "Stratum epoll_wait failed");
 		}
-		last_nonce = nonce;
-		last_nonce2 = *nonce2_64;
-		__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
-		__bin2hex(nonce2hex, nonce2, work->nonce2_len);
+		for (i = 0; i < n; i++)
+			stratum_ev_pool(events[i].data.ptr, events[i].events);
+	}
 
-		sshare = cgcalloc(sizeof(struct stratum_share), 1);
-		hash32 = (uint32_t *)work->hash;
-		submitted = false;
+	return NULL;
+}
 
-		sshare->sshare_time = time(NULL);
-		/* This work item is freed in parse_stratum_response */
-		sshare->work = work;
-		memset(s, 0, 1024);
+static void stratum_ev_init(void)
+{
+	pthread_t pth;
 
-		mutex_lock(&sshare_lock);
-		/* Give the stratum share a unique id */
-		sshare->id = swork_id++;
-		mutex_unlock(&sshare_lock);
+	stratum_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(stratum_epfd < 0))
+		quit(1, "Failed to create stratum epoll");
+	if (unlikely(pthread_create(&pth, NULL, stratum_evthread, NULL)))
+		quit(1, "Failed to create stratum event thread");
+}
+
+/* Sets up the pool's event loop timer and share queue and adds its already
+ * connected and authorised socket */
+static void stratum_ev_start(struct pool *pool)
+{
+	struct epoll_event ev;
+
+	pthread_once(&stratum_ev_once, stratum_ev_init);
+
+	pool->sock_ev.pool = pool->timer_ev.pool = pool->send_ev.pool = pool;
+	pool->sock_ev.type = STRATUM_EV_SOCK;
+	pool->timer_ev.type = STRATUM_EV_TIMER;
+	pool->send_ev.type = STRATUM_EV_SEND;
+	pool->stratum_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (unlikely(pool->stratum_timerfd < 0))
+		quit(1, "Failed to create stratum timerfd for pool %d", pool->pool_no);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &pool->timer_ev;
+	if (unlikely(epoll_ctl(stratum_epfd, EPOLL_CTL_ADD, pool->stratum_timerfd, &ev)))
+		quit(1, "Failed to add stratum timerfd for pool %d", pool->pool_no);
+	pool->stratum_sendfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(pool->stratum_sendfd < 0))
+		quit(1, "Failed to create stratum eventfd for pool %d", pool->pool_no);
+	ev.data.ptr = &pool->send_ev;
+	if (unlikely(epoll_ctl(stratum_epfd, EPOLL_CTL_ADD, pool->stratum_sendfd, &ev)))
+		quit(1, "Failed to add stratum eventfd for pool %d", pool->pool_no);
+	pool->stratum_q = tq_new();
+	stratum_ev_add(pool);
+}
+#else /* USE_STRATUM_EPOLL */
+/* One stratum receive thread per pool that has stratum waits on the socket
+ * checking for new messages and for the integrity of the socket connection. We
+ * reset the connection based on the integrity of the receive side only as the
+ * send side will eventually expire data it fails to send. */
+static void *stratum_rthread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
 
-		if (pool->vmask) {
-			snprintf(s, sizeof(s),
-				 "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, pool->vmask_002[work->micro_job_id], sshare->id);
-		} else {
-			snprintf(s, sizeof(s),
-				"{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, work->ntime, noncehex, sshare->id);
-		}
-
-		applog(LOG_INFO, "Submitting share %08lx to pool %d",
-					(long unsigned int)htole32(hash32[6]), pool->pool_no);
-
-		/* Try resubmitting for up to 2 minutes if we fail to submit
-		 * once and the stratum pool nonce1 still matches suggesting
-		 * we may be able to resume. */
-		while (time(NULL) < sshare->sshare_time + 120) {
-			bool sessionid_match;
-
-			if (likely(stratum_send(pool, s, strlen(s)))) {
-				mutex_lock(&sshare_lock);
-				HASH_ADD_INT(stratum_shares, id, sshare);
-				pool->sshares++;
-				mutex_unlock(&sshare_lock);
-
-				if (pool_tclear(pool, &pool->submit_fail))
-						applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
-				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
-				submitted = true;
-				break;
-			}
-			if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
-				applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
-				total_ro++;
-				pool->remotefail_occasions++;
-			}
+	pthread_detach(pthread_self());
 
-			if (opt_lowmem) {
-				applog(LOG_DEBUG, "Lowmem option prevents resubmitting stratum share");
-				break;
-			}
+	snprintf(threadname, sizeof(threadname), "%d/RStratum", pool->pool_no);
+	RenameThread(threadname);
 
-			cg_rlock(&pool->data_lock);
-			sessionid_match = (pool->nonce1 && !strcmp(work->nonce1, pool->nonce1));
-			cg_runlock(&pool->data_lock);
+	while (42) {
+		struct timeval timeout;
+		int sel_ret;
+		size_t len;
+		fd_set rd;
+		char *s;
 
-			if (!sessionid_match) {
-				applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
-				break;
+		if (unlikely(pool->removed)) {
+			suspend_stratum(pool);
+			break;
+		}
+
+		/* Check to see whether we need to maintain this connection
+		 * indefinitely or just bring it up when we switch to this
+		 * pool */
+		if (!sock_full(pool) && !cnx_needed(pool)) {
+			suspend_stratum(pool);
+			clear_stratum_shares(pool);
+			clear_pool_work(pool);
+
+			wait_lpcurrent(pool);
+			while (!restart_stratum(pool)) {
+				pool_died(pool);
+				if (pool->removed)
+					goto out;
+				cgsleep_ms(5000);
 			}
-			/* Retry every 5 seconds */
-			sleep(5);
 		}
 
-		if (unlikely(!submitted)) {
-			applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
-			free_work(work);
-			free(sshare);
-			pool->stale_shares++;
-			total_stale++;
-		} else {
-			int ssdiff;
+		FD_ZERO(&rd);
+		FD_SET(pool->sock, &rd);
+		timeout.tv_sec = STRATUM_RECV_TIMEOUT;
+		timeout.tv_usec = 0;
+
+		if (!sock_full(pool) && (sel_ret = select(pool->sock + 1, &rd, NULL, NULL, &timeout)) < 1) {
+			applog(LOG_DEBUG, "Stratum select failed on pool %d with value %d", pool->pool_no, sel_ret);
+			s = NULL;
+		} else
+			s = recv_line_inplace(pool, &len);
+		if (!s) {
+			stratum_interrupted(pool);
 
-			sshare->sshare_sent = time(NULL);
-			ssdiff = sshare->sshare_sent - sshare->sshare_time;
-			if (opt_debug || ssdiff > 0) {
-				applog(LOG_INFO, "Pool %d stratum share submission lag time %d seconds",
-				       pool->pool_no, ssdiff);
+			while (!restart_stratum(pool)) {
+				pool_died(pool);
+				if (pool->removed)
+					goto out;
+				cgsleep_ms(5000);
 			}
+			continue;
 		}
-	}
 
-	/* Freeze the work queue but don't free up its memory in case there is
-	 * work still trying to be submitted to the removed pool. */
-	tq_freeze(pool->stratum_q);
+		stratum_dispatch(pool, s, len);
+	}
 
+out:
 	return NULL;
 }
+#endif /* USE_STRATUM_EPOLL */
 
 static void init_stratum_threads(struct pool *pool)
 {
 	have_longpoll = true;
 
+	INIT_LIST_HEAD(&pool->stratum_pending);
+#ifdef USE_STRATUM_EPOLL
+	stratum_ev_start(pool);
+#else
+	pool->stratum_q = tq_new();
 	if (unlikely(pthread_create(&pool->stratum_sthread, NULL, stratum_sthread, (void *)pool)))
 		quit(1, "Failed to create stratum sthread");
 	if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_rthread, (void *)pool)))
 		quit(1, "Failed to create stratum rthread");
+#endif
 }
 
 static void *longpoll_thread(void *userdata);
@@ -7364,11 +8296,10 @@ static bool work_emptied;
  * be handled. */
 static struct work *hash_pop(bool blocking)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	struct work *work = NULL;
 
 	mutex_lock(stgd_lock);
-	if (!HASH_COUNT(staged_work)) {
+	if (!__total_staged()) {
 		work_emptied = true;
 		if (!blocking)
 			goto out_unlock;
@@ -7387,7 +8318,7 @@ static struct work *hash_pop(bool blocking)
 				no_work = true;
 				applog(LOG_WARNING, "Waiting for work to be available from pools.");
 			}
-		} while (!HASH_COUNT(staged_work));
+		} while (!__total_staged());
 	}
 
 	if (no_work) {
@@ -7395,18 +8326,8 @@ static struct work *hash_pop(bool blocking)
 		no_work = false;
 	}
 
-	hc = HASH_COUNT(staged_work);
-	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
-		}
-	} else
-		work = staged_work;
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
+	/* Take clone work if possible, to allow masters to be reused */
+	work = __staged_pop(staged_noroll.count ? &staged_noroll : &staged_roll);
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
@@ -7504,7 +8425,7 @@ bool submit_nonce2_nonce(struct thr_info *thr, struct pool *pool, struct pool *r
 	work->sdiff = pool->sdiff;
 
 	work->thr_id = thr_id;
-	work->work_block = work_block;
+	work->work_block = atomic_load_explicit(&work_block, memory_order_relaxed);
 	work->pool->works++;
 
 	work->mined = true;
@@ -7517,30 +8438,32 @@ bool submit_nonce2_nonce(struct thr_info *thr, struct pool *pool, struct pool *r
 }
 #endif
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+/* Fills in the header and share submission fields of one stratum work item
+ * with the given nonce2. The coinbase is never written to; its hash resumes
+ * from the prefix state cached by parse_notify and only the nonce2 and the
+ * remaining tail are hashed per work. Must be called with pool->data_lock
+ * held. */
+static void __gen_stratum_work(struct pool *pool, struct work *work, uint64_t nonce2)
 {
 	unsigned char merkle_root[32], merkle_sha[64];
 	uint32_t *data32, *swap32;
+	int tail_offset, i;
 	uint64_t nonce2le;
-	int i;
-
-	cg_wlock(&pool->data_lock);
+	sha256_ctx ctx;
 
-	/* Update coinbase. Always use an LE encoded nonce2 to fill in values
-	 * from left to right and prevent overflow errors with small n2sizes */
-	nonce2le = htole64(pool->nonce2);
-	cg_memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
-	work->nonce2 = pool->nonce2++;
+	/* Always use an LE encoded nonce2 to fill in values from left to
+	 * right and prevent overflow errors with small n2sizes */
+	nonce2le = htole64(nonce2);
+	work->nonce2 = nonce2;
 	work->nonce2_len = pool->n2size;
 
-	/* Downgrade to a read lock to read off the pool variables */
-	cg_dwlock(&pool->data_lock);
-
 	/* Generate merkle root */
-	gen_hash(pool->coinbase, merkle_root, pool->coinbase_len);
+	tail_offset = pool->nonce2_offset + pool->n2size;
+	cg_memcpy(&ctx, pool->coinbase_prefix, sizeof(ctx));
+	sha256_update(&ctx, (unsigned char *)&nonce2le, pool->n2size);
+	sha256_update(&ctx, pool->coinbase + tail_offset, pool->coinbase_len - tail_offset);
+	sha256_final(&ctx, merkle_sha);
+	sha256(merkle_sha, 32, merkle_root);
 	cg_memcpy(merkle_sha, merkle_root, 32);
 	for (i = 0; i < pool->merkles; i++) {
 		cg_memcpy(merkle_sha + 32, pool->swork.merkle_bin[i], 32);
@@ -7560,41 +8483,92 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	work->sdiff = pool->sdiff;
 
 	/* Copy parameters required for share submission */
-	work->job_id = strdup(pool->swork.job_id);
-	work->nonce1 = strdup(pool->nonce1);
-	work->ntime = strdup(pool->ntime);
+	work->job_id = rcstr_get(pool->swork.work_job_id);
+	work->nonce1 = rcstr_get(pool->swork.work_nonce1);
+	work->ntime = rcstr_get(pool->swork.work_ntime);
+
+	work->notify_seq = pool->swork.notify_seq;
+	copy_time(&work->tv_notify, &pool->swork.tv_notify);
+}
+
+/* Replace a refcounted copy of a pool string if the pool's value changed */
+static void __intern_swork_str(char **interned, const char *val)
+{
+	if (*interned && val && !strcmp(*interned, val))
+		return;
+	rcstr_put(*interned);
+	*interned = rcstr_new(val);
+}
+
+/* Generates count consecutive stratum works based on the most recent notify
+ * information from the pool under one acquisition of the data_lock. This will
+ * keep generating work while a pool is down so we use other means to detect
+ * when the pool has died in stratum_thread */
+static void gen_stratum_works(struct pool *pool, struct work **works, int count)
+{
+	uint64_t nonce2;
+	int i;
+
+	/* Reserve our nonce2 range then downgrade to a read lock to read off
+	 * the pool variables */
+	cg_wlock(&pool->data_lock);
+	nonce2 = pool->nonce2;
+	pool->nonce2 += count;
+	/* Every work from the same notify shares one copy of the share
+	 * submission strings */
+	__intern_swork_str(&pool->swork.work_job_id, pool->swork.job_id);
+	__intern_swork_str(&pool->swork.work_nonce1, pool->nonce1);
+	__intern_swork_str(&pool->swork.work_ntime, pool->ntime);
+	cg_dwlock(&pool->data_lock);
+
+	for (i = 0; i < count; i++)
+		__gen_stratum_work(pool, works[i], nonce2 + i);
 	cg_runlock(&pool->data_lock);
 
-	if (opt_debug) {
-		char *header, *merkle_hash;
+	for (i = 0; i < count; i++) {
+		struct work *work = works[i];
 
-		header = bin2hex(work->data, 112);
-		merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
-		applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
-		applog(LOG_DEBUG, "Generated stratum header %s", header);
-		applog(LOG_DEBUG, "Work job_id %s nonce2 %"PRIu64" ntime %s", work->job_id,
-		       work->nonce2, work->ntime);
-		free(header);
-		free(merkle_hash);
-	}
+		if (opt_debug) {
+			char *header, *merkle_hash;
 
-	calc_midstate(pool, work);
-	set_target(work->target, work->sdiff);
+			header = bin2hex(work->data, 112);
+			merkle_hash = bin2hex(work->data + 36, 32);
+			applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
+			applog(LOG_DEBUG, "Generated stratum header %s", header);
+			applog(LOG_DEBUG, "Work job_id %s nonce2 %"PRIu64" ntime %s", work->job_id,
+			       work->nonce2, work->ntime);
+			free(header);
+			free(merkle_hash);
+		}
 
-	local_work++;
-	work->pool = pool;
-	work->stratum = true;
-	work->nonce = 0;
-	work->longpoll = false;
-	work->getwork_mode = GETWORK_MODE_STRATUM;
-	work->work_block = work_block;
-	/* Nominally allow a driver to ntime roll 60 seconds */
-	work->drv_rolllimit = 60;
-	calc_diff(work, work->sdiff);
+		calc_midstate(pool, work);
+		set_target(work->target, work->sdiff);
 
-	cgtime(&work->tv_staged);
+		atomic_fetch_add_explicit(&local_work, 1, memory_order_relaxed);
+		work->pool = pool;
+		work->stratum = true;
+		work->nonce = 0;
+		work->longpoll = false;
+		work->getwork_mode = GETWORK_MODE_STRATUM;
+		work->work_block = atomic_load_explicit(&work_block, memory_order_relaxed);
+		/* Nominally allow a driver to ntime roll 60 seconds */
+		work->drv_rolllimit = 60;
+		calc_diff(work, work->sdiff);
+
+		cgtime(&work->tv_staged);
+		trace_event(TRACE_WORK_GEN, work->trace_id, TRACE_NONE, TRACE_NONE,
+			    TRACE_NONE, work->notify_seq);
+	}
 }
 
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+	gen_stratum_works(pool, &work, 1);
+}
+
+/* Most stratum works the getwork scheduler generates per pool lock */
+#define STRATUM_WORK_BATCH 8
+
 #ifdef HAVE_LIBCURL
 static void gen_solo_work(struct pool *pool, struct work *work);
 
@@ -7703,7 +8677,7 @@ static void gen_solo_work(struct pool *pool, struct work *work)
 	work->sdiff = pool->sdiff;
 
 	/* Copy parameters required for share submission */
-	work->ntime = strdup(pool->ntime);
+	work->ntime = rcstr_new(pool->ntime);
 	cg_memcpy(work->target, pool->gbt_target, 32);
 	cg_runlock(&pool->gbt_lock);
 
@@ -7722,13 +8696,13 @@ static void gen_solo_work(struct pool *pool, struct work *work)
 
 	calc_midstate(pool, work);
 
-	local_work++;
+	atomic_fetch_add_explicit(&local_work, 1, memory_order_relaxed);
 	work->gbt = true;
 	work->pool = pool;
 	work->nonce = 0;
 	work->longpoll = false;
 	work->getwork_mode = GETWORK_MODE_SOLO;
-	work->work_block = work_block;
+	work->work_block = atomic_load_explicit(&work_block, memory_order_relaxed);
 	/* Nominally allow a driver to ntime roll 60 seconds */
 	work->drv_rolllimit = 60;
 	calc_diff(work, work->sdiff);
@@ -7795,6 +8769,28 @@ struct work *get_work(struct thr_info *thr, const int thr_id)
 	return work;
 }
 
+/* Drivers call this as they hand a work to the hardware. The first work of
+ * each stratum notify to get there accounts the pool's notify latency. */
+void work_started(struct work *work)
+{
+	struct pool *pool = work->pool;
+	unsigned int seq;
+
+	cgtime(&work->tv_work_start);
+	if (!pool || !work->notify_seq)
+		return;
+
+	seq = atomic_load_explicit(&pool->notify_job_seq, memory_order_relaxed);
+	while ((int)(work->notify_seq - seq) > 0) {
+		if (atomic_compare_exchange_weak_explicit(&pool->notify_job_seq, &seq, work->notify_seq,
+							  memory_order_relaxed, memory_order_relaxed)) {
+			lat_hist_add(&pool->cgminer_pool_stats.notify_latency,
+				     tdiff(&work->tv_work_start, &work->tv_notify) * 1000000);
+			break;
+		}
+	}
+}
+
 /* Submit a copy of the tested, statistic recorded work item asynchronously */
 static void submit_work_async(struct work *work)
 {
@@ -7805,14 +8801,10 @@ static void submit_work_async(struct work *work)
 	if (opt_benchmark) {
 		struct cgpu_info *cgpu = get_thr_cgpu(work->thr_id);
 
-		mutex_lock(&stats_lock);
-		cgpu->accepted++;
-		total_accepted++;
-		pool->accepted++;
-		cgpu->diff_accepted += work->work_difficulty;
-		total_diff_accepted += work->work_difficulty;
-		pool->diff_accepted += work->work_difficulty;
-		mutex_unlock(&stats_lock);
+		cgpu->shard.accepted++;
+		shard_add_diff(&cgpu->shard.diff_accepted, work->work_difficulty);
+		pool->shard.accepted++;
+		shard_add_diff(&pool->shard.diff_accepted, work->work_difficulty);
 
 		applog(LOG_NOTICE, "Accepted %s %d benchmark share nonce %08x",
 		       cgpu->drv->name, cgpu->device_id, *(uint32_t *)(work->data + 64 + 12));
@@ -7828,12 +8820,7 @@ static void submit_work_async(struct work *work)
 			applog(LOG_NOTICE, "Pool %d stale share detected, discarding", pool->pool_no);
 			sharelog("discard", work);
 
-			mutex_lock(&stats_lock);
-			total_stale++;
-			pool->stale_shares++;
-			total_diff_stale += work->work_difficulty;
-			pool->diff_stale += work->work_difficulty;
-			mutex_unlock(&stats_lock);
+			add_stale_share(work);
 
 			free_work(work);
 			return;
@@ -7847,6 +8834,10 @@ static void submit_work_async(struct work *work)
 			applog(LOG_DEBUG, "Discarding work from removed pool");
 			free_work(work);
 		}
+#ifdef USE_STRATUM_EPOLL
+		else
+			stratum_ev_queued(pool);
+#endif
 	} else {
 		applog(LOG_DEBUG, "Pushing submit work to work thread");
 		if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)work)))
@@ -7859,10 +8850,7 @@ void inc_hw_errors(struct thr_info *thr)
 	applog(LOG_INFO, "%s %d: invalid nonce - HW error", thr->cgpu->drv->name,
 	       thr->cgpu->device_id);
 
-	mutex_lock(&stats_lock);
-	hw_errors++;
-	thr->cgpu->hw_errors++;
-	mutex_unlock(&stats_lock);
+	thr->cgpu->shard.hw_errors++;
 
 	thr->cgpu->drv->hw_error(thr);
 }
@@ -7912,12 +8900,10 @@ static void update_work_stats(struct thr_info *thr, struct work *work)
 		applog(LOG_NOTICE, "Found block for pool %d!", work->pool->pool_no);
 	}
 
-	mutex_lock(&stats_lock);
-	total_diff1 += work->device_diff;
-	thr->cgpu->diff1 += work->device_diff;
-	work->pool->diff1 += work->device_diff;
+	shard_add_diff(&thr->cgpu->shard.diff1, work->device_diff);
+	shard_add_diff(&work->pool->shard.diff1, work->device_diff);
+	/* Only ever written by the device's own thread or its verifier */
 	thr->cgpu->last_device_valid_work = time(NULL);
-	mutex_unlock(&stats_lock);
 }
 
 /* To be used once the work has been tested to be meet diff1 and has had its
@@ -7927,6 +8913,10 @@ bool submit_tested_work(struct thr_info *thr, struct work *work)
 	struct work *work_out;
 	update_work_stats(thr, work);
 
+	cgtime(&work->tv_work_found);
+	if (work->tv_work_start.tv_sec)
+		lat_hist_add(&work_nonce_latency, tdiff(&work->tv_work_found, &work->tv_work_start) * 1000000);
+
 	if (!fulltest(work->hash, work->target)) {
 		applog(LOG_INFO, "%s %d: Share above target", thr->cgpu->drv->name,
 		       thr->cgpu->device_id);
@@ -8025,6 +9015,204 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 	return true;
 }
 
+/* Batched submit_nonce for count nonces found on one work, each from the
+ * micro job in micro_job_ids when it is not NULL. The nonces are verified in
+ * multi-buffer passes and valid[i] is set to whether nonces[i] was a valid
+ * share. Returns the number of HW errors. */
+int submit_nonces(struct thr_info *thr, struct work *work, const int *micro_job_ids,
+		  const uint32_t *nonces, bool *valid, int count)
+{
+	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+	unsigned char hashes[SHA256_MB_LANES][32];
+	int i, done, lanes, hw_errors = 0;
+
+	for (done = 0; done < count; done += lanes) {
+		lanes = MIN(count - done, SHA256_MB_LANES);
+		regen_hashes(work, micro_job_ids ? micro_job_ids + done : NULL,
+			     nonces + done, hashes, lanes);
+
+		for (i = 0; i < lanes; i++) {
+			uint32_t *hash_32 = (uint32_t *)(hashes[i] + 28);
+			int n = done + i;
+
+			valid[n] = new_nonce(thr, nonces[n]) && *hash_32 == 0;
+			if (!valid[n]) {
+				inc_hw_errors(thr);
+				hw_errors++;
+				continue;
+			}
+
+			if (micro_job_ids) {
+				work->micro_job_id = micro_job_ids[n];
+				if (work->pool->vmask)
+					memcpy(work->data, &(work->pool->vmask_001[micro_job_ids[n]]), 4);
+			}
+			*work_nonce = htole32(nonces[n]);
+			cg_memcpy(work->hash, hashes[i], 32);
+			submit_tested_work(thr, work);
+
+			if (opt_benchfile && opt_benchfile_display)
+				benchfile_dspwork(work, nonces[n]);
+		}
+	}
+
+	return hw_errors;
+}
+
+/* Share verification stage. With --verify-threads set, drivers hand their
+ * nonces to submit_nonces_async() and go straight back to their device while
+ * the hashing, stats and submission run on the verifier threads. Each one
+ * owns an intrusive MPSC queue and a device always uses the same one, which
+ * keeps a single writer for per device state like cgpu->last_nonce. */
+struct verify_req {
+	_Atomic(struct verify_req *) next;
+	struct thr_info *thr;
+	struct work *work;
+	nonce_batch_done_fn done;
+	struct nonce_batch batch;
+};
+
+struct verify_queue {
+	_Atomic(struct verify_req *) head;
+	struct verify_req *tail;
+	struct verify_req stub;
+	cgsem_t wake;
+	struct thr_info thr;
+};
+
+_Static_assert(MAX_BATCH_NONCES <= SHA256_MB_LANES,
+	       "a nonce batch must fit one multi-buffer pass");
+
+int opt_verify_threads;
+static struct verify_queue *verify_queues;
+
+static void verify_queue_push(struct verify_queue *vq, struct verify_req *req)
+{
+	struct verify_req *prev;
+
+	atomic_store_explicit(&req->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&vq->head, req, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, req, memory_order_release);
+}
+
+/* Returns NULL when empty or when a producer has not linked its request in
+ * yet, which it posts the wake semaphore for once it has */
+static struct verify_req *verify_queue_pop(struct verify_queue *vq)
+{
+	struct verify_req *tail = vq->tail, *next;
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (tail == &vq->stub) {
+		if (!next)
+			return NULL;
+		vq->tail = tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+	if (next) {
+		vq->tail = next;
+		return tail;
+	}
+	if (tail != atomic_load_explicit(&vq->head, memory_order_acquire))
+		return NULL;
+
+	/* tail is the last request, put the stub behind it to pop it */
+	verify_queue_push(vq, &vq->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		vq->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static void verify_batch(struct thr_info *thr, struct work *work,
+			 struct nonce_batch *batch, nonce_batch_done_fn done)
+{
+	submit_nonces(thr, work, batch->micro_job_ids, batch->nonces, batch->valid,
+		      batch->count);
+	if (unlikely(atomic_load_explicit(&trace_on, memory_order_relaxed))) {
+		for (int i = 0; i < batch->count; i++) {
+			if (batch->valid[i])
+				trace_event(TRACE_NONCE_OK, work->trace_id,
+					    thr->cgpu->device_id, batch->chip_id,
+					    batch->job_id, batch->nonces[i]);
+		}
+	}
+	if (done)
+		done(thr, batch);
+}
+
+static void *verify_thread(void *userdata)
+{
+	struct verify_queue *vq = (struct verify_queue *)userdata;
+	char threadname[16];
+
+	snprintf(threadname, sizeof(threadname), "Verify/%d", (int)(vq - verify_queues));
+	RenameThread(threadname);
+
+	while (42) {
+		struct verify_req *req = verify_queue_pop(vq);
+
+		if (!req) {
+			cgsem_wait(&vq->wake);
+			continue;
+		}
+		verify_batch(req->thr, req->work, &req->batch, req->done);
+		free_work(req->work);
+		free(req);
+	}
+
+	return NULL;
+}
+
+static void start_verify_threads(void)
+{
+	int i;
+
+	if (!opt_verify_threads)
+		return;
+
+	verify_queues = cgcalloc(opt_verify_threads, sizeof(*verify_queues));
+	for (i = 0; i < opt_verify_threads; i++) {
+		struct verify_queue *vq = &verify_queues[i];
+
+		atomic_init(&vq->stub.next, NULL);
+		atomic_init(&vq->head, &vq->stub);
+		vq->tail = &vq->stub;
+		cgsem_init(&vq->wake);
+		if (thr_info_create(&vq->thr, NULL, verify_thread, vq))
+			early_quit(1, "verify thread create failed");
+		pthread_detach(vq->thr.pth);
+	}
+	applog(LOG_INFO, "Started %d share verification threads", opt_verify_threads);
+}
+
+/* Verifies and submits the nonces of batch found on work, then calls done
+ * with batch->valid filled in. That happens on a verifier thread when there
+ * are any, so work is copied and the caller keeps ownership of both work and
+ * batch. */
+void submit_nonces_async(struct thr_info *thr, struct work *work,
+			 struct nonce_batch *batch, nonce_batch_done_fn done)
+{
+	struct verify_queue *vq;
+	struct verify_req *req;
+
+	if (!opt_verify_threads) {
+		verify_batch(thr, work, batch, done);
+		return;
+	}
+
+	req = cgmalloc(sizeof(*req));
+	req->thr = thr;
+	req->work = copy_work(work);
+	req->done = done;
+	cg_memcpy(&req->batch, batch, sizeof(*batch));
+
+	vq = &verify_queues[thr->cgpu->cgminer_id % opt_verify_threads];
+	verify_queue_push(vq, req);
+	cgsem_post(&vq->wake);
+}
+
 /* Allows drivers to submit work items where the driver has changed the ntime
  * value by noffset. Must be only used with a work protocol that does not ntime
  * roll itself intrinsically to generate work (eg stratum). We do not touch
@@ -8140,7 +9328,7 @@ static void hash_sole_work(struct thr_info *mythr)
 				copy_time(&pool_stats->getwork_wait_min, &getwork_start);
 			pool_stats->getwork_calls++;
 
-			cgtime(&(work->tv_work_start));
+			work_started(work);
 
 			/* Only allow the mining thread to be cancelled when
 			 * it is not in the driver code. */
@@ -8679,14 +9867,21 @@ static struct pool *select_longpoll_pool(struct pool *cp)
 }
 #endif /* HAVE_LIBCURL */
 
+/* Whether the pool is to wait till it's the current pool, or it has been
+ * flagged as rejecting, before attempting to open any connections */
+static bool lp_waiting(struct pool *pool)
+{
+	return !cnx_needed(pool) && (pool->enabled == POOL_DISABLED ||
+	       (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
+	       pool_strategy != POOL_BALANCE));
+}
+
 /* This will make the longpoll thread wait till it's the current pool, or it
  * has been flagged as rejecting, before attempting to open any connections.
  */
 static void wait_lpcurrent(struct pool *pool)
 {
-	while (!cnx_needed(pool) && (pool->enabled == POOL_DISABLED ||
-	       (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
-	       pool_strategy != POOL_BALANCE))) {
+	while (lp_waiting(pool)) {
 		mutex_lock(&lp_lock);
 		pthread_cond_wait(&lp_cond, &lp_lock);
 		mutex_unlock(&lp_lock);
@@ -9233,6 +10428,7 @@ void print_summary(void)
 	int hours, mins, secs, i;
 	double utility, displayed_hashes, work_util;
 
+	fold_stats();
 	timersub(&total_tv_end, &total_tv_start, &diff);
 	hours = diff.tv_sec / 3600;
 	mins = (diff.tv_sec % 3600) / 60;
@@ -9264,9 +10460,9 @@ void print_summary(void)
 
 	applog(LOG_WARNING, "Stale submissions discarded due to new blocks: %"PRId64, total_stale);
 	applog(LOG_WARNING, "Unable to get work from server occasions: %d", total_go);
-	applog(LOG_WARNING, "Work items generated locally: %d", local_work);
+	applog(LOG_WARNING, "Work items generated locally: %d", atomic_load(&local_work));
 	applog(LOG_WARNING, "Submitting work remotely delay occasions: %d", total_ro);
-	applog(LOG_WARNING, "New blocks detected on network: %d\n", new_blocks);
+	applog(LOG_WARNING, "New blocks detected on network: %d\n", atomic_load(&new_blocks));
 
 	if (total_pools > 1) {
 		for (i = 0; i < total_pools; i++) {
@@ -10295,6 +11491,8 @@ int main(int argc, char *argv[])
 			fork_monitor();
 	#endif // defined(unix)
 
+	start_log_writer();
+
 	if (opt_benchmark || opt_benchfile)
 		goto begin_bench;
 
@@ -10392,6 +11590,8 @@ begin_bench:
 #endif
 	}
 
+	start_verify_threads();
+
 	// Start threads
 	k = 0;
 	for (i = 0; i < total_devices; ++i) {
@@ -10532,9 +11732,20 @@ begin_bench:
 		};
 		if (pool->has_stratum) {
 			if (opt_gen_stratum_work) {
-				gen_stratum_work(pool, work);
-				applog(LOG_DEBUG, "Generated stratum work");
-				stage_work(work);
+				struct work *works[STRATUM_WORK_BATCH];
+				int i, count = 1;
+
+				/* Balanced strategies pick a pool per work item */
+				if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE)
+					count = MIN(max_staged - ts + 1, STRATUM_WORK_BATCH);
+				works[0] = work;
+				work = NULL;
+				for (i = 1; i < count; i++)
+					works[i] = make_work();
+				gen_stratum_works(pool, works, count);
+				applog(LOG_DEBUG, "Generated %d stratum work", count);
+				for (i = 0; i < count; i++)
+					stage_work(works[i]);
 			}
 			continue;
 		}
@@ -15,13 +15,18 @@
 #include <limits.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "spi-context.h"
 #include "logging.h"
 #include "miner.h"
 #include "util.h"
+#include "trace.h"
 
 #include "btc08-common.h"
+#include "btc08-gpio.h"
 
 #define GPIOA	0
 #define GPIOB	32
@@ -143,61 +148,54 @@ struct btc08_config_options btc08_config_options = {
 static struct btc08_config_options *parsed_config_options;
 
 /********** work queue */
+#define WQ_MASK		((1 << WORK_QUEUE_ORDER) - 1)
+
 static bool wq_enqueue(struct work_queue *wq, struct work *work)
 {
 	if (work == NULL)
 		return false;
-	struct work_ent *we = malloc(sizeof(*we));
-	assert(we != NULL);
+	if (wq->num_elems > WQ_MASK)
+		return false;
 
-	we->work = work;
-	INIT_LIST_HEAD(&we->head);
-	list_add_tail(&we->head, &wq->head);
+	wq->slots[(wq->head + wq->num_elems) & WQ_MASK] = work;
 	wq->num_elems++;
 	return true;
 }
 
-static struct work *wq_dequeue(struct work_queue *wq)
+static struct work *wq_peek(struct work_queue *wq)
 {
 	if (wq == NULL)
 		return NULL;
 	if (wq->num_elems == 0)
 		return NULL;
-	struct work_ent *we;
-	we = list_entry(wq->head.next, struct work_ent, head);
-	struct work *work = we->work;
+	return wq->slots[wq->head & WQ_MASK];
+}
 
-	list_del(&we->head);
-	free(we);
+static struct work *wq_dequeue(struct work_queue *wq)
+{
+	struct work *work = wq_peek(wq);
+
+	if (work == NULL)
+		return NULL;
+	wq->slots[wq->head & WQ_MASK] = NULL;
+	wq->head++;
 	wq->num_elems--;
 	return work;
 }
 
-static int32_t get_gpio_value(int pin)
+/* empty the queue in one pass, handing every work to fn oldest first */
+static void wq_drain(struct work_queue *wq,
+		     void (*fn)(struct btc08_chain *btc08, struct work *work),
+		     struct btc08_chain *btc08)
 {
-	int fd;
-	char buf[64];
-
-	snprintf(buf, sizeof(buf), "/sys/class/gpio/gpio%d/value", pin);
-
-	fd = open(buf, O_RDONLY);
-	if (0 > fd)
-	{
-		applog(LOG_ERR, "gpio%d: Failed to open", pin);
-		return -1;
-	}
+	while (wq->num_elems > 0) {
+		unsigned int slot = wq->head & WQ_MASK;
 
-	lseek(fd, 0, SEEK_SET);
-	if (0 > read(fd, buf, sizeof(buf)))
-	{
-		close(fd);
-		applog(LOG_ERR, "gpio%d: Failed to read", pin);
-		return -1;
+		fn(btc08, wq->slots[slot]);
+		wq->slots[slot] = NULL;
+		wq->head++;
+		wq->num_elems--;
 	}
-
-	close(fd);
-
-	return atoi(buf);
 }
 
 static int32_t set_gpio_value(int pin, int val)
@@ -234,6 +232,37 @@ static int32_t set_gpio_value(int pin, int val)
 	return 0;
 }
 
+/********** GN/OON interrupt handling, see btc08-gpio.h */
+static void wait_gpio_irq(struct btc08_chain *btc08, int timeout_ms)
+{
+	btc08_gpio_wait_irq(btc08->fd_gpio_gn, btc08->fd_gpio_oon,
+			    btc08->fd_wakeup, timeout_ms);
+}
+
+static void open_chain_irqs(struct btc08_chain *btc08)
+{
+	btc08->fd_gpio_gn  = btc08_gpio_open_irq(btc08->pinnum_gpio_gn);
+	btc08->fd_gpio_oon = btc08_gpio_open_irq(btc08->pinnum_gpio_oon);
+	btc08->fd_wakeup   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if ((0 > btc08->fd_gpio_gn) || (0 > btc08->fd_gpio_oon))
+		applog(LOG_WARNING, "%d: GN/OON edge IRQ unavailable, polling levels",
+				btc08->chain_id);
+}
+
+static void close_chain_irqs(struct btc08_chain *btc08)
+{
+	if (btc08->fd_gpio_gn >= 0)
+		close(btc08->fd_gpio_gn);
+	if (btc08->fd_gpio_oon >= 0)
+		close(btc08->fd_gpio_oon);
+	if (btc08->fd_wakeup >= 0)
+		close(btc08->fd_wakeup);
+	btc08->fd_gpio_gn  = -1;
+	btc08->fd_gpio_oon = -1;
+	btc08->fd_wakeup   = -1;
+}
+
 /* 0x000 : 0V
  * 0xFFF : 1.8V
  * (1.8/4096)xADC = voltage
@@ -249,30 +278,60 @@ static int32_t set_gpio_value(int pin, int val)
 #define HASH_ADC_MIN    910
 #define HASH_ADC_MAX    1365
 
-static int get_mvolt(int ch)
+static int open_adc(int ch)
 {
-	int ret = -1;
-	int fd, val = 0;
 	char adcpath[64];
+	int fd;
+
+	snprintf(adcpath, sizeof(adcpath), "/sys/bus/iio/devices/iio:device0/in_voltage%d_raw", ch);
+	fd = open(adcpath, O_RDONLY | O_CLOEXEC);
+	if (0 > fd)
+		applog(LOG_WARNING, "adc%d: Failed to open %s", ch, adcpath);
 
-	sprintf(adcpath, "/sys/bus/iio/devices/iio\\:device0/in_voltage%d_raw", ch);
-	fd = open(adcpath, O_RDONLY);
+	return fd;
+}
+
+/* sysfs attributes are ASCII and can be re-read from offset 0 */
+static bool read_sysfs_int(int fd, int *val)
+{
+	char buf[32];
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return false;
+
+	buf[len] = '\0';
+	*val = atoi(buf);
+	return true;
+}
 
-	ret = read(fd, &val, 4);
+static int get_mvolt(int ch)
+{
+	int fd, val = 0;
+	bool ret;
 
-	ret = ad2mV(val);
+	fd = open_adc(ch);
+	if (0 > fd)
+		return -1;
 
+	ret = read_sysfs_int(fd, &val);
 	close(fd);
 
-	return ret;
+	if (!ret) {
+		applog(LOG_ERR, "adc%d: Failed to read", ch);
+		return -1;
+	}
+
+	return ad2mV(val);
 }
 
 static void applog_hexdump(char *prefix, uint8_t *buff, int len, int level)
 {
-	static char line[512];
+	char line[512];
 	char *pos = line;
 	int i;
-	if (len < 1)
+	if (len < 1 || !log_enabled(level))
 	{
 		return;
 	}
@@ -303,6 +362,212 @@ static void hexdump_error(char *prefix, uint8_t *buff, int len)
 	applog_hexdump(prefix, buff, len, LOG_ERR);
 }
 
+/********** board monitor thread */
+/*
+ * Sensors are sampled every TEMP_UPDATE_INT_MS by a niced thread per
+ * chain that keeps the sysfs fds open, and published with a seqlock so
+ * the API and statline never touch hardware. BTC08 has no SPI command for
+ * die temperature, so the temperature comes from --btc08-temp-sensor.
+ */
+#define MONITOR_NICE		10
+#define SENSOR_PATH_LEN		128	/* sysfs attribute paths are far shorter */
+
+static int open_temp_sensor(int chain_id)
+{
+	const char *fmt = opt_btc08_temp_sensor;
+	char path[SENSOR_PATH_LEN];
+	const char *pos;
+	int len, fd;
+
+	if (fmt == NULL)
+		return -1;
+
+	pos = strstr(fmt, "%d");
+	if (pos != NULL)
+		len = snprintf(path, sizeof(path), "%.*s%d%s", (int)(pos - fmt), fmt, chain_id, pos + 2);
+	else
+		len = snprintf(path, sizeof(path), "%s", fmt);
+	if (len < 0 || len >= (int)sizeof(path)) {
+		applog(LOG_WARNING, "%d: temperature sensor path too long: %s", chain_id, fmt);
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (0 > fd)
+		applog(LOG_WARNING, "%d: Failed to open temperature sensor %s", chain_id, path);
+
+	return fd;
+}
+
+static void read_sensors(struct btc08_chain *btc08, struct btc08_sensors *sensors)
+{
+	unsigned int seq;
+
+	do {
+		seq = seq_read_begin(&btc08->sensors_seq);
+		*sensors = btc08->sensors;
+	} while (seq_read_retry(&btc08->sensors_seq, seq));
+}
+
+static void sample_sensors(struct btc08_chain *btc08)
+{
+	struct btc08_sensors sensors = btc08->sensors;	/* only this thread writes */
+	int val;
+
+	if (btc08->fd_volt >= 0 && read_sysfs_int(btc08->fd_volt, &val))
+		sensors.mvolt = ad2mV(val);
+
+	if (btc08->fd_temp >= 0 && read_sysfs_int(btc08->fd_temp, &val)) {
+		sensors.high_temp_val = val / 1000;
+		sensors.high_temp_id = 0;		/* board sensor, not a chip */
+	}
+
+	seq_write_begin(&btc08->sensors_seq);
+	btc08->sensors = sensors;
+	seq_write_end(&btc08->sensors_seq);
+}
+
+static void *btc08_monitor_thread(void *userdata)
+{
+	struct cgpu_info *cgpu = (struct cgpu_info *)userdata;
+	struct btc08_chain *btc08 = cgpu->device_data;
+	char threadname[16];
+
+	snprintf(threadname, sizeof(threadname), "BTC08Mon%d", btc08->chain_id);
+	RenameThread(threadname);
+
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), MONITOR_NICE))
+		applog(LOG_INFO, "%d: failed to lower monitor thread priority", btc08->chain_id);
+
+	while (likely(!cgpu->shutdown)) {
+		sample_sensors(btc08);
+		cgsem_mswait(&btc08->monitor_wake, TEMP_UPDATE_INT_MS);
+	}
+
+	return NULL;
+}
+
+/********** stats snapshot */
+/*
+ * chips[] and the flush counters belong to the SPI thread, which also
+ * wipes chips[] on a reinit. The API and metrics read a copy of them the
+ * SPI thread publishes every STATS_PUBLISH_MS, the same way as sensors.
+ */
+#define STATS_PUBLISH_MS	500
+
+static void publish_stats(struct btc08_chain *btc08)
+{
+	struct btc08_stats *stats = &btc08->stats;
+	int ii;
+
+	seq_write_begin(&btc08->stats_seq);
+	stats->num_chips = btc08->num_chips;
+	stats->last_chip = btc08->last_chip;
+	stats->soft_flushes = btc08->soft_flushes;
+	stats->hard_flushes = btc08->hard_flushes;
+	stats->flush_last_ms = btc08->flush_last_ms;
+	stats->flush_max_ms = btc08->flush_max_ms;
+	stats->flush_avg_ms = btc08->flush_samples ?
+		(double)btc08->flush_total_ms / btc08->flush_samples : 0;
+	stats->nonce_rebalances = btc08->nonce_rebalances;
+	for (ii = btc08->last_chip; ii < btc08->num_chips; ii++) {
+		struct btc08_chip_stats *cs = &btc08->chip_stats[ii];
+		struct btc08_chip *chip = &btc08->chips[ii];
+
+		cs->start_nonce = chip->start_nonce;
+		cs->end_nonce = chip->end_nonce;
+		cs->rate_mhs = chip->rate_mhs;
+		cs->mhz = chip->mhz;
+		cs->stales = chip->stales;
+		cs->disabled = chip->disabled;
+	}
+	seq_write_end(&btc08->stats_seq);
+
+	cgtimer_time(&btc08->stats_begin);
+}
+
+static void maybe_publish_stats(struct btc08_chain *btc08)
+{
+	cgtimer_t ts_now, ts_diff;
+
+	cgtimer_time(&ts_now);
+	cgtimer_sub(&ts_now, &btc08->stats_begin, &ts_diff);
+	if (cgtimer_to_ms(&ts_diff) >= STATS_PUBLISH_MS)
+		publish_stats(btc08);
+}
+
+/* chips gets the active chips at their chip index, it may be NULL */
+static void read_stats(struct btc08_chain *btc08, struct btc08_stats *stats,
+		       struct btc08_chip_stats *chips)
+{
+	unsigned int seq;
+
+	do {
+		seq = seq_read_begin(&btc08->stats_seq);
+		*stats = btc08->stats;
+		if (chips != NULL && stats->last_chip < stats->num_chips &&
+		    stats->num_chips <= MAX_CHAIN_LEN)
+			memcpy(&chips[stats->last_chip], &btc08->chip_stats[stats->last_chip],
+			       (stats->num_chips - stats->last_chip) * sizeof(*chips));
+	} while (seq_read_retry(&btc08->stats_seq, seq));
+}
+
+/* the chip-th active chip, false once past the last one */
+static bool read_chip_stats(struct btc08_chain *btc08, int chip, int *last_chip,
+			    struct btc08_chip_stats *cs)
+{
+	unsigned int seq;
+	bool found;
+	int ii;
+
+	do {
+		seq = seq_read_begin(&btc08->stats_seq);
+		*last_chip = btc08->stats.last_chip;
+		ii = *last_chip + chip;
+		found = ii < btc08->stats.num_chips && ii < MAX_CHAIN_LEN;
+		if (found)
+			*cs = btc08->chip_stats[ii];
+	} while (seq_read_retry(&btc08->stats_seq, seq));
+
+	return found;
+}
+
+/********** SPI thread / miner thread hand-over */
+/*
+ * Each chain has a thread that owns the spidev fd. btc08_queue_full()
+ * hands it works through work_ring and btc08_scanwork() gets nonces, OON
+ * and retired works back through result_ring, so the miner thread never
+ * waits on SPI. Works are only freed by the miner thread, on the
+ * BTC08_RES_DONE which follows every nonce reported for them.
+ */
+#define WORK_RING_ORDER		4		/* 16 works on their way to the SPI thread */
+#define RESULT_RING_ORDER	8
+#define SCANWORK_WAIT_MS	100
+#define SPI_IDLE_WAIT_MS	10
+/* longest an OON refill waits for fresh work, e.g. right after a flush */
+#define REFILL_WAIT_MS		1000
+
+static void push_result(struct btc08_chain *btc08, struct btc08_result *res)
+{
+	while (!spsc_ring_push(&btc08->result_ring, res)) {
+		if (btc08->cgpu->shutdown)
+			return;
+		cgsem_post(&btc08->result_ready);
+		cgsleep_ms(1);
+	}
+}
+
+/* hand a work the chain does not reference anymore back to the miner thread */
+static void retire_work(struct btc08_chain *btc08, struct work *work)
+{
+	struct btc08_result res;
+
+	memset(&res, 0, sizeof(res));
+	res.type = BTC08_RES_DONE;
+	res.work = work;
+	push_result(btc08, &res);
+}
+
 /********** temporary helper for hexdumping SPI traffic */
 static void flush_spi(struct btc08_chain *btc08)
 {
@@ -489,6 +754,79 @@ static void disable_cores(struct btc08_chain *btc08, uint8_t chip_id)
 	exec_cmd(btc08, SPI_CMD_SET_DISABLE, chip_id, disable_cores, DISABLE_LEN, 0);
 }
 
+/* one CS frame of the largest batched reply, READ_RESULT */
+#define BATCH_SLOT_LEN	ALIGN((CMD_CHIP_ID_LEN + RET_READ_RESULT_LEN + DUMMY_BYTES), 4)
+
+/*
+ * Send cmd to every chip in chip_ids[] as separate CS frames of a single
+ * SPI message, the way cmd_WRITE_JOB_fast() chains WRITE_PARM/RUN_JOB.
+ * If parms is set, frame i carries the parm_len bytes at parms + i*parm_len.
+ * The reply of chip_ids[i] is returned by batch_resp(btc08, i).
+ */
+static bool exec_cmd_batch(struct btc08_chain *btc08, uint8_t cmd,
+		uint8_t *chip_ids, int num, uint8_t *parms, int parm_len,
+		uint8_t resp_len)
+{
+	int tx_len = ALIGN((CMD_CHIP_ID_LEN + parm_len + resp_len + DUMMY_BYTES), 4);
+	struct spi_ioc_transfer *xfr = btc08->xfr;
+	bool ret;
+	int ii, jj;
+
+	if (num <= 0)
+		return true;
+	if (num > btc08->num_batch_slots || tx_len > BATCH_SLOT_LEN) {
+		applog(LOG_ERR, "%d: %s() %d frames of %d bytes exceed batch buffer",
+				btc08->chain_id, __func__, num, tx_len);
+		btc08->disabled = true;
+		return false;
+	}
+
+	for (ii = 0; ii < num; ii++) {
+		uint8_t *spi_tx = btc08->spi_tx_a + (ii * BATCH_SLOT_LEN);
+		uint8_t *spi_rx = btc08->spi_rx_a + (ii * BATCH_SLOT_LEN);
+
+		memset(spi_tx, 0, tx_len);
+		memset(spi_rx, 0xff, tx_len);
+		spi_tx[0] = cmd;
+		spi_tx[1] = chip_ids[ii];
+		if (parms != NULL)
+			memcpy(spi_tx + CMD_CHIP_ID_LEN, parms + (ii * parm_len), parm_len);
+
+		memset(&xfr[ii], 0, sizeof(xfr[ii]));
+		xfr[ii].tx_buf = (unsigned long)spi_tx;
+		xfr[ii].rx_buf = (unsigned long)spi_rx;
+		xfr[ii].len = tx_len;
+		xfr[ii].speed_hz = btc08->spi_ctx->config.speed;
+		xfr[ii].delay_usecs = btc08->spi_ctx->config.delay;
+		xfr[ii].bits_per_word = btc08->spi_ctx->config.bits;
+		xfr[ii].cs_change = 1;
+	}
+
+	ret = spi_transfer_x20_a(btc08->spi_ctx, xfr, num);
+	if(ret == false) {
+		btc08->disabled = true;
+		applog(LOG_ERR, "%d: %s() error", btc08->chain_id, __func__);
+		return false;
+	}
+	btc08->disabled = false;
+
+	for (ii = 0; ii < num; ii++) {
+		uint8_t *spi_rx = btc08->spi_rx_a + (ii * BATCH_SLOT_LEN);
+
+		for (jj = 0; jj < tx_len; jj++)
+			spi_rx[jj] ^= 0xff;
+		hexdump("batch: TX", btc08->spi_tx_a + (ii * BATCH_SLOT_LEN), tx_len);
+		hexdump("batch: RX", spi_rx, tx_len);
+	}
+
+	return true;
+}
+
+static uint8_t *batch_resp(struct btc08_chain *btc08, int idx)
+{
+	return btc08->spi_rx_a + (idx * BATCH_SLOT_LEN) + CMD_CHIP_ID_LEN;
+}
+
 /********** btc08 SPI commands */
 static uint8_t *cmd_BIST_BCAST(struct btc08_chain *btc08, uint8_t chip_id)
 {
@@ -857,93 +1195,108 @@ void calc_btc08_target(uint8_t *dest_target, uint32_t nbits)
 	hexdump("select", dest_target+4, 2);
 }
 
-static uint8_t cmd_WRITE_JOB_fast(struct btc08_chain *btc08,
-			      uint8_t job_id, uint8_t *job, struct work *work)
+/*
+ * The WRITE_TARGET and RUN_JOB frames of a job live at a fixed place of
+ * the mmap'd spidev TX buffer with their headers and dummy bytes written
+ * once, and the transfers of a job are built once per chain. WRITE_PARM
+ * goes out straight from struct work, where calc_midstate() left the
+ * midstates in frame order, so queueing a job only adds the command bytes
+ * and the 12 data bytes around them and issues one ioctl. The place is
+ * away from the start of the buffer, which set_work_test() uses.
+ */
+#define JOB_SLOT_OFFSET		2048
+#define JOB_PARM_LEN		ALIGN((CMD_CHIP_ID_LEN + WRITE_JOB_LEN + DUMMY_BYTES), 4)
+#define JOB_TARGET_LEN		ALIGN((CMD_CHIP_ID_LEN + TARGET_LEN + DUMMY_BYTES), 4)
+#define JOB_RUN_LEN		ALIGN((CMD_CHIP_ID_LEN + JOB_ID_LEN + DUMMY_BYTES), 4)
+
+/* WRITE_PARM is sent from the end of work->job_head to job_dummy */
+#define JOB_PARM_OFFSET		(offsetof(struct work, midstate) - CMD_CHIP_ID_LEN)
+
+_Static_assert(offsetof(struct work, job_data) == offsetof(struct work, midstate) + MIDSTATE_LEN &&
+	       offsetof(struct work, midstate1) == offsetof(struct work, job_data) + DATA_LEN &&
+	       offsetof(struct work, midstate2) == offsetof(struct work, midstate1) + MIDSTATE_LEN &&
+	       offsetof(struct work, midstate3) == offsetof(struct work, midstate2) + MIDSTATE_LEN &&
+	       offsetof(struct work, job_dummy) == offsetof(struct work, midstate3) + MIDSTATE_LEN,
+	       "struct work job frame must be contiguous");
+_Static_assert(WRITE_JOB_LEN == 4 * MIDSTATE_LEN + DATA_LEN &&
+	       CMD_CHIP_ID_LEN <= sizeof(((struct work *)0)->job_head) &&
+	       JOB_PARM_LEN - CMD_CHIP_ID_LEN - WRITE_JOB_LEN <= sizeof(((struct work *)0)->job_dummy),
+	       "struct work job frame too short for WRITE_PARM");
+
+static void fill_job_xfr(struct btc08_chain *btc08, struct spi_ioc_transfer *xfr,
+			 uint8_t *tx_buf, int len)
 {
-	int ii=0;
-	bool retb;
-	uint32_t nbits;
-	uint8_t btc08_target[6] = {0x00,};
-	int tx_len;
-	/* ensure we push the SPI command to the last chip in chain */
-	uint8_t *spi_tx = job;
-	struct spi_ioc_transfer *xfr = btc08->xfr;
+	memset(xfr, 0, sizeof(*xfr));
+	xfr->tx_buf = (unsigned long)tx_buf;
+	xfr->rx_buf = (unsigned long)NULL;
+	xfr->len = len;
+	xfr->speed_hz = MAX_TX_SPI_SPEED;
+	xfr->delay_usecs = btc08->spi_ctx->config.delay;
+	xfr->bits_per_word = btc08->spi_ctx->config.bits;
+	xfr->cs_change = 1;
+}
 
-	tx_len = ALIGN((CMD_CHIP_ID_LEN + WRITE_JOB_LEN + DUMMY_BYTES), 4);
+static void init_job_slot(struct btc08_chain *btc08)
+{
+	uint8_t *slot = btc08->spi_ctx->txb + JOB_SLOT_OFFSET;
 
-	// WRITE_PARM
-	hexdump("[WRITE_PARM]", spi_tx, tx_len);
-	xfr[0].tx_buf = (unsigned long)spi_tx;
-	xfr[0].rx_buf = (unsigned long)NULL;
-	xfr[0].len = tx_len;
-	xfr[0].speed_hz = MAX_TX_SPI_SPEED;
-	xfr[0].delay_usecs = btc08->spi_ctx->config.delay;
-	xfr[0].bits_per_word = btc08->spi_ctx->config.bits;
-	xfr[0].cs_change = 1;
-	xfr[0].tx_nbits = 0;
-	xfr[0].rx_nbits = 0;
-	xfr[0].pad = 0;
-	spi_tx += tx_len;
+	memset(slot, 0, JOB_TARGET_LEN + JOB_RUN_LEN);
 
-	ii++;
+	btc08->job_target = slot;
+	btc08->job_target[0] = SPI_CMD_WRITE_TARGET;
+	btc08->job_target[1] = BCAST_CHIP_ID;
 
-	// WRITE_TARGET
-	if(btc08->sdiff != work->sdiff)
-	{
-		tx_len = ALIGN((CMD_CHIP_ID_LEN + TARGET_LEN + DUMMY_BYTES), 4);
+	btc08->job_run = btc08->job_target + JOB_TARGET_LEN;
+	btc08->job_run[0] = SPI_CMD_RUN_JOB;
+	btc08->job_run[1] = BCAST_CHIP_ID;
 
-		spi_tx[0] = SPI_CMD_WRITE_TARGET;
-		spi_tx[1] = BCAST_CHIP_ID;
+	/* tx_buf is set to each work in turn */
+	fill_job_xfr(btc08, &btc08->job_xfr[0], NULL, JOB_PARM_LEN);
+	fill_job_xfr(btc08, &btc08->job_xfr[1], btc08->job_target, JOB_TARGET_LEN);
+	fill_job_xfr(btc08, &btc08->job_xfr[2], btc08->job_run, JOB_RUN_LEN);
+	btc08->job_xfr_nt[0] = btc08->job_xfr[0];
+	btc08->job_xfr_nt[1] = btc08->job_xfr[2];
+}
+
+/* WRITE_PARM (+ WRITE_TARGET if the diff changed) + RUN_JOB in one message */
+static bool cmd_WRITE_JOB_fast(struct btc08_chain *btc08,
+			      uint8_t job_id, struct work *work)
+{
+	uint8_t *parm = (uint8_t *)work + JOB_PARM_OFFSET;
+	struct spi_ioc_transfer *xfr = btc08->job_xfr_nt;
+	uint8_t btc08_target[6] = {0x00,};
+	uint32_t nbits;
+	int num = 2;
+	bool retb;
 
-		/* target */
+	// midstate + MerkleRoot/TimeStamp/Target + midstate1..3, the
+	// midstates are where calc_midstate() wrote them
+	parm[0] = SPI_CMD_WRITE_PARM;
+	parm[1] = BCAST_CHIP_ID;
+	memcpy(work->job_data, work->data + 64, DATA_LEN);
+	memset(work->job_dummy, 0, sizeof(work->job_dummy));
+	btc08->job_xfr[0].tx_buf = btc08->job_xfr_nt[0].tx_buf = (unsigned long)parm;
+	hexdump("[WRITE_PARM]", parm, JOB_PARM_LEN);
+
+	if(btc08->sdiff != work->sdiff)
+	{
 		btc08->sdiff = work->sdiff;
 		nbits = nbits_from_target(work->target);
 		calc_btc08_target(btc08_target, nbits);
-		memcpy(spi_tx+2, btc08_target, 6);
-		spi_tx[8] = 0;
-		hexdump("[WRITE_TARGET]", spi_tx, tx_len);
+		memcpy(btc08->job_target + CMD_CHIP_ID_LEN, btc08_target, TARGET_LEN);
+		hexdump("[WRITE_TARGET]", btc08->job_target, JOB_TARGET_LEN);
 		hexdump("target", work->target, 32);
 		applog(LOG_ERR, "diff : %.2f", btc08->sdiff);
 
-		xfr[ii].tx_buf = (unsigned long)spi_tx;
-		xfr[ii].rx_buf = (unsigned long)NULL;
-		xfr[ii].len = tx_len;
-		xfr[ii].speed_hz = MAX_TX_SPI_SPEED;
-		xfr[ii].delay_usecs = btc08->spi_ctx->config.delay;
-		xfr[ii].bits_per_word = btc08->spi_ctx->config.bits;
-		xfr[ii].cs_change = 1;
-		xfr[ii].tx_nbits = 0;
-		xfr[ii].rx_nbits = 0;
-		xfr[ii].pad = 0;
-
-		ii += 1;
-		spi_tx += tx_len;
+		xfr = btc08->job_xfr;
+		num = 3;
 	}
 
-	// RUN_JOB
-	tx_len = ALIGN((CMD_CHIP_ID_LEN + JOB_ID_LEN + DUMMY_BYTES), 4);
-
-	spi_tx[0] = SPI_CMD_RUN_JOB;
-	spi_tx[1] = BCAST_CHIP_ID;
-	spi_tx[2] = 0;
-	if (work->pool->vmask)
-		spi_tx[2] |= ASIC_BOOST_EN;
-	spi_tx[3] = job_id;
-	hexdump("[RUN_JOB]", spi_tx, tx_len);
-	xfr[ii].tx_buf = (unsigned long)spi_tx;
-	xfr[ii].rx_buf = (unsigned long)NULL;
-	xfr[ii].len = tx_len;
-	xfr[ii].speed_hz = MAX_TX_SPI_SPEED;
-	xfr[ii].delay_usecs = btc08->spi_ctx->config.delay;
-	xfr[ii].bits_per_word = btc08->spi_ctx->config.bits;
-	xfr[ii].cs_change = 1;
-	xfr[ii].tx_nbits = 0;
-	xfr[ii].rx_nbits = 0;
-	xfr[ii].pad = 0;
-
-	ii += 1;
+	btc08->job_run[2] = work->pool->vmask ? ASIC_BOOST_EN : 0;
+	btc08->job_run[3] = job_id;
+	hexdump("[RUN_JOB]", btc08->job_run, JOB_RUN_LEN);
 
-	assert(retb = spi_transfer_x20_a(btc08->spi_ctx, btc08->xfr, ii));
+	retb = spi_transfer_x20_a(btc08->spi_ctx, xfr, num);
 	if(retb == false) {
 		btc08->disabled = true;
 		applog(LOG_ERR, "%d: %s() error", btc08->chain_id, __func__);
@@ -951,7 +1304,7 @@ static uint8_t cmd_WRITE_JOB_fast(struct btc08_chain *btc08,
 	else
 		btc08->disabled = false;
 
-	return true;
+	return retb;
 }
 
 /********** btc08 low level functions */
@@ -988,21 +1341,64 @@ static bool check_chip_pll_lock(struct btc08_chain *btc08, int chip_id)
 #endif
 }
 
-static int get_pll_idx(int pll_freq)
+/* same overall limit as check_chip_pll_lock(), polled chain-wide */
+#define PLL_BATCH_WAIT_MS	5
+#define PLL_BATCH_WAIT_CYCLES	(MAX_PLL_WAIT_CYCLES * PLL_CYCLE_WAIT_TIME / PLL_BATCH_WAIT_MS)
+
+/*
+ * READ_PLL chips 1..num_chips in one SPI message per cycle, dropping the
+ * locked ones, instead of waiting on every chip in turn. Like
+ * check_chip_pll_lock() an unlocked PLL is only logged; returns false on
+ * SPI error.
+ */
+static bool wait_chain_pll_lock(struct btc08_chain *btc08)
 {
-	int ret;
-	struct pll_conf *plls;
+#if !defined(USE_BTC08_FPGA)
+	int cid = btc08->chain_id;
+	uint8_t chip_ids[MAX_CHAIN_LEN];
+	int num = 0, n, ii;
 
-	if(pll_freq < pll_sets[0].freq)
-		return -1;
-	if(pll_freq > pll_sets[NUM_PLL_SET-1].freq) {
-		applog(LOG_WARNING, "set to Max Frequency setting (%d)", pll_sets[NUM_PLL_SET-1].freq);
-		return (NUM_PLL_SET-1);
-	}
+	for (ii = 0; ii < btc08->num_chips; ii++)
+		chip_ids[num++] = ii + 1;
 
-	ret = 0;
-	for(plls = &pll_sets[0]; plls; plls++) {
-		if(pll_freq <= plls->freq) break;
+	for (n = 0; n < PLL_BATCH_WAIT_CYCLES && num > 0; n++) {
+		int pending = 0;
+
+		if (!exec_cmd_batch(btc08, SPI_CMD_READ_PLL, chip_ids, num, NULL, 0, RET_READ_PLL_LEN)) {
+			applog(LOG_WARNING, "%d: error in READ_PLL", cid);
+			return false;
+		}
+		for (ii = 0; ii < num; ii++) {
+			if (!(batch_resp(btc08, ii)[1] & (1<<7)))
+				chip_ids[pending++] = chip_ids[ii];
+		}
+		num = pending;
+		if (num > 0)
+			cgsleep_ms(PLL_BATCH_WAIT_MS);
+	}
+
+	for (ii = 0; ii < num; ii++)
+		applog(LOG_ERR, "%d: failed to lock PLL on chip %d", cid, chip_ids[ii]);
+	applog(LOG_INFO, "%d: PLL of %d chips locked", cid, btc08->num_chips - num);
+#endif
+	return true;
+}
+
+static int get_pll_idx(int pll_freq)
+{
+	int ret;
+	struct pll_conf *plls;
+
+	if(pll_freq < pll_sets[0].freq)
+		return -1;
+	if(pll_freq > pll_sets[NUM_PLL_SET-1].freq) {
+		applog(LOG_WARNING, "set to Max Frequency setting (%d)", pll_sets[NUM_PLL_SET-1].freq);
+		return (NUM_PLL_SET-1);
+	}
+
+	ret = 0;
+	for(plls = &pll_sets[0]; plls; plls++) {
+		if(pll_freq <= plls->freq) break;
 		ret++;
 	}
 	return ret;
@@ -1077,6 +1473,13 @@ static bool set_pll_config(struct btc08_chain *btc08, int chip_id, int pll)
 				btc08->chips[chip_index].mhz = pll_sets[pll_idx].freq;
 			}
 		}
+		else if (!btc08->last_chip && btc08->num_chips <= btc08->num_batch_slots)
+		{
+			if (!wait_chain_pll_lock(btc08))
+				return false;
+			for(ii=0; ii<btc08->num_chips; ii++)
+				btc08->chips[ii].mhz = pll_sets[pll_idx].freq;
+		}
 		else
 		{
 			for(ii=btc08->last_chip; ii<btc08->num_chips; ii++) {
@@ -1120,10 +1523,36 @@ static bool set_control(struct btc08_chain *btc08, int chip_id, int udiv)
 	return true;
 }
 
-static bool check_chip(struct btc08_chain *btc08, int chip_id)
+/* evaluate the READ_BIST reply of a chip that finished BIST */
+static bool check_chip_bist(struct btc08_chain *btc08, int chip_id, uint8_t *ret)
 {
 	int cid = btc08->chain_id;
 	int chip_index = chip_id - 1;
+
+	btc08->chips[chip_index].num_cores = ret[1];
+
+	// Calculate the performance of each chip
+	if (((btc08->chips[chip_index].rev >> 8) & 0xf) != FEATURE_FOR_FPGA) {
+		if(btc08->chips[chip_index].num_cores < btc08_config_options.min_cores) {
+			applog(LOG_ERR, "%d: chip %d doesn't have enough cores(%d), it must be over than %d",
+					cid, chip_id, btc08->chips[chip_index].num_cores, btc08_config_options.min_cores);
+			btc08->chips[chip_index].num_cores = 0;
+			btc08->chips[chip_index].perf = 0;
+			return false;
+		}
+	}
+	applog(LOG_WARNING, "%d: Found chip %d with %d active cores",
+	       cid, chip_id, btc08->chips[chip_index].num_cores);
+
+	btc08->chips[chip_index].perf = btc08->chips[chip_index].num_cores*btc08->chips[chip_index].mhz;
+	applog(LOG_WARNING, "%d: chip %d perf = %ld (%ld MHz)", cid, chip_id, btc08->chips[chip_index].perf, btc08->chips[chip_index].mhz);
+
+	return true;
+}
+
+static bool check_chip(struct btc08_chain *btc08, int chip_id)
+{
+	int cid = btc08->chain_id;
 	uint8_t *ret;
 
 	// READ_BIST to check the number of cores of the active chip
@@ -1140,27 +1569,89 @@ static bool check_chip(struct btc08_chain *btc08, int chip_id)
 		applog(LOG_ERR, "%d: error in READ_BIST", cid);
 		return false;
 	}
-	btc08->chips[chip_index].num_cores = ret[1];
 
-	// Calculate the performance of each chip
-	if (((btc08->chips[chip_index].rev >> 8) & 0xf) != FEATURE_FOR_FPGA) {
-		if(btc08->chips[chip_index].num_cores < btc08_config_options.min_cores) {
-			applog(LOG_ERR, "%d: chip %d doesn't have enough cores(%d), it must be over than %d",
-					cid, chip_id, btc08->chips[chip_index].num_cores, btc08_config_options.min_cores);
-			btc08->chips[chip_index].num_cores = 0;
-			btc08->chips[chip_index].perf = 0;
+	return check_chip_bist(btc08, chip_id, ret);
+}
+
+#define BIST_BATCH_WAIT_MS	10
+#define BIST_BATCH_WAIT_CYCLES	(10 * 200 / BIST_BATCH_WAIT_MS)
+
+/*
+ * After RUN_BIST, READ_BIST all chips in one SPI message per cycle until
+ * none is busy, then check each chip from its last reply. Adds up
+ * num_cores and perf of the chain, returns false if a chip fails.
+ */
+static bool check_chain(struct btc08_chain *btc08)
+{
+	int cid = btc08->chain_id;
+	uint8_t chip_ids[MAX_CHAIN_LEN];
+	int num = btc08->num_chips;
+	bool busy = true;
+	int n, ii;
+
+	if (num > btc08->num_batch_slots) {
+		for (ii = 1; ii <= num; ii++) {
+			if (!check_chip(btc08, ii))
+				return false;
+			btc08->num_cores += btc08->chips[ii-1].num_cores;
+			btc08->perf += btc08->chips[ii-1].perf;
+		}
+		return true;
+	}
+
+	for (ii = 0; ii < num; ii++)
+		chip_ids[ii] = ii + 1;
+
+	for (n = 0; n < BIST_BATCH_WAIT_CYCLES && busy; n++) {
+		if (n)
+			cgsleep_ms(BIST_BATCH_WAIT_MS);
+		if (!exec_cmd_batch(btc08, SPI_CMD_READ_BIST, chip_ids, num, NULL, 0, RET_READ_BIST_LEN)) {
+			applog(LOG_ERR, "%d: error in READ_BIST", cid);
 			return false;
 		}
+		busy = false;
+		for (ii = 0; ii < num; ii++) {
+			if ((batch_resp(btc08, ii)[0] & 1) == BIST_STATUS_BUSY)
+				busy = true;
+		}
 	}
-	applog(LOG_WARNING, "%d: Found chip %d with %d active cores",
-	       cid, chip_id, btc08->chips[chip_index].num_cores);
 
-	btc08->chips[chip_index].perf = btc08->chips[chip_index].num_cores*btc08->chips[chip_index].mhz;
-	applog(LOG_WARNING, "%d: chip %d perf = %ld (%ld MHz)", cid, chip_id, btc08->chips[chip_index].perf, btc08->chips[chip_index].mhz);
+	for (ii = 0; ii < num; ii++) {
+		uint8_t *ret = batch_resp(btc08, ii);
+
+		if ((ret[0] & 1) == BIST_STATUS_BUSY) {
+			applog(LOG_ERR, "%d: chip %d still busy in READ_BIST", cid, ii + 1);
+			return false;
+		}
+		if (!check_chip_bist(btc08, ii + 1, ret))
+			return false;
+		btc08->num_cores += btc08->chips[ii].num_cores;
+		btc08->perf += btc08->chips[ii].perf;
+	}
 
 	return true;
 }
 
+/* give every chip a slice of the nonce space proportional to its weight */
+static void split_nonce_range(struct btc08_chain *btc08)
+{
+	double total = 0;
+	int ii;
+
+	for(ii=btc08->last_chip; ii<btc08->num_chips; ii++)
+		total += btc08->chips[ii].weight;
+
+	btc08->chips[btc08->last_chip].start_nonce = 0;
+	for(ii=btc08->last_chip; ii<(btc08->num_chips-1); ii++) {
+		uint64_t len = 0;
+		if (total > 0)
+			len = MAX_NONCE_SIZE * (btc08->chips[ii].weight / total);
+		btc08->chips[ii].end_nonce = btc08->chips[ii].start_nonce + len;
+		btc08->chips[ii+1].start_nonce = btc08->chips[ii].end_nonce+1;
+	}
+	btc08->chips[btc08->num_chips-1].end_nonce = MAX_NONCE_SIZE;
+}
+
 static bool calc_nonce_range(struct btc08_chain *btc08)
 {
 	int ii;
@@ -1176,13 +1667,12 @@ static bool calc_nonce_range(struct btc08_chain *btc08)
 		}
 	}
 	else {
-		btc08->chips[btc08->last_chip].start_nonce = 0;
-		for(ii=btc08->last_chip; ii<(btc08->num_chips-1); ii++) {
-			btc08->chips[ii].end_nonce = btc08->chips[ii].start_nonce
-				+ ((MAX_NONCE_SIZE*btc08->chips[ii].perf)/btc08->perf);
-			btc08->chips[ii+1].start_nonce = btc08->chips[ii].end_nonce+1;
+		// BIST perf is the best guess until rebalance_nonce_range() measures
+		for(ii=btc08->last_chip; ii<btc08->num_chips; ii++) {
+			btc08->chips[ii].weight = btc08->chips[ii].perf;
+			btc08->chips[ii].rate_mhs = 0;
 		}
-		btc08->chips[btc08->num_chips-1].end_nonce = MAX_NONCE_SIZE;
+		split_nonce_range(btc08);
 	}
 
 	btc08->disabled = false;
@@ -1604,33 +2094,14 @@ uint32_t get_diff(double diff)
 	return n_bits;
 }
 
-static uint8_t *create_job(uint8_t chip_id, uint8_t *job, struct work *work)
-{
-	uint8_t *midstate, *wdata, *midstate1, *midstate2, *midstate3;
-
-	job[0] = SPI_CMD_WRITE_PARM;
-	job[1] = chip_id;
-
-	midstate  = work->midstate;
-	wdata     = work->data + 64;
-	midstate1 = work->midstate1;
-	midstate2 = work->midstate2;
-	midstate3 = work->midstate3;
-
-	memcpy(job+2,              midstate, 32);
-	memcpy(job+2+32,              wdata, 12);	// MerkleRoot + TimeStamp + Target
-	memcpy(job+2+32+12,       midstate1, 32);
-	memcpy(job+2+32+12+32,    midstate2, 32);
-	memcpy(job+2+32+12+32+32, midstate3, 32);
-
-	return job;
-}
-
 static void dump_work(char* title, struct work *work)
 {
 	char *header, *prev_blockhash, *merkle_root, *timestamp, *nbits;
 	char *midstate, *midstate1, *midstate2, *midstate3, *target;
 
+	if (!log_enabled(LOG_DEBUG))
+		return;
+
 	header         = bin2hex(work->data,         128);
 	prev_blockhash = bin2hex(work->data+4,        32);
 	merkle_root    = bin2hex(work->data+4+32,     32);
@@ -1686,6 +2157,37 @@ static void dump_work_list(struct btc08_chain *btc08)
 	}
 }
 
+static uint64_t now_ns(void)
+{
+	cgtimer_t ts;
+
+	cgtimer_time(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* account the time from a flush request to the first job of fresh work */
+static void flush_latency_done(struct btc08_chain *btc08)
+{
+	uint64_t begin_ns;
+	int ms;
+
+	if (!btc08->flush_pending)
+		return;
+
+	/* a newer flush may have restamped it, count from that one */
+	begin_ns = atomic_load(&btc08->flush_begin_ns);
+	ms = (now_ns() - begin_ns) / 1000000;
+
+	btc08->flush_pending = false;
+	btc08->flush_last_ms = ms;
+	if (ms > btc08->flush_max_ms)
+		btc08->flush_max_ms = ms;
+	btc08->flush_total_ms += ms;
+	btc08->flush_samples++;
+
+	applog(LOG_INFO, "%d: fresh work queued %dms after flush", btc08->chain_id, ms);
+}
+
 /* set work for given chip, returns true if a nonce range was finished */
 static bool set_work(struct btc08_chain *btc08, struct work *work)
 {
@@ -1705,22 +2207,26 @@ static bool set_work(struct btc08_chain *btc08, struct work *work)
 			dump_work_list(btc08);
 		}
 		// delete already processed work from queued_work of cgpu
-		work_completed(btc08->cgpu, btc08->work[btc08->last_queued_id]);
+		retire_work(btc08, btc08->work[btc08->last_queued_id]);
 		btc08->work[btc08->last_queued_id] = NULL;
 		retval = true;
 	}
 
 	// RUN_JOB for a new work
-	uint8_t *jobdata = create_job(BCAST_CHIP_ID, btc08->spi_ctx->txb, work);
-	if (!cmd_WRITE_JOB_fast(btc08, job_id, jobdata, work)) {
+	if (!cmd_WRITE_JOB_fast(btc08, job_id, work)) {
 		applog(LOG_ERR, "%d: failed to set work for job_id %d with spi err", cid, job_id);
 
 		// delete a work from queued_work of cgpu
-		work_completed(btc08->cgpu, work);
+		retire_work(btc08, work);
 		btc08->disabled = true;
 	} else {
 		applog(LOG_INFO, "%d: succeed to set a new job_id:%d for work_job_id:%s", cid, job_id, work->job_id);
+		trace_event(TRACE_WRITE_PARM, work->trace_id, btc08->cgpu->device_id,
+			    TRACE_NONE, job_id, 0);
+		work_started(work);
 		btc08->work[btc08->last_queued_id] = work;
+		btc08->job_sent_ns[btc08->last_queued_id] = now_ns();
+		flush_latency_done(btc08);
 		if (opt_debug) {
 			char s[512];
 			snprintf(s, sizeof(s), "[NEW WORK] btc08->work[%d] job_id:%d, work_job_id:%s",
@@ -1760,27 +2266,110 @@ static bool set_work_test(struct btc08_chain *btc08, uint8_t chip_id, uint8_t jo
 	return retval;
 }
 
-static bool get_nonce(struct btc08_chain *btc08, uint8_t *nonce,
-		      uint8_t *chip, uint8_t *micro_job_id)
+/********** batched result collection */
+/*
+ * Time the chips' jobs from the oon job ids of a READ_JOB_ID batch. A job
+ * is only timed if it was queued before the chip was seen done with the
+ * previous one, so the chip never idled in between and the time is its
+ * own speed rather than the refill pace, and if the polls at both ends
+ * were no further apart than 1/JOB_TIMING_GAP_DIV of it.
+ */
+#define JOB_TIMING_GAP_DIV		8
+
+static void time_chip_jobs(struct btc08_chain *btc08, int num_chips)
+{
+	uint64_t now = now_ns();
+	uint64_t gap = now - btc08->last_poll_ns;
+
+	btc08->last_poll_ns = now;
+	for (int i = 0; i < num_chips; i++) {
+		uint8_t *res = batch_resp(btc08, i);
+		struct btc08_chip *chip;
+		uint64_t busy;
+		int done;
+
+		// [0]: oon job id, [3]: chip id
+		if (res[3] < 1 || res[3] > btc08->num_chips)
+			continue;
+		if (res[0] < 1 || res[0] > JOB_ID_NUM_MASK+1)
+			continue;
+		chip = &btc08->chips[res[3] - 1];
+		if (res[0] == chip->oon_job_id)
+			continue;
+
+		done = (res[0] - chip->oon_job_id + JOB_ID_NUM_MASK+1) % (JOB_ID_NUM_MASK+1);
+		busy = now - chip->done_ns;
+		if (done == 1 && chip->done_ns != 0 &&
+		    btc08->job_sent_ns[res[0] - 1] <= chip->done_ns - chip->done_gap_ns &&
+		    (gap + chip->done_gap_ns) * JOB_TIMING_GAP_DIV <= busy) {
+			chip->busy_ns += busy;
+			chip->timed_jobs++;
+		}
+		chip->oon_job_id = res[0];
+		chip->done_ns = now;
+		chip->done_gap_ns = gap;
+	}
+}
+
+/*
+ * READ_JOB_ID all active chips in one message, then READ_RESULT (which
+ * also clears GN IRQ) only the chips that flagged GN in a second one.
+ * On return gn_chips[]/gn_jobs[] hold chip and job id of each result and
+ * batch_resp(btc08, n) its READ_RESULT reply. Returns number of results
+ * or -1 on SPI error.
+ */
+static int read_gn_results(struct btc08_chain *btc08, uint8_t *gn_chips, uint8_t *gn_jobs)
 {
-	uint8_t *ret;
 	int cid = btc08->chain_id;
+	uint8_t chip_ids[MAX_CHAIN_LEN];
+	int num_chips = btc08->num_active_chips;
+	int num_gn = 0;
+	uint8_t *res;
 
-	// READ_RESULT to read GN and clear GN IRQ
-	ret = cmd_READ_RESULT(btc08, *chip);
-	if (ret == NULL)
-		return false;
+	if (num_chips > MAX_CHAIN_LEN)
+		num_chips = MAX_CHAIN_LEN;
+
+	for (int i = 0; i < num_chips; i++)
+		chip_ids[i] = i + 1;
+
+	if (!exec_cmd_batch(btc08, SPI_CMD_READ_JOB_ID, chip_ids, num_chips, NULL, 0, RET_READ_JOB_ID_LEN))
+		return -1;
+	time_chip_jobs(btc08, num_chips);
+
+	for (int i = 0; i < num_chips; i++) {
+		res = batch_resp(btc08, i);
+		// [0]: oon job id, [1]: gn job id, [2]: [0] gn irq, [3]: chip id
+		if (0 == (res[2] & (1<<0)))
+			continue;
+		if (res[3] < 1 || res[3] > btc08->num_active_chips) {
+			applog(LOG_WARNING, "%d: wrong chip_id %d", cid, res[3]);
+			continue;
+		}
+		gn_chips[num_gn] = res[3];
+		gn_jobs[num_gn] = res[1];
+		num_gn++;
+	}
+
+	if (!exec_cmd_batch(btc08, SPI_CMD_READ_RESULT, gn_chips, num_gn, NULL, 0, RET_READ_RESULT_LEN))
+		return -1;
+
+	return num_gn;
+}
 
+/* split a READ_RESULT reply into the nonces of the 4 ASICBoost cores */
+static bool get_nonce(struct btc08_chain *btc08, uint8_t *ret, uint8_t *nonce,
+		      uint8_t chip, uint8_t *micro_job_id)
+{
 	// [3:0]: lower3/lower2/lower/upper GN
 	*micro_job_id = ret[17];
 	for (int i=0; i<ASIC_BOOST_CORE_NUM; i++)
 	{
 		memcpy(&(nonce[i*4]), &(ret[i*4]), 4);
-		if((*micro_job_id & (1<<i)) != 0)
+		if((*micro_job_id & (1<<i)) != 0 && log_enabled(LOG_DEBUG))
 		{
 			char buf[512];
 			snprintf(buf, sizeof(buf),
-				"READ_RESULT[%d] on chip#%d Inst_%s", i, *chip,
+				"READ_RESULT[%d] on chip#%d Inst_%s", i, chip,
 				(i==0) ? "Upper":(((i==1) ? "Lower": ((i==2) ? "Lower_2":"Lower_3"))));
 			applog_hexdump(buf, (ret + i*4), 4, LOG_DEBUG);
 		}
@@ -1790,7 +2379,7 @@ static bool get_nonce(struct btc08_chain *btc08, uint8_t *nonce,
 	if (opt_debug)
 	{
 		int i=0;
-		uint8_t *hash_ret = cmd_READ_HASH(btc08, *chip);
+		uint8_t *hash_ret = cmd_READ_HASH(btc08, chip);
 		if (hash_ret == NULL)
 			return false;
 
@@ -1798,7 +2387,7 @@ static bool get_nonce(struct btc08_chain *btc08, uint8_t *nonce,
 		{
 			char title[512];
 			sprintf(title, "READ_HASH[Inst_%s] on chip#%d",
-					(i==0) ? "Upper":(((i==1) ? "Lower": ((i==2) ? "Lower_2":"Lower_3"))), *chip);
+					(i==0) ? "Upper":(((i==1) ? "Lower": ((i==2) ? "Lower_2":"Lower_3"))), chip);
 			applog_hexdump(title, &(hash_ret[i*32]), 32, LOG_DEBUG);
 		}
 	}
@@ -1806,125 +2395,517 @@ static bool get_nonce(struct btc08_chain *btc08, uint8_t *nonce,
 	return true;
 }
 
-/* H/W reset of chip chain */
-static bool abort_work(int chain_id)
+/********** adaptive nonce range */
+/*
+ * The BIST perf split makes the chain as slow as its slowest chip once a
+ * chip throttles or starts returning HW errors. A chip's rate is the size
+ * of its slice over the jobs time_chip_jobs() timed, less the part of its
+ * nonces that are HW errors. Once a window of at least REBALANCE_OONS
+ * OONs has collected enough nonces, the slices are resized after the
+ * rates so that the chips finish a job together. A chip without a timed
+ * job keeps its share. The ranges are written in one SPI message right at
+ * the OON, the job boundary the driver sees, with the FIFO left as it is.
+ * A chip inside a job may hash a sliver of that job twice or skip it,
+ * which is cheaper than idling the whole chain to drain the FIFO.
+ */
+#define REBALANCE_OONS			32
+#define REBALANCE_TIMED_JOBS		8	/* per chip and window, polled for */
+#define REBALANCE_MIN_NONCES		64	/* per chip, fewer is mostly noise */
+#define REBALANCE_MIN_SHIFT		0.01	/* ignore share moves below 1% */
+
+static void reset_rebalance(struct btc08_chain *btc08)
 {
-	return HWReset(chain_id);
+	btc08->rebalance_oons = 0;
+
+	for (int ii = btc08->last_chip; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
+
+		chip->last_nonces_found = atomic_load(&chip->nonces_found);
+		chip->last_hw_errors = atomic_load(&chip->hw_errors);
+		chip->busy_ns = 0;
+		chip->timed_jobs = 0;
+	}
 }
 
-/********** driver interface */
-void exit_btc08_chain(struct btc08_chain *btc08)
+/* job ids start over from 1 after a chain reset */
+static void reset_job_timing(struct btc08_chain *btc08)
 {
-	applog(LOG_DEBUG, "exit_btc08_chain");
+	btc08->last_poll_ns = 0;
+	btc08->tune_drain = false;
 
-	if (btc08 == NULL)
-		return;
+	for (int ii = 0; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
 
-	if (btc08->chips)
-	{
-		free(btc08->chips);
-		btc08->chips = NULL;
+		chip->oon_job_id = 0;
+		chip->done_ns = 0;
+		chip->done_gap_ns = 0;
 	}
-	btc08->spi_ctx = NULL;
-	free(btc08);
+	reset_rebalance(btc08);
 }
 
-static int mvolt_array[2] = {400, 420};
-#define DEFAULT_HBTEST_MIN_400MV      (400-40);
-#define DEFAULT_HBTEST_MAX_400MV      (400+40);
-#define DEFAULT_HBTEST_MIN_420MV      (420-42);
-#define DEFAULT_HBTEST_MAX_420MV      (420+42);
-#define DEFAULT_HBTEST_MIN_CORES      (206-10);
-#define DEFAULT_HBTEST_FULLTEST_MSEC (2000)
+/* true once every chip had enough jobs timed this window */
+static bool rebalance_timed(struct btc08_chain *btc08)
+{
+	for (int ii = btc08->last_chip; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
 
-#define DEFAULT_HBVOLT_SETUPTIME_MSEC (500)
+		if (!chip->disabled && chip->timed_jobs < REBALANCE_TIMED_JOBS)
+			return false;
+	}
+	return true;
+}
 
-static int hbtest_get_ref_value(char *refstr)
+/* true once the window holds enough nonces to weigh the HW errors */
+static bool rebalance_due(struct btc08_chain *btc08)
 {
-	int ret = 0;
-	FILE *fwfptr;
-	char cmd[128];
+	int good = 0;
 
-	sprintf(cmd, "/sbin/fw_printenv | /bin/grep %s | /usr/bin/awk -F= '{print $2}'", refstr);
+	if (btc08_config_options.test_mode == 1)
+		return false;
+	if (btc08->rebalance_oons < REBALANCE_OONS)
+		return false;
 
-	fwfptr = popen(cmd, "r");
-	if(fwfptr) {
-		char lenstr[16];
-		fgets(lenstr, 16, fwfptr);
-		ret = strtoul(lenstr, NULL, 0);
-		pclose(fwfptr);
-	}
+	for (int ii = btc08->last_chip; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
 
-	return ret;
+		good += atomic_load(&chip->nonces_found) - chip->last_nonces_found;
+	}
+	return good >= REBALANCE_MIN_NONCES * (btc08->num_chips - btc08->last_chip);
 }
 
-static int job_weight_idx = 0;
-static int hashboard_test(struct btc08_chain *btc08)
+static void rebalance_nonce_range(struct btc08_chain *btc08)
 {
-	uint8_t *ret;
-	int res = 0, i, chip_id, ii;
-	int mvolt_idx = 0, start_ms;
+	uint8_t chip_ids[MAX_CHAIN_LEN];
+	uint8_t parms[MAX_CHAIN_LEN * NONCE_LEN * 2];
+	double rate[MAX_CHAIN_LEN];
+	double total_w = 0, timed_w = 0, total_r = 0, chain_mhs = 0, max_shift = 0;
+	int num = 0, ii;
+
+	for (ii = btc08->last_chip; ii < btc08->num_chips; ii++)
+		total_w += btc08->chips[ii].weight;
+	if (total_w <= 0)
+		goto out;
+
+	// nonces per second over the timed jobs, HW errors taken out
+	for (ii = btc08->last_chip; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
+		int good = atomic_load(&chip->nonces_found) - chip->last_nonces_found;
+		int hw = atomic_load(&chip->hw_errors) - chip->last_hw_errors;
+		double slice = (double)chip->end_nonce - chip->start_nonce + 1;
+
+		rate[ii] = 0;
+		if (chip->disabled || chip->timed_jobs == 0 || chip->busy_ns == 0)
+			continue;
 
-	applog(LOG_ERR, "----------------------------------------------------------------------");
-	applog(LOG_ERR, "----------------------- hash board test mode!! -----------------------");
-	applog(LOG_ERR, "----------------------------------------------------------------------");
-	int min_mvolt_array[2];
-	int max_mvolt_array[2];
-	int min_cores, min_chips;
-	int fulltest_msec;
-	char dummy[32];
-	FILE *fwfptr;
+		rate[ii] = slice * chip->timed_jobs * 1e9 / chip->busy_ns;
+		chip->rate_mhs = rate[ii] * ASIC_BOOST_CORE_NUM / 1e6;
+		chain_mhs += chip->rate_mhs;
+		if (good + hw >= REBALANCE_MIN_NONCES)
+			rate[ii] = rate[ii] * good / (good + hw);
 
-	min_mvolt_array[0] = hbtest_get_ref_value("hbtest_min_400mv");
-//	if(!min_mvolt_array[0]) min_mvolt_array[0] = DEFAULT_HBTEST_MIN_400MV;
+		timed_w += chip->weight;
+		total_r += rate[ii];
+	}
+	if (total_r <= 0)
+		goto out;
 
-	max_mvolt_array[0] = hbtest_get_ref_value("hbtest_max_400mv");
-	if(!max_mvolt_array[0]) max_mvolt_array[0] = DEFAULT_HBTEST_MAX_400MV;
-	
-	min_mvolt_array[1] = hbtest_get_ref_value("hbtest_min_420mv");
-//	if(!min_mvolt_array[1]) min_mvolt_array[1] = DEFAULT_HBTEST_MIN_420MV;
+	// the timed chips split their combined share after their rates
+	for (ii = btc08->last_chip; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
+		double share = chip->weight / total_w;
+		double target, weight;
 
-	max_mvolt_array[1] = hbtest_get_ref_value("hbtest_max_420mv");
-	if(!max_mvolt_array[1]) max_mvolt_array[1] = DEFAULT_HBTEST_MAX_420MV;
-	
-	min_cores = hbtest_get_ref_value("hbtest_min_cores");
-	if(!min_cores) min_cores = DEFAULT_HBTEST_MIN_CORES;
-	
-	min_chips = hbtest_get_ref_value("hbtest_min_chips");
-	if(!min_chips) min_chips = MAX_CHIP_NUM;
-	
-	fulltest_msec = hbtest_get_ref_value("hbtest_fulltest_msec");
-	if(!fulltest_msec) fulltest_msec = DEFAULT_HBTEST_FULLTEST_MSEC;
-	
-	applog(LOG_ERR, "--- 0.400V min adc value : %d ---", min_mvolt_array[0]);
-	applog(LOG_ERR, "--- 0.400V MAX adc value : %d ---", max_mvolt_array[0]);
-	applog(LOG_ERR, "--- 0.420V min adc value : %d ---", min_mvolt_array[1]);
-	applog(LOG_ERR, "--- 0.420V MAX adc value : %d ---", max_mvolt_array[1]);
-	applog(LOG_ERR, "--- minimum core number : %d ---", min_cores);
-	applog(LOG_ERR, "--- full load test time : %d.%03d seconds ---", fulltest_msec/1000, fulltest_msec%1000);
+		if (rate[ii] <= 0)
+			continue;
 
-	for(mvolt_idx = 0; mvolt_idx < 2; mvolt_idx++) {
-		cmd_RESET_BCAST(btc08);
+		target = timed_w / total_w * rate[ii] / total_r;
+		weight = (3 * share + target) / 4;
+		if (weight - share > max_shift)
+			max_shift = weight - share;
+		if (share - weight > max_shift)
+			max_shift = share - weight;
+		chip->weight = weight * total_w;
+	}
 
-		//set_gpio_value(btc08->pinnum_gpio_vctrl, mvolt_idx);
-		sprintf(dummy, "at %d.%03dV", mvolt_array[mvolt_idx]/1000, mvolt_array[mvolt_idx]%1000);
-		cgsleep_ms(DEFAULT_HBVOLT_SETUPTIME_MSEC);
+	if (max_shift < REBALANCE_MIN_SHIFT)
+		goto out;
 
-		res = get_mvolt(mvolt_idx);
-		if( 
-				(res < min_mvolt_array[mvolt_idx]) || 
-				(res > max_mvolt_array[mvolt_idx]) ) {
-			applog(LOG_ERR, "power error (%dmV detected, it must be %dmV)", res, mvolt_array[mvolt_idx]);
-			res = -1;
-			return res;
-		}
-		applog(LOG_ERR, "-- test chip at %d mV --", mvolt_array[mvolt_idx]);
+	split_nonce_range(btc08);
 
-		// SPI_CMD_AUTO_ADDRESS
-		ret = exec_cmd(btc08, SPI_CMD_AUTO_ADDRESS, BCAST_CHIP_ID, dummy, sizeof(dummy), RET_AUTO_ADDRESS_LEN);
-		if(ret[0] != SPI_CMD_AUTO_ADDRESS) {
-			applog(LOG_ERR, "%s: error in AUTO_ADDRESS", dummy);
-			res = -1;
+	for (ii = btc08->last_chip; ii < btc08->num_chips; ii++, num++) {
+		uint32_t start_nonce = bswap_32(btc08->chips[ii].start_nonce);
+		uint32_t end_nonce = bswap_32(btc08->chips[ii].end_nonce);
+
+		chip_ids[num] = ii + 1;
+		memcpy(&parms[num * NONCE_LEN * 2], &start_nonce, NONCE_LEN);
+		memcpy(&parms[num * NONCE_LEN * 2 + NONCE_LEN], &end_nonce, NONCE_LEN);
+	}
+	if (!exec_cmd_batch(btc08, SPI_CMD_WRITE_NONCE, chip_ids, num, parms, NONCE_LEN * 2, 0))
+		goto out;
+
+	btc08->nonce_rebalances++;
+	applog(LOG_INFO, "%d: nonce ranges rebalanced, chain at %.0f MH/s (max shift %.1f%%)",
+			btc08->chain_id, chain_mhs, max_shift * 100);
+
+out:
+	reset_rebalance(btc08);
+}
+
+/********** per-chip PLL autotune */
+/*
+ * With --btc08-autotune every chip walks pll_sets[] on its own, once per
+ * rebalance window: a step down when its HW error ratio is too high or it
+ * runs hot, a step up after AUTOTUNE_CLEAN_WINDOWS clean windows. A clock
+ * the chip erred at becomes its ceiling. Tuned clocks are written to the
+ * --btc08-pll-profile file, keyed by chain and chip id, and the next
+ * bring-up starts from there.
+ */
+#define BTC08_PLL_PROFILE		"/etc/btc08_pll.conf"
+#define AUTOTUNE_DEF_MIN_MHZ		200
+#define AUTOTUNE_DEF_MAX_TEMP		85
+#define AUTOTUNE_MIN_HW			2
+#define AUTOTUNE_HW_RATIO		0.02
+#define AUTOTUNE_CLEAN_WINDOWS		4
+#define AUTOTUNE_TEMP_HYST		5
+
+static int pll_profile[MAX_SPI_PORT][MAX_CHAIN_LEN];	/* MHz, 0 if not tuned */
+static pthread_mutex_t pll_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *pll_profile_path(void)
+{
+	return opt_btc08_pll_profile ? opt_btc08_pll_profile : BTC08_PLL_PROFILE;
+}
+
+static bool autotune_enabled(struct btc08_chain *btc08)
+{
+	if (btc08_config_options.autotune_max_mhz == 0 || btc08_config_options.test_mode == 1)
+		return false;
+	if (btc08->chain_id < 0 || btc08->chain_id >= MAX_SPI_PORT)
+		return false;
+	if (btc08->num_chips == 0 || btc08->last_chip)
+		return false;
+	return ((btc08->chips[btc08->num_chips-1].rev >> 8) & 0xf) != FEATURE_FOR_FPGA;
+}
+
+static void load_pll_profile(void)
+{
+	const char *path = pll_profile_path();
+	int chain, chip_id, mhz;
+	char line[64];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		applog(LOG_INFO, "no BTC08 PLL profile in %s", path);
+		return;
+	}
+
+	// "chain chip_id mhz" per line, anything else is skipped
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%d %d %d", &chain, &chip_id, &mhz) != 3)
+			continue;
+		if (chain < 0 || chain >= MAX_SPI_PORT || chip_id < 1 || chip_id > MAX_CHAIN_LEN)
+			continue;
+		pll_profile[chain][chip_id-1] = mhz;
+	}
+	fclose(fp);
+}
+
+static void save_pll_profile(struct btc08_chain *btc08)
+{
+	const char *path = pll_profile_path();
+	char tmp_path[PATH_MAX];
+	FILE *fp;
+
+	mutex_lock(&pll_profile_lock);
+	for (int ii = 0; ii < btc08->num_chips; ii++)
+		pll_profile[btc08->chain_id][ii] = btc08->chips[ii].mhz;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL) {
+		applog(LOG_WARNING, "%d: failed to write PLL profile %s", btc08->chain_id, path);
+		goto out;
+	}
+
+	fprintf(fp, "# chain chip_id mhz\n");
+	for (int chain = 0; chain < MAX_SPI_PORT; chain++) {
+		for (int ii = 0; ii < MAX_CHAIN_LEN; ii++) {
+			if (pll_profile[chain][ii] != 0)
+				fprintf(fp, "%d %d %d\n", chain, ii+1, pll_profile[chain][ii]);
+		}
+	}
+
+	if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+		applog(LOG_WARNING, "%d: failed to write PLL profile %s", btc08->chain_id, path);
+out:
+	mutex_unlock(&pll_profile_lock);
+}
+
+/* after the broadcast PLL setup, move the chips to their tuned clocks */
+static void apply_pll_profile(struct btc08_chain *btc08)
+{
+	int cid = btc08->chain_id;
+
+	if (!autotune_enabled(btc08))
+		return;
+
+	for (int ii = 0; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
+		int mhz = pll_profile[cid][ii];
+
+		chip->tune_max_mhz = btc08_config_options.autotune_max_mhz;
+		chip->tune_clean_windows = 0;
+
+		if (mhz == 0 || mhz == chip->mhz)
+			continue;
+		if (mhz < btc08_config_options.autotune_min_mhz)
+			mhz = btc08_config_options.autotune_min_mhz;
+		if (mhz > btc08_config_options.autotune_max_mhz)
+			mhz = btc08_config_options.autotune_max_mhz;
+
+		if (!set_pll_config(btc08, ii+1, mhz)) {
+			applog(LOG_WARNING, "%d: chip %d failed to start at %dMHz from profile",
+					cid, ii+1, mhz);
+			set_pll_config(btc08, ii+1, btc08_config_options.pll);
+			continue;
+		}
+		applog(LOG_INFO, "%d: chip %d starts at %dMHz from profile", cid, ii+1, mhz);
+	}
+}
+
+/*
+ * Pick one autotune step per chip over the current rebalance window,
+ * returns true if any chip is to be relocked by autotune_pll().
+ */
+static bool autotune_plan(struct btc08_chain *btc08)
+{
+	int cid = btc08->chain_id;
+	int max_temp = btc08_config_options.autotune_max_temp;
+	struct btc08_sensors sensors;
+	bool planned = false;
+
+	if (!autotune_enabled(btc08))
+		return false;
+
+	// the board sensor is the only temperature there is
+	read_sensors(btc08, &sensors);
+
+	for (int ii = 0; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
+		int good = atomic_load(&chip->nonces_found) - chip->last_nonces_found;
+		int hw = atomic_load(&chip->hw_errors) - chip->last_hw_errors;
+		int temp = sensors.high_temp_val;
+		bool erring = (hw >= AUTOTUNE_MIN_HW) && (hw > (good + hw) * AUTOTUNE_HW_RATIO);
+		int idx, new_idx;
+
+		chip->tune_mhz = 0;
+		if (chip->disabled || chip->mhz == 0)
+			continue;
+
+		idx = new_idx = get_pll_idx(chip->mhz);
+		if (erring || temp > max_temp) {
+			chip->tune_clean_windows = 0;
+			if (erring && idx > 0)
+				chip->tune_max_mhz = pll_sets[idx-1].freq;
+			if (idx > 0 && pll_sets[idx-1].freq >= btc08_config_options.autotune_min_mhz)
+				new_idx = idx - 1;
+		} else if (hw == 0 && good > 0 && temp <= max_temp - AUTOTUNE_TEMP_HYST) {
+			if (++chip->tune_clean_windows >= AUTOTUNE_CLEAN_WINDOWS) {
+				chip->tune_clean_windows = 0;
+				if (idx + 1 < NUM_PLL_SET && pll_sets[idx+1].freq <= chip->tune_max_mhz)
+					new_idx = idx + 1;
+			}
+		} else
+			chip->tune_clean_windows = 0;
+
+		if (new_idx == idx)
+			continue;
+
+		applog(LOG_NOTICE, "%d: chip %d PLL %dMHz -> %dMHz (nonces %d, hw errors %d, temp %d)",
+				cid, ii+1, (int)chip->mhz, pll_sets[new_idx].freq, good, hw, temp);
+		chip->tune_mhz = pll_sets[new_idx].freq;
+		planned = true;
+	}
+	return planned;
+}
+
+/* relock the chips autotune_plan() picked, with the chip FIFO drained */
+static void autotune_pll(struct btc08_chain *btc08)
+{
+	int cid = btc08->chain_id;
+	bool changed = false, relocked = false;
+
+	for (int ii = 0; ii < btc08->num_chips; ii++) {
+		struct btc08_chip *chip = &btc08->chips[ii];
+		int old_mhz = chip->mhz;
+		int new_mhz = chip->tune_mhz;
+
+		if (new_mhz == 0)
+			continue;
+		chip->tune_mhz = 0;
+
+		relocked = true;
+		if (!set_pll_config(btc08, ii+1, new_mhz)) {
+			// never try that clock again, go back to the one that worked
+			if (new_mhz > old_mhz)
+				chip->tune_max_mhz = old_mhz;
+			if (!set_pll_config(btc08, ii+1, old_mhz)) {
+				applog(LOG_ERR, "%d: chip %d failed to restore PLL %dMHz",
+						cid, ii+1, old_mhz);
+			} else {
+				applog(LOG_WARNING, "%d: chip %d failed to change PLL, back at %dMHz",
+						cid, ii+1, old_mhz);
+				continue;
+			}
+		}
+
+		btc08->perf -= chip->perf;
+		chip->perf = chip->num_cores * chip->mhz;
+		btc08->perf += chip->perf;
+		// the share follows the clock until the next window times it
+		if (old_mhz > 0)
+			chip->weight = chip->weight * chip->mhz / old_mhz;
+		changed = true;
+	}
+
+	// set_pll_config() put back the static OON limit
+	if (relocked && btc08->perf > 0)
+		btc08->timeout_oon = 4.*1024. / btc08->perf * 1000. * 4.;
+	if (changed)
+		save_pll_profile(btc08);
+}
+
+/* H/W reset of chip chain */
+static bool abort_work(int chain_id)
+{
+	return HWReset(chain_id);
+}
+
+/********** driver interface */
+void exit_btc08_chain(struct btc08_chain *btc08)
+{
+	applog(LOG_DEBUG, "exit_btc08_chain");
+
+	if (btc08 == NULL)
+		return;
+
+	if (btc08->chips)
+	{
+		free(btc08->chips);
+		btc08->chips = NULL;
+	}
+	free(btc08->chip_stats);
+	close_chain_irqs(btc08);
+	if (btc08->fd_volt >= 0)
+		close(btc08->fd_volt);
+	if (btc08->fd_temp >= 0)
+		close(btc08->fd_temp);
+	spsc_ring_free(&btc08->work_ring);
+	spsc_ring_free(&btc08->result_ring);
+	free(btc08->xfr);
+	free(btc08->spi_tx_a);
+	free(btc08->spi_rx_a);
+	btc08->spi_ctx = NULL;
+	free(btc08);
+}
+
+static int mvolt_array[2] = {400, 420};
+#define DEFAULT_HBTEST_MIN_400MV      (400-40);
+#define DEFAULT_HBTEST_MAX_400MV      (400+40);
+#define DEFAULT_HBTEST_MIN_420MV      (420-42);
+#define DEFAULT_HBTEST_MAX_420MV      (420+42);
+#define DEFAULT_HBTEST_MIN_CORES      (206-10);
+#define DEFAULT_HBTEST_FULLTEST_MSEC (2000)
+
+#define DEFAULT_HBVOLT_SETUPTIME_MSEC (500)
+
+static int hbtest_get_ref_value(char *refstr)
+{
+	int ret = 0;
+	FILE *fwfptr;
+	char cmd[128];
+
+	sprintf(cmd, "/sbin/fw_printenv | /bin/grep %s | /usr/bin/awk -F= '{print $2}'", refstr);
+
+	fwfptr = popen(cmd, "r");
+	if(fwfptr) {
+		char lenstr[16];
+		fgets(lenstr, 16, fwfptr);
+		ret = strtoul(lenstr, NULL, 0);
+		pclose(fwfptr);
+	}
+
+	return ret;
+}
+
+static int job_weight_idx = 0;
+static int hashboard_test(struct btc08_chain *btc08)
+{
+	uint8_t *ret;
+	int res = 0, i, chip_id, ii;
+	int mvolt_idx = 0, start_ms;
+
+	applog(LOG_ERR, "----------------------------------------------------------------------");
+	applog(LOG_ERR, "----------------------- hash board test mode!! -----------------------");
+	applog(LOG_ERR, "----------------------------------------------------------------------");
+	int min_mvolt_array[2];
+	int max_mvolt_array[2];
+	int min_cores, min_chips;
+	int fulltest_msec;
+	char dummy[32];
+	FILE *fwfptr;
+
+	min_mvolt_array[0] = hbtest_get_ref_value("hbtest_min_400mv");
+//	if(!min_mvolt_array[0]) min_mvolt_array[0] = DEFAULT_HBTEST_MIN_400MV;
+
+	max_mvolt_array[0] = hbtest_get_ref_value("hbtest_max_400mv");
+	if(!max_mvolt_array[0]) max_mvolt_array[0] = DEFAULT_HBTEST_MAX_400MV;
+	
+	min_mvolt_array[1] = hbtest_get_ref_value("hbtest_min_420mv");
+//	if(!min_mvolt_array[1]) min_mvolt_array[1] = DEFAULT_HBTEST_MIN_420MV;
+
+	max_mvolt_array[1] = hbtest_get_ref_value("hbtest_max_420mv");
+	if(!max_mvolt_array[1]) max_mvolt_array[1] = DEFAULT_HBTEST_MAX_420MV;
+	
+	min_cores = hbtest_get_ref_value("hbtest_min_cores");
+	if(!min_cores) min_cores = DEFAULT_HBTEST_MIN_CORES;
+	
+	min_chips = hbtest_get_ref_value("hbtest_min_chips");
+	if(!min_chips) min_chips = MAX_CHIP_NUM;
+	
+	fulltest_msec = hbtest_get_ref_value("hbtest_fulltest_msec");
+	if(!fulltest_msec) fulltest_msec = DEFAULT_HBTEST_FULLTEST_MSEC;
+	
+	applog(LOG_ERR, "--- 0.400V min adc value : %d ---", min_mvolt_array[0]);
+	applog(LOG_ERR, "--- 0.400V MAX adc value : %d ---", max_mvolt_array[0]);
+	applog(LOG_ERR, "--- 0.420V min adc value : %d ---", min_mvolt_array[1]);
+	applog(LOG_ERR, "--- 0.420V MAX adc value : %d ---", max_mvolt_array[1]);
+	applog(LOG_ERR, "--- minimum core number : %d ---", min_cores);
+	applog(LOG_ERR, "--- full load test time : %d.%03d seconds ---", fulltest_msec/1000, fulltest_msec%1000);
+
+	for(mvolt_idx = 0; mvolt_idx < 2; mvolt_idx++) {
+		cmd_RESET_BCAST(btc08);
+
+		//set_gpio_value(btc08->pinnum_gpio_vctrl, mvolt_idx);
+		sprintf(dummy, "at %d.%03dV", mvolt_array[mvolt_idx]/1000, mvolt_array[mvolt_idx]%1000);
+		cgsleep_ms(DEFAULT_HBVOLT_SETUPTIME_MSEC);
+
+		res = get_mvolt(mvolt_idx);
+		if( 
+				(res < min_mvolt_array[mvolt_idx]) || 
+				(res > max_mvolt_array[mvolt_idx]) ) {
+			applog(LOG_ERR, "power error (%dmV detected, it must be %dmV)", res, mvolt_array[mvolt_idx]);
+			res = -1;
+			return res;
+		}
+		applog(LOG_ERR, "-- test chip at %d mV --", mvolt_array[mvolt_idx]);
+
+		// SPI_CMD_AUTO_ADDRESS
+		ret = exec_cmd(btc08, SPI_CMD_AUTO_ADDRESS, BCAST_CHIP_ID, dummy, sizeof(dummy), RET_AUTO_ADDRESS_LEN);
+		if(ret[0] != SPI_CMD_AUTO_ADDRESS) {
+			applog(LOG_ERR, "%s: error in AUTO_ADDRESS", dummy);
+			res = -1;
 			return res;
 		}
 		btc08->num_chips = ret[1];
@@ -2057,7 +3038,7 @@ static int hashboard_test(struct btc08_chain *btc08)
 	start_ms = get_current_ms();
 //	set_control(btc08, 0, 1|(1<<4));	// set OON int
 	do {
-		if(0 == get_gpio_value(btc08->pinnum_gpio_gn)) {
+		if(0 == btc08_gpio_get_value(btc08->pinnum_gpio_gn)) {
 			ret = cmd_READ_JOB_ID(btc08, BCAST_CHIP_ID);
 
 			if(ret[2]&1) {
@@ -2075,7 +3056,7 @@ static int hashboard_test(struct btc08_chain *btc08)
 			}
 		}
 
-		if(0 == get_gpio_value(btc08->pinnum_gpio_oon)) {
+		if(0 == btc08_gpio_get_value(btc08->pinnum_gpio_oon)) {
 			cmd_CLEAR_OON(btc08, BCAST_CHIP_ID);
 			ii = set_work_test(btc08, 0, job_weight_idx+1);
 			job_weight_idx++;
@@ -2116,13 +3097,8 @@ static bool reinit_btc08_chip(struct btc08_chain *btc08)
 
 	chain_id = btc08->chain_id;
 
-	if (btc08->chips)
-	{
-		free(btc08->chips);
-		btc08->chips = NULL;
-	}
-
-	btc08->chips = NULL;
+	/* chips[] stays allocated, the miner thread accounts into it */
+	memset(btc08->chips, 0, MAX_CHAIN_LEN * sizeof(struct btc08_chip));
 	btc08->num_cores = 0;
 	btc08->perf = 0;
 	btc08->is_processing_job = false;
@@ -2141,10 +3117,6 @@ static bool reinit_btc08_chip(struct btc08_chain *btc08)
 	       btc08->spi_ctx->config.bus, btc08->spi_ctx->config.cs_line,
 	       btc08->chain_id, btc08->num_chips);
 
-	// Allocate memory for active chips
-	btc08->chips = calloc(btc08->num_active_chips, sizeof(struct btc08_chip));
-	assert (btc08->chips != NULL);
-
 	// Get feature & revision info
 	for(int chip_id = 1; chip_id <= btc08->num_active_chips; chip_id++) {
 		read_feature(btc08, chip_id);
@@ -2165,18 +3137,12 @@ static bool reinit_btc08_chip(struct btc08_chain *btc08)
 	// Set PLL config
 	if (!set_pll_config(btc08, BCAST_CHIP_ID, btc08_config_options.pll))
 		goto failure;
+	apply_pll_profile(btc08);
 
 	// RUN_BIST & READ_BIST to check the number of cores passed BIST
 	cmd_BIST_BCAST(btc08, BCAST_CHIP_ID);
-	for (int chip_id = 1; chip_id <= btc08->num_chips; chip_id++) {
-		if (check_chip(btc08, chip_id))
-		{
-			btc08->num_cores += btc08->chips[chip_id-1].num_cores;
-			btc08->perf += btc08->chips[chip_id-1].perf;
-		}
-		else
-			goto failure;
-	}
+	if (!check_chain(btc08))
+		goto failure;
 
 	if (btc08->num_cores < btc08_config_options.num_cores * btc08_config_options.num_chips)
 		goto failure;
@@ -2193,12 +3159,6 @@ static bool reinit_btc08_chip(struct btc08_chain *btc08)
 	return true;
 
 failure:
-	if (btc08->chips)
-	{
-		free(btc08->chips);
-		btc08->chips = NULL;
-	}
-
 	return false;
 }
 
@@ -2214,6 +3174,11 @@ struct btc08_chain *init_btc08_chain(struct spi_ctx *ctx, int chain_id)
 	btc08->spi_ctx = ctx;
 	btc08->chain_id = chain_id;
 	btc08->is_processing_job = false;
+	btc08->fd_gpio_gn  = -1;
+	btc08->fd_gpio_oon = -1;
+	btc08->fd_wakeup   = -1;
+	btc08->fd_volt     = -1;
+	btc08->fd_temp     = -1;
 
 	for(i=0; i<MAX_SPI_PORT; i++) {
 		if(ctx->config.bus == spi_available_bus[i])
@@ -2224,6 +3189,8 @@ struct btc08_chain *init_btc08_chain(struct spi_ctx *ctx, int chain_id)
 	btc08->pinnum_gpio_oon   =   oon_pin[i];
 	btc08->pinnum_gpio_reset = reset_pin[i];
 
+	open_chain_irqs(btc08);
+
 	// Check the number of the chips and the active chips via AUTO_ADDRESS & READ_ID
 	btc08->num_chips = chain_detect(btc08);
 	if (btc08->num_chips == 0) {
@@ -2234,11 +3201,20 @@ struct btc08_chain *init_btc08_chain(struct spi_ctx *ctx, int chain_id)
 	       btc08->spi_ctx->config.bus, btc08->spi_ctx->config.cs_line,
 	       btc08->chain_id, btc08->num_chips);
 
-	// Allocate memory for active chips
-	btc08->chips = calloc(btc08->num_active_chips, sizeof(struct btc08_chip));
+	// Allocate memory for the whole chain, a reinit may find more active chips
+	btc08->chips = calloc(MAX_CHAIN_LEN, sizeof(struct btc08_chip));
 	assert (btc08->chips != NULL);
-	btc08->xfr = calloc(btc08->num_active_chips+4, sizeof(struct spi_ioc_transfer)); // 2 for WRITE_TARGET, RUN_JOB
+	btc08->chip_stats = calloc(MAX_CHAIN_LEN, sizeof(struct btc08_chip_stats));
+	assert (btc08->chip_stats != NULL);
+	btc08->xfr = calloc(MAX_CHAIN_LEN+4, sizeof(struct spi_ioc_transfer)); // 2 for WRITE_TARGET, RUN_JOB
 	assert (btc08->xfr != NULL);
+	init_job_slot(btc08);
+	// one frame per chip for batched READ_JOB_ID/READ_RESULT, sized for
+	// the whole chain like chips[] as a reinit may find more active chips
+	btc08->num_batch_slots = MAX_CHAIN_LEN;
+	btc08->spi_tx_a = calloc(btc08->num_batch_slots, BATCH_SLOT_LEN);
+	btc08->spi_rx_a = calloc(btc08->num_batch_slots, BATCH_SLOT_LEN);
+	assert (btc08->spi_tx_a != NULL && btc08->spi_rx_a != NULL);
 
 	// Get feature & revision info
 	for(chip_id = 1; chip_id <= btc08->num_active_chips; chip_id++) {
@@ -2260,18 +3236,12 @@ struct btc08_chain *init_btc08_chain(struct spi_ctx *ctx, int chain_id)
 	// Set PLL config
 	if (!set_pll_config(btc08, BCAST_CHIP_ID, btc08_config_options.pll))
 		goto failure;
+	apply_pll_profile(btc08);
 
 	// RUN_BIST & READ_BIST to check the number of cores passed BIST
 	cmd_BIST_BCAST(btc08, BCAST_CHIP_ID);
-	for (chip_id = 1; chip_id <= btc08->num_chips; chip_id++) {
-		if (check_chip(btc08, chip_id))
-		{
-			btc08->num_cores += btc08->chips[chip_id-1].num_cores;
-			btc08->perf += btc08->chips[chip_id-1].perf;
-		}
-		else
-			goto failure;
-	}
+	if (!check_chain(btc08))
+		goto failure;
 
 	if (btc08->num_cores < btc08_config_options.num_cores * btc08_config_options.num_chips)
 		goto failure;
@@ -2312,8 +3282,14 @@ struct btc08_chain *init_btc08_chain(struct spi_ctx *ctx, int chain_id)
 	applog(LOG_WARNING, "%d: found %d chips with total %d active cores",
 	       btc08->chain_id, btc08->num_active_chips, btc08->num_cores);
 
-	mutex_init(&btc08->lock);
-	INIT_LIST_HEAD(&btc08->active_wq.head);
+	spsc_ring_init(&btc08->work_ring, WORK_RING_ORDER, sizeof(struct work *));
+	spsc_ring_init(&btc08->result_ring, RESULT_RING_ORDER, sizeof(struct btc08_result));
+	cgsem_init(&btc08->result_ready);
+
+	btc08->volt_ch = chain_id;
+	btc08->fd_volt = open_adc(btc08->volt_ch);
+	btc08->fd_temp = open_temp_sensor(chain_id);
+	cgsem_init(&btc08->monitor_wake);
 
 	return btc08;
 
@@ -2322,7 +3298,7 @@ failure:
 	return NULL;
 }
 
-static bool detect_single_chain(struct spi_ctx *ctx, int idx)
+static struct btc08_chain *probe_single_chain(struct spi_ctx *ctx, int idx)
 {
 	applog(LOG_WARNING, "%d: checking single BTC08 chain", idx);
 	struct btc08_chain *btc08 = init_btc08_chain(ctx, idx);
@@ -2330,7 +3306,7 @@ static bool detect_single_chain(struct spi_ctx *ctx, int idx)
 		applog(LOG_ERR, "%d: BTC08 chain not detected", idx);
 
 		if (idx != 0)		// TODO: skip not connected hash board
-			return false;
+			return NULL;
 
 		for (int retry_cnt = 0; retry_cnt < 10; retry_cnt++)
 		{
@@ -2349,6 +3325,11 @@ static bool detect_single_chain(struct spi_ctx *ctx, int idx)
 		}
 	}
 
+	return btc08;
+}
+
+static void register_single_chain(struct btc08_chain *btc08, int idx)
+{
 	struct cgpu_info *cgpu = malloc(sizeof(*cgpu));
 	assert(cgpu != NULL);
 
@@ -2363,7 +3344,31 @@ static bool detect_single_chain(struct spi_ctx *ctx, int idx)
 	add_cgpu(cgpu);
 	applog(LOG_WARNING, "%d: Detected single BTC08 chain with %d chips / %d cores",
 	       idx, btc08->num_active_chips, btc08->num_cores);
-	return true;
+}
+
+/*
+ * Chains are brought up on a thread each, PLL lock and BIST of the
+ * hash boards overlap. All of them are joined before any is registered
+ * so cgpu numbering stays in SPI port order.
+ */
+struct chain_probe {
+	pthread_t pth;
+	bool started;
+	struct spi_ctx *ctx;
+	int idx;
+	struct btc08_chain *btc08;
+};
+
+static void *probe_chain_thread(void *userdata)
+{
+	struct chain_probe *probe = (struct chain_probe *)userdata;
+	char threadname[16];
+
+	snprintf(threadname, sizeof(threadname), "BTC08Probe%d", probe->idx);
+	RenameThread(threadname);
+
+	probe->btc08 = probe_single_chain(probe->ctx, probe->idx);
+	return NULL;
 }
 
 static void export_gpios()
@@ -2470,10 +3475,10 @@ static void export_gpios()
 void setup_hashboard_gpio(int port_num, int *plug_status, int *board_type)
 {
 	// Check hash board connection
-	*plug_status = get_gpio_value(plug_pin[port_num]);
+	*plug_status = btc08_gpio_get_value(plug_pin[port_num]);
 
 	// Read board type (HASH/VTK)
-	*board_type = get_gpio_value(boddet_pin[port_num]);
+	*board_type = btc08_gpio_get_value(boddet_pin[port_num]);
 
 	// Enable FN
 	set_gpio_value(pwren_pin[port_num], 1);
@@ -2538,10 +3543,22 @@ void btc08_detect(bool hotplug)
 		sscanf(opt_btc08_min_chips, "%d", &min_chips);
 		btc08_config_options.min_chips = min_chips;
 	}
+	if (opt_btc08_autotune != NULL) {
+		int min_mhz = 0;
+		int max_mhz = 0;
+		int max_temp = 0;
+
+		sscanf(opt_btc08_autotune, "%d:%d:%d",
+		       &min_mhz, &max_mhz, &max_temp);
+		btc08_config_options.autotune_min_mhz = min_mhz ? min_mhz : AUTOTUNE_DEF_MIN_MHZ;
+		btc08_config_options.autotune_max_mhz = max_mhz ? max_mhz : (btc08_config_options.pll + 100);
+		btc08_config_options.autotune_max_temp = max_temp ? max_temp : AUTOTUNE_DEF_MAX_TEMP;
+		load_pll_profile();
+	}
 	btc08_config_options.test_mode = 0;
 	if (opt_btc08_chiptest != NULL)
 		btc08_config_options.test_mode = 1;
-	if (get_gpio_value(15) == 0)
+	if (btc08_gpio_get_value(15) == 0)
 		btc08_config_options.test_mode = 1;
 
 	if (opt_btc08_test != NULL)
@@ -2567,6 +3584,9 @@ void btc08_detect(bool hotplug)
 
 	/* register global SPI context */
 	struct spi_config cfg = default_spi_config;
+	struct chain_probe probes[MAX_SPI_PORT];
+
+	memset(probes, 0, sizeof(probes));
 	for(ii=0; ii<MAX_SPI_PORT; ii++)
 	{
 		cfg.mode = SPI_MODE_0;
@@ -2575,14 +3595,48 @@ void btc08_detect(bool hotplug)
 
 		spi[ii] = spi_init(&cfg);
 		if (spi[ii] == NULL)
-			return;
+			break;
 
-		if (detect_single_chain(spi[ii], ii) == false)
+		probes[ii].ctx = spi[ii];
+		probes[ii].idx = ii;
+		if (pthread_create(&probes[ii].pth, NULL, probe_chain_thread, &probes[ii])) {
+			applog(LOG_ERR, "%d: failed to create BTC08 probe thread", ii);
+			probe_chain_thread(&probes[ii]);
+			continue;
+		}
+		probes[ii].started = true;
+	}
+
+	for(ii=0; ii<MAX_SPI_PORT; ii++)
+	{
+		if (probes[ii].started)
+			pthread_join(probes[ii].pth, NULL);
+	}
+
+	for(ii=0; ii<MAX_SPI_PORT; ii++)
+	{
+		if (probes[ii].ctx == NULL)
+			break;
+
+		if (probes[ii].btc08 != NULL)
+			register_single_chain(probes[ii].btc08, ii);
+		else
 			/* release SPI context if no BTC08 products found */
 			spi_exit(spi[ii]);
 	}
 }
 
+/********** SPI I/O thread */
+/* move works from btc08_queue_full() into the chain backlog */
+static void pull_work(struct btc08_chain *btc08)
+{
+	struct work *work;
+
+	while (btc08->active_wq.num_elems < WORK_QUEUE_DEPTH &&
+	       spsc_ring_pop(&btc08->work_ring, &work))
+		wq_enqueue(&btc08->active_wq, work);
+}
+
 static bool restart_btc08(struct cgpu_info *cgpu)
 {
 	struct btc08_chain *btc08 = cgpu->device_data;
@@ -2595,6 +3649,7 @@ static bool restart_btc08(struct cgpu_info *cgpu)
 	cid = btc08->chain_id;
 
 	applog(LOG_WARNING, "%d: BTC08 running flushwork", cid);
+	btc08->hard_flushes++;
 
 	/* stop chips hashing current work */
 	if (!abort_work(cid)) {
@@ -2608,17 +3663,13 @@ static bool restart_btc08(struct cgpu_info *cgpu)
 			continue;
 		applog(LOG_DEBUG, "[DELETE WORK] %d: flushing work[%d]: %s",
 				cid, i, work->job_id);
-		work_completed(cgpu, work);
+		retire_work(btc08, work);
 		btc08->work[i] = NULL;
 	}
 
 	/* flush queued work */
 	applog(LOG_DEBUG, "%d: flushing queued work...", cid);
-	while (btc08->active_wq.num_elems > 0) {
-		struct work *work = wq_dequeue(&btc08->active_wq);
-		assert(work != NULL);
-		work_completed(cgpu, work);
-	}
+	wq_drain(&btc08->active_wq, retire_work, btc08);
 	btc08->sdiff = 0;
 	btc08->is_processing_job = false;
 	btc08->num_cores = 0;
@@ -2628,8 +3679,7 @@ static bool restart_btc08(struct cgpu_info *cgpu)
 	/* reinit btc08 chip */
 	for (int retry_cnt = 0; retry_cnt < 10; retry_cnt++)
 	{
-		reinit_btc08_chip(btc08);
-		if (NULL == btc08)
+		if (!reinit_btc08_chip(btc08))
 			continue;
 
 		if (btc08->num_cores < btc08_config_options.num_cores * btc08_config_options.num_chips) {
@@ -2643,206 +3693,495 @@ static bool restart_btc08(struct cgpu_info *cgpu)
 	return ret;
 }
 
-static int64_t btc08_scanwork(struct thr_info *thr)
+/*
+ * Drop the host side of the pipeline only. Jobs already in the chip FIFO
+ * keep hashing and their results come back as stale since work[] is
+ * empty, while last_queued_id keeps advancing so the fresh jobs pushed on
+ * the next OON never reuse a job id that is still in flight.
+ */
+static void soft_flush_btc08(struct cgpu_info *cgpu)
 {
-	int i;
-	struct cgpu_info *cgpu = thr->cgpu;
 	struct btc08_chain *btc08 = cgpu->device_data;
 	int cid = btc08->chain_id;
-	int32_t nonce_ranges_processed = 0;
-	uint32_t nonce[4];
-	uint8_t chip_id, job_id, micro_job_id;
-	uint8_t gn_job_id, gn_irq;
-	uint8_t *res;
-	float perf;
 
-	// spi err
-	if ((0 == btc08->num_cores) || (MAX_CORES < btc08->num_cores)) {
-		applog(LOG_ERR, "%d: wrong num_cores: %d", btc08->chain_id, btc08->num_cores);
-		return -1;
+	applog(LOG_INFO, "%d: BTC08 running soft flushwork", cid);
+	btc08->soft_flushes++;
+
+	for (int i = 0; i <= JOB_ID_NUM_MASK; i++) {
+		struct work *work = btc08->work[i];
+		if (work == NULL)
+			continue;
+		applog(LOG_DEBUG, "[DELETE WORK] %d: flushing work[%d]: %s",
+				cid, i, work->job_id);
+		retire_work(btc08, work);
+		btc08->work[i] = NULL;
 	}
 
-	if (btc08->disabled) {
-		if (!restart_btc08(cgpu))
-		{
+	wq_drain(&btc08->active_wq, retire_work, btc08);
+}
+
+/* flush requested by btc08_flush_work(), returns false if the chain is lost */
+static bool handle_flush(struct cgpu_info *cgpu)
+{
+	struct btc08_chain *btc08 = cgpu->device_data;
+	struct work *work;
+
+	applog(LOG_WARNING, "%d: %s START", btc08->chain_id, __func__);
+
+	/* works handed over before the flush are stale as well */
+	while (spsc_ring_pop(&btc08->work_ring, &work))
+		retire_work(btc08, work);
+
+	btc08->flush_pending = true;
+
+	/* a misbehaving chain still gets the full reset */
+	if (!opt_btc08_hard_flush && !btc08->disabled && btc08->is_processing_job)
+		soft_flush_btc08(cgpu);
+	else if (!restart_btc08(cgpu))
+	{
+		applog(LOG_ERR, "num_chips:%d btc08->num_cores:%d", btc08->num_chips, btc08->num_cores);
+		return false;
+	}
+
+	applog(LOG_WARNING, "%d: %s END", btc08->chain_id, __func__);
+
+	return true;
+}
+
+/* fill the chip FIFO with the first works, returns false on SPI error */
+static bool start_jobs(struct btc08_chain *btc08)
+{
+	int cid = btc08->chain_id;
+
+	applog(LOG_INFO, "%d: BTC08 starting with the first work", cid);
+
+	cgtimer_time(&btc08->oon_begin);
+
+	for (int i=0; i<MAX_JOB_FIFO ; i++)
+	{
+		struct work *work = wq_dequeue(&btc08->active_wq);
+		if (work == NULL) {
+			applog(LOG_WARNING, "%d: work underflow for %dth work", cid, (i+1));
+			return true;
+		}
+
+		set_work(btc08, work);
+		if (btc08->disabled) {
 			applog(LOG_ERR, "chain%d is disabled", cid);
-			return -1;
+			return false;
 		}
+		btc08->is_processing_job = true;
+		btc08->is_first_oon = true;
 	}
 
-	mutex_lock(&btc08->lock);
+	// 4G / (num_chips * num_cores_of_each_chip * pll_freq_MHz) * 1000(sec to msec) * 2 oons * 2 times
+	btc08->timeout_oon = 4.*1024. / btc08->perf * 1000. * 4.;
+	reset_job_timing(btc08);
+
+	return true;
+}
+
+/* turn the GN results of all chips into BTC08_RES_NONCE */
+static void collect_nonces(struct btc08_chain *btc08)
+{
+	int cid = btc08->chain_id;
+	uint8_t gn_chips[MAX_CHAIN_LEN], gn_jobs[MAX_CHAIN_LEN];
+	uint8_t chip_id, job_id, micro_job_id;
+	struct btc08_result res;
+	int num_gn;
 
-	applog(LOG_INFO, "BTC08 running scanwork %s",
-			(false == btc08->is_processing_job) ? "with the first work":"");
+	num_gn = read_gn_results(btc08, gn_chips, gn_jobs);
+	if (num_gn < 0) {
+		applog(LOG_ERR, "chain%d is disabled", cid);
+		return;
+	}
 
-	if (!btc08->is_processing_job)
+	for (int n=0; n<num_gn; n++)
 	{
-		cgtimer_time(&btc08->oon_begin);
+		chip_id = gn_chips[n];
+		job_id  = gn_jobs[n];
 
-		// Try to run first 4 works
-		for (int i=0; i<MAX_JOB_FIFO ; i++)
-		{
-			struct work *work = wq_dequeue(&btc08->active_wq);
-			if (work == NULL) {
-				applog(LOG_WARNING, "%d: work underflow for %dth work", cid, (i+1));
-				goto failure;
-			}
+		memset(&res, 0, sizeof(res));
+		if (!get_nonce(btc08, batch_resp(btc08, n), (uint8_t*)&res.nonce[0], chip_id, &micro_job_id))
+			continue;
 
-			set_work(btc08, work);
-			if (btc08->disabled) {
-				applog(LOG_ERR, "chain%d is disabled", cid);
-				goto failure;
-			} else {
-				btc08->is_processing_job = true;
-				btc08->is_first_oon = true;
-			}
+		if (job_id < 1 || job_id > (JOB_ID_NUM_MASK+1)) {
+			applog(LOG_WARNING, "%d: chip %d: result has wrong job_id %d",
+					cid, chip_id, job_id);
+			continue;
+		}
+
+		struct btc08_chip *chip = &btc08->chips[chip_id - 1];
+		struct work *work = btc08->work[job_id - 1];
+		if (work == NULL) {
+			// already been flushed => stale
+			applog(LOG_WARNING, "%d: already been flushed job_id %d chip %d: "
+					"stale nonce 0x%08x 0x%08x 0x%08x 0x%08x",
+					cid, job_id, chip_id, res.nonce[0], res.nonce[1], res.nonce[2], res.nonce[3]);
+			chip->stales++;
+			continue;
 		}
+
+		trace_event(TRACE_GN, work->trace_id, btc08->cgpu->device_id,
+			    chip_id, job_id, micro_job_id);
+		res.type = BTC08_RES_NONCE;
+		res.work = work;
+		res.chip_id = chip_id;
+		res.job_id = job_id;
+		res.micro_job_id = micro_job_id;
+		push_result(btc08, &res);
 	}
+}
 
-	// 4G / (num_chips * num_cores_of_each_chip * pll_freq_MHz) * 1000(sec to msec) * 2 oons * 2 times
-	btc08->timeout_oon = 4.*1024. / btc08->perf * 1000. * 4.;
+/*
+ * Next work for the chip FIFO. A soft flush empties the backlog while the
+ * chips keep hashing, so wait up to wait_ms for fresh work rather than let
+ * the FIFO run dry into an OON timeout and a hard restart.
+ */
+static struct work *next_work(struct btc08_chain *btc08, int wait_ms)
+{
+	cgtimer_t ts_start, ts_now, ts_diff;
+	struct work *work;
+	int remain_ms;
+
+	cgtimer_time(&ts_start);
+	while (42) {
+		pull_work(btc08);
+		work = wq_dequeue(&btc08->active_wq);
+		if (work != NULL || btc08->cgpu->shutdown ||
+		    atomic_load(&btc08->flush_req))
+			return work;
+
+		cgtimer_time(&ts_now);
+		cgtimer_sub(&ts_now, &ts_start, &ts_diff);
+		remain_ms = wait_ms - cgtimer_to_ms(&ts_diff);
+		if (remain_ms <= 0)
+			return NULL;
+
+		/* btc08_queue_full() kicks fd_wakeup once this is seen */
+		atomic_store(&btc08->spi_starved, true);
+		btc08_wait_eventfd(btc08->fd_wakeup, remain_ms);
+	}
+}
+
+/*
+ * Right after an OON refill every chip has jobs queued back to back, so
+ * keep polling until each chip had its jobs timed for this window, the
+ * next OON fires or about three jobs passed. GN results are collected on
+ * the way.
+ */
+static void poll_job_timing(struct btc08_chain *btc08)
+{
+	uint64_t end_ns;
+
+	if (btc08_config_options.test_mode == 1 || rebalance_timed(btc08))
+		return;
 
-	/* poll queued results */
-	while(true)
+	end_ns = now_ns() + (uint64_t)btc08->timeout_oon * 1000000 * 3 / 4;
+	while (!btc08->disabled && !rebalance_timed(btc08) && now_ns() < end_ns) {
+		if (0 == btc08_gpio_irq_value(btc08->fd_gpio_oon, btc08->pinnum_gpio_oon))
+			break;
+		collect_nonces(btc08);
+	}
+}
+
+/* refill the chip FIFO on OON and report the finished nonce ranges */
+static void handle_oon(struct btc08_chain *btc08)
+{
+	int cid = btc08->chain_id;
+	struct btc08_result res;
+	int refill = OON_INT_MAXJOB;
+
+	applog(LOG_INFO, "================= OON IRQ!!!! =================");
+
+	cgtimer_time(&btc08->oon_begin);
+	applog(LOG_DEBUG, "%d: oon_begin:%d", cid, cgtimer_to_ms(&btc08->oon_begin));
+
+	memset(&res, 0, sizeof(res));
+	res.type = BTC08_RES_OON;
+	if (btc08->is_first_oon) {
+		res.nonce_ranges = 1;
+		btc08->is_first_oon = false;
+	} else {
+		res.nonce_ranges = 2;
+	}
+	trace_event(TRACE_OON, 0, btc08->cgpu->device_id, TRACE_NONE,
+		    TRACE_NONE, res.nonce_ranges);
+	push_result(btc08, &res);
+
+	applog(LOG_INFO, "%d: job done ", cid);
+
+	cmd_CLEAR_OON(btc08, BCAST_CHIP_ID);
+
+	btc08->rebalance_oons++;
+	if (btc08->tune_drain) {
+		// the FIFO ran dry, the chain is idle until it is refilled
+		autotune_pll(btc08);
+		btc08->tune_drain = false;
+		refill = MAX_JOB_FIFO;
+		btc08->is_first_oon = true;
+		reset_rebalance(btc08);
+	} else if (rebalance_due(btc08)) {
+		bool relock = autotune_plan(btc08);
+
+		rebalance_nonce_range(btc08);
+		if (relock) {
+			// leave the jobs in flight to finish before the clocks change
+			btc08->tune_drain = true;
+			return;
+		}
+	}
+
+	// Fill 2 works into FIFO whenever OON occurs, all of it after a drain,
+	// waiting for the first one within half the OON budget if the backlog
+	// is empty
+	for (int i=0; i<refill; i++)
 	{
-		{
-			cgtimer_t ts_now, ts_diff;
-			cgtimer_time(&ts_now);
-			cgtimer_sub(&ts_now, &btc08->oon_begin, &ts_diff);
+		int wait_ms = i ? 0 : MIN(REFILL_WAIT_MS, btc08->timeout_oon / 2);
+		struct work *work = next_work(btc08, wait_ms);
+		if (work == NULL) {
+			applog(LOG_WARNING, "%d: work underflow", cid);
+			break;
+		}
+		set_work(btc08, work);
+		if (btc08->disabled) {
+			applog(LOG_ERR, "chain%d is disabled", cid);
+			break;
+		}
+	}
 
-			if (cgtimer_to_ms(&ts_diff) > btc08->timeout_oon)
-			{
-				applog(LOG_WARNING, "%d: stop waiting irq because of OON timeout", cid);
-				applog(LOG_WARNING, "diff:%d(now:%d, oon_begin:%d), btc08->timeout_oon:%d",
-						cgtimer_to_ms(&ts_diff), cgtimer_to_ms(&ts_now),
-						cgtimer_to_ms(&btc08->oon_begin), btc08->timeout_oon);
-				btc08->disabled = true;
-				cgtimer_time(&btc08->oon_begin);
+	// the PLL relock may have taken a while, the refilled jobs start now
+	if (refill == MAX_JOB_FIFO)
+		cgtimer_time(&btc08->oon_begin);
+
+	poll_job_timing(btc08);
+}
+
+/* wait once for GN/OON and service what fired */
+static void service_chain(struct btc08_chain *btc08)
+{
+	int cid = btc08->chain_id;
+	int pins, oon_remain_ms;
+	cgtimer_t ts_now, ts_diff;
+
+	cgtimer_time(&ts_now);
+	cgtimer_sub(&ts_now, &btc08->oon_begin, &ts_diff);
+
+	oon_remain_ms = btc08->timeout_oon - cgtimer_to_ms(&ts_diff);
+	if (oon_remain_ms < 0)
+	{
+		applog(LOG_WARNING, "%d: stop waiting irq because of OON timeout", cid);
+		applog(LOG_WARNING, "diff:%d(now:%d, oon_begin:%d), btc08->timeout_oon:%d",
+				cgtimer_to_ms(&ts_diff), cgtimer_to_ms(&ts_now),
+				cgtimer_to_ms(&btc08->oon_begin), btc08->timeout_oon);
+		btc08->disabled = true;
+		cgtimer_time(&btc08->oon_begin);
+		return;
+	}
+
+	pins = btc08_gpio_pending(btc08->fd_gpio_gn, btc08->pinnum_gpio_gn,
+				  btc08->fd_gpio_oon, btc08->pinnum_gpio_oon,
+				  btc08->fd_wakeup, oon_remain_ms);
+	if (!pins)
+		return;
+
+	// Check GN GPIO Pin
+	if (pins & BTC08_PIN_GN) {
+		applog(LOG_WARNING, "================= GN IRQ !!!! =================");
+		collect_nonces(btc08);
+	}
+
+	// Check OON GPIO Pin
+	if ((pins & BTC08_PIN_OON) && !btc08->disabled)
+		handle_oon(btc08);
+
+	cgsem_post(&btc08->result_ready);
+}
+
+static void *btc08_spi_thread(void *userdata)
+{
+	struct cgpu_info *cgpu = (struct cgpu_info *)userdata;
+	struct btc08_chain *btc08 = cgpu->device_data;
+	int cid = btc08->chain_id;
+	char threadname[16];
+
+	snprintf(threadname, sizeof(threadname), "BTC08SPI%d", cid);
+	RenameThread(threadname);
+
+	applog(LOG_INFO, "%d: BTC08 SPI thread started", cid);
+
+	publish_stats(btc08);
+	while (likely(!cgpu->shutdown)) {
+		maybe_publish_stats(btc08);
+
+		if (atomic_exchange(&btc08->flush_req, false)) {
+			if (!handle_flush(cgpu))
 				break;
-			}
+			cgsem_post(&btc08->result_ready);
 		}
 
-		if (thr->work_restart)
-		{
-			applog(LOG_WARNING, "%d: stop waiting irq because of work_restart", cid);
-			cgtimer_time(&btc08->oon_begin);
+		if (btc08->disabled) {
+			bool restarted = restart_btc08(cgpu);
+
+			cgsem_post(&btc08->result_ready);
+			if (!restarted)
+				break;
+		}
+
+		// spi err
+		if ((0 == btc08->num_cores) || (MAX_CORES < btc08->num_cores)) {
+			applog(LOG_ERR, "%d: wrong num_cores: %d", cid, btc08->num_cores);
 			break;
 		}
 
-		// Check GN GPIO Pin
-		if (0 == get_gpio_value(btc08->pinnum_gpio_gn))
-		{
-			applog(LOG_WARNING, "================= GN IRQ !!!! =================");
-			for (int i=1; i<=btc08->num_active_chips; i++)
-			{
-				res = cmd_READ_JOB_ID(btc08, i);
-				gn_job_id  = res[1];
-				gn_irq 	   = res[2] & (1<<0);
-				chip_id    = res[3];
-
-				if (0 != gn_irq)
-				{
-					job_id = gn_job_id;
-					if (get_nonce(btc08, (uint8_t*)&nonce[0], &chip_id, &micro_job_id))
-					{
-						if (chip_id < 1 || chip_id > btc08->num_active_chips) {
-							applog(LOG_WARNING, "%d: wrong chip_id %d", cid, chip_id);
-							continue;
-						}
-						if (job_id < 1 || job_id > (JOB_ID_NUM_MASK+1)) {
-							applog(LOG_WARNING, "%d: chip %d: result has wrong job_id %d",
-									cid, chip_id, job_id);
-							continue;
-						}
-
-						struct btc08_chip *chip = &btc08->chips[chip_id - 1];
-						struct work *work = btc08->work[job_id - 1];
-						if (work == NULL) {
-							// already been flushed => stale
-							applog(LOG_WARNING, "%d: already been flushed job_id %d chip %d: "
-									"stale nonce 0x%08x 0x%08x 0x%08x 0x%08x",
-									cid, job_id, chip_id, nonce[0], nonce[1], nonce[2], nonce[3]);
-							chip->stales++;
-							continue;
-						}
-
-						// submit nonce
-						for (i=0; i<ASIC_BOOST_CORE_NUM; i++)
-						{
-							if ((micro_job_id & (1<<i)) != 0)
-							{
-								work->micro_job_id = (1<<i);
-								if (work->pool->vmask) {
-									memcpy(work->data, &(work->pool->vmask_001[(1<<i)]), 4);
-								}
-
-								if (opt_debug) {
-									char s[2048];
-									snprintf(s, sizeof(s),
-											"[GN WORK] btc08->work[%d] gn_job_id:%d for work_job_id:%s",
-											(job_id - 1), job_id, work->job_id);
-									dump_work(s, work);
-									dump_work_list(btc08);
-								}
-								if (!submit_nonce(thr, work, nonce[i])) {
-									applog(LOG_ERR, "%d: chip %d(job_id:%d, micro_jobid:%d): invalid nonce 0x%08x",
-										cid, chip_id, job_id, work->micro_job_id, nonce[i]);
-									chip->hw_errors++;
-									/* add a penalty of a full nonce range on HW errors */
-									nonce_ranges_processed--;
-									continue;
-								}
-								applog(LOG_WARNING, "YEAH: %d: chip %d (job_id:%d, micro_job_id:%d): nonce 0x%08x",
-									cid, chip_id, job_id, work->micro_job_id, nonce[i]);
-								chip->nonces_found++;
-							}
-						}
-					}
-				}
+		pull_work(btc08);
+
+		if (!btc08->is_processing_job) {
+			if (btc08->active_wq.num_elems < MAX_JOB_FIFO) {
+				/* btc08_queue_full() kicks fd_wakeup once this is seen */
+				atomic_store(&btc08->spi_starved, true);
+				if (spsc_ring_count(&btc08->work_ring) == 0)
+					wait_gpio_irq(btc08, SPI_IDLE_WAIT_MS);
+				continue;
 			}
+			if (!start_jobs(btc08))
+				continue;
 		}
 
-		// Check OON GPIO Pin
-		if (0 == get_gpio_value(btc08->pinnum_gpio_oon))
-		{
-			applog(LOG_INFO, "================= OON IRQ!!!! =================");
+		service_chain(btc08);
+	}
 
-			cgtimer_time(&btc08->oon_begin);
-			applog(LOG_DEBUG, "%d: oon_begin:%d", cid, cgtimer_to_ms(&btc08->oon_begin));
+	if (!cgpu->shutdown) {
+		applog(LOG_ERR, "chain%d is disabled", cid);
+		atomic_store(&btc08->failed, true);
+		cgsem_post(&btc08->result_ready);
+	}
 
-			if (btc08->is_first_oon) {
-				nonce_ranges_processed += 1;
-				btc08->is_first_oon = false;
-			} else {
-				nonce_ranges_processed += 2;
-			}
+	return NULL;
+}
 
-			applog(LOG_INFO, "%d: job done ", cid);
+static bool btc08_thread_prepare(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct btc08_chain *btc08 = cgpu->device_data;
 
-			cmd_CLEAR_OON(btc08, BCAST_CHIP_ID);
+	if (thr_info_create(&(btc08->spi_thr), NULL, btc08_spi_thread, (void *)cgpu)) {
+		applog(LOG_ERR, "%d: BTC08 SPI thread create failed", btc08->chain_id);
+		return false;
+	}
+	pthread_detach(btc08->spi_thr.pth);
 
-			// Fill 2 works into FIFO whenever OON occurs
-			for (int i=0; i<2; i++)
-			{
-				struct work *work = wq_dequeue(&btc08->active_wq);
-				if (work == NULL) {
-					applog(LOG_WARNING, "%d: work underflow", cid);
-					break;
-				}
-				set_work(btc08, work);
-				if (btc08->disabled) {
-					applog(LOG_ERR, "chain%d is disabled", cid);
-					goto failure;
-				}
-			}
-			break;
+	if (thr_info_create(&(btc08->monitor_thr), NULL, btc08_monitor_thread, (void *)cgpu)) {
+		applog(LOG_ERR, "%d: BTC08 monitor thread create failed", btc08->chain_id);
+		return false;
+	}
+	pthread_detach(btc08->monitor_thr.pth);
+
+	return true;
+}
+
+static void btc08_thread_shutdown(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct btc08_chain *btc08 = cgpu->device_data;
+
+	cgpu->shutdown = true;
+	if (btc08->fd_wakeup >= 0)
+		btc08_signal_eventfd(btc08->fd_wakeup);
+	cgsem_post(&btc08->monitor_wake);
+}
+
+/* runs once the nonces of a GN result are verified, on a verifier thread
+ * with --verify-threads */
+static void btc08_verify_done(struct thr_info __maybe_unused *thr,
+			      struct nonce_batch *batch)
+{
+	struct btc08_chain *btc08 = batch->data;
+	struct btc08_chip *chip = &btc08->chips[batch->chip_id - 1];
+	int cid = btc08->chain_id;
+	int hw_errors = 0;
+
+	for (int i=0; i<batch->count; i++)
+	{
+		if (!batch->valid[i]) {
+			applog(LOG_ERR, "%d: chip %d(job_id:%d, micro_jobid:%d): invalid nonce 0x%08x",
+				cid, batch->chip_id, batch->job_id, batch->micro_job_ids[i],
+				batch->nonces[i]);
+			atomic_fetch_add(&chip->hw_errors, 1);
+			hw_errors++;
+			continue;
 		}
+		applog(LOG_WARNING, "YEAH: %d: chip %d (job_id:%d, micro_job_id:%d): nonce 0x%08x",
+			cid, batch->chip_id, batch->job_id, batch->micro_job_ids[i],
+			batch->nonces[i]);
+		atomic_fetch_add(&chip->nonces_found, 1);
+	}
+
+	if (hw_errors)
+		atomic_fetch_add(&btc08->verify_hw_errors, hw_errors);
+}
 
-		sched_yield();
+/* hand the nonces of one GN result over for verification */
+static void submit_result(struct thr_info *thr, struct btc08_chain *btc08,
+			  struct btc08_result *res)
+{
+	struct work *work = res->work;
+	struct nonce_batch batch;
+
+	batch.data = btc08;
+	batch.chip_id = res->chip_id;
+	batch.job_id = res->job_id;
+	batch.count = 0;
+	for (int i=0; i<ASIC_BOOST_CORE_NUM; i++)
+	{
+		if ((res->micro_job_id & (1<<i)) == 0)
+			continue;
+		batch.micro_job_ids[batch.count] = (1<<i);
+		batch.nonces[batch.count++] = res->nonce[i];
+	}
+
+	if (opt_debug) {
+		char s[2048];
+		snprintf(s, sizeof(s),
+				"[GN WORK] btc08->work[%d] gn_job_id:%d for work_job_id:%s",
+				(res->job_id - 1), res->job_id, work->job_id);
+		dump_work(s, work);
 	}
 
-	mutex_unlock(&btc08->lock);
+	submit_nonces_async(thr, work, &batch, btc08_verify_done);
+}
+
+static int64_t btc08_scanwork(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct btc08_chain *btc08 = cgpu->device_data;
+	int cid = btc08->chain_id;
+	int32_t nonce_ranges_processed = 0;
+	struct btc08_result res;
+
+	if (atomic_load(&btc08->failed))
+		return -1;
+
+	if (spsc_ring_count(&btc08->result_ring) == 0)
+		cgsem_mswait(&btc08->result_ready, SCANWORK_WAIT_MS);
+
+	while (spsc_ring_pop(&btc08->result_ring, &res))
+	{
+		switch (res.type) {
+			case BTC08_RES_NONCE:
+				submit_result(thr, btc08, &res);
+				break;
+			case BTC08_RES_OON:
+				nonce_ranges_processed += res.nonce_ranges;
+				break;
+			case BTC08_RES_DONE:
+				work_completed(cgpu, res.work);
+				break;
+		}
+	}
 
+	/* add a penalty of a full nonce range on HW errors */
+	nonce_ranges_processed -= atomic_exchange(&btc08->verify_hw_errors, 0);
 	if (nonce_ranges_processed < 0)
 		nonce_ranges_processed = 0;
 
@@ -2852,7 +4191,9 @@ static int64_t btc08_scanwork(struct thr_info *thr)
 	}
 
 #if defined(USE_BTC08_FPGA)
-	if (nonce_ranges_processed == 1) {
+	if (nonce_ranges_processed == 0) {
+		return 0;
+	} else if (nonce_ranges_processed == 1) {
 		return ((uint64_t)MAX_NONCE_SIZE + 1) * ASIC_BOOST_CORE_NUM;
 	} else {
 		return ((uint64_t)MAX_NONCE_SIZE + 1) * 2 * ASIC_BOOST_CORE_NUM;
@@ -2860,31 +4201,31 @@ static int64_t btc08_scanwork(struct thr_info *thr)
 #else
 	return ((int64_t)nonce_ranges_processed << 32) * ASIC_BOOST_CORE_NUM;		// nonce range : 4G
 #endif
-
-failure:
-	mutex_unlock(&btc08->lock);
-	return 0;
 }
 
-
-/* queue two work items per chip in chain */
+/* hand works to the SPI thread until its ring is full */
 static bool btc08_queue_full(struct cgpu_info *cgpu)
 {
 	struct btc08_chain *btc08 = cgpu->device_data;
-	int queue_full = false;
+	struct work *work;
 
-	mutex_lock(&btc08->lock);
-	applog(LOG_DEBUG, "%d, BTC08 running queue_full: %d/%d",
-	       btc08->chain_id, btc08->active_wq.num_elems, (MAX_JOB_FIFO*10));
+	applog(LOG_DEBUG, "%d, BTC08 running queue_full: %u/%u",
+	       btc08->chain_id, spsc_ring_count(&btc08->work_ring),
+	       btc08->work_ring.mask + 1);
 
-	if (btc08->active_wq.num_elems >= MAX_JOB_FIFO*10)
-		queue_full = true;
-	else
-		wq_enqueue(&btc08->active_wq, get_queued(cgpu));
+	if (spsc_ring_full(&btc08->work_ring))
+		return true;
 
-	mutex_unlock(&btc08->lock);
+	work = get_queued(cgpu);
+	if (work != NULL) {
+		trace_event(TRACE_WORK_QUEUED, work->trace_id, cgpu->device_id,
+			    TRACE_NONE, TRACE_NONE, 0);
+		spsc_ring_push(&btc08->work_ring, &work);
+		if (atomic_exchange(&btc08->spi_starved, false))
+			btc08_signal_eventfd(btc08->fd_wakeup);
+	}
 
-	return queue_full;
+	return spsc_ring_full(&btc08->work_ring);
 }
 
 static void btc08_flush_work(struct cgpu_info *cgpu)
@@ -2894,65 +4235,117 @@ static void btc08_flush_work(struct cgpu_info *cgpu)
 	if (btc08 == NULL)
 		return;
 
-	mutex_lock(&btc08->lock);
-
-	applog(LOG_WARNING, "%s START", __func__);
-
-	if (!restart_btc08(cgpu))
-	{
-		applog(LOG_ERR, "num_chips:%d btc08->num_cores:%d", btc08->num_chips, btc08->num_cores);
-		cgpu->deven = DEV_DISABLED;
-	}
-
-	applog(LOG_WARNING, "%s END", __func__);
-
-	mutex_unlock(&btc08->lock);
+	/* the SPI thread picks the request up as soon as it wakes */
+	atomic_store(&btc08->flush_begin_ns, now_ns());
+	atomic_store(&btc08->flush_req, true);
+	if (btc08->fd_wakeup >= 0)
+		btc08_signal_eventfd(btc08->fd_wakeup);
 }
 
 static void btc08_get_statline_before(char *buf, size_t len,
 				   struct cgpu_info *cgpu)
 {
 	struct btc08_chain *btc08 = cgpu->device_data;
+	struct btc08_sensors sensors;
 	char temp[10];
-	if (btc08->temp != 0)
-		snprintf(temp, 9, "%2dC", btc08->temp[0]);
+
+	read_sensors(btc08, &sensors);
+	if (sensors.high_temp_val != 0)
+		snprintf(temp, 9, "%2dC", sensors.high_temp_val);
 	tailsprintf(buf, len, " %2d:%2d/%3d %s",
 		    btc08->chain_id, btc08->num_active_chips, btc08->num_cores,
-		    btc08->temp[0] == 0 ? "   " : temp);
+		    sensors.high_temp_val == 0 ? "   " : temp);
 }
 
 static struct api_data *btc08_api_stats(struct cgpu_info *cgpu)
 {
        struct api_data *root = NULL;
        struct btc08_chain *btc08 = cgpu->device_data;
+       struct btc08_sensors sensors;
+       struct btc08_stats stats;
+       struct btc08_chip_stats *chips;
+       float volt, hi_temp;
+
+       read_sensors(btc08, &sensors);
+       chips = cgcalloc(MAX_CHAIN_LEN, sizeof(*chips));
+       read_stats(btc08, &stats, chips);
 
        root = api_add_int(root, "chain_id", &(btc08->chain_id), false);
 
-       root = api_add_int(root, "asic_count", &(btc08->num_chips), false);
+       root = api_add_int(root, "asic_count", &(stats.num_chips), true);
 
-       btc08->volt_f = (float)btc08->mvolt/1000.0;
-       root = api_add_volts(root, "volt", &(btc08->volt_f), false);
+       volt = (float)sensors.mvolt/1000.0;
+       root = api_add_volts(root, "volt", &volt, true);
 
-       btc08->high_temp_val_f = (float)btc08->high_temp_val;
-       root = api_add_temp(root, "hi_temp", &(btc08->high_temp_val_f), false);
+       hi_temp = (float)sensors.high_temp_val;
+       root = api_add_temp(root, "hi_temp", &hi_temp, true);
 
-       root = api_add_int(root, "hot_chip", &(btc08->high_temp_id), false);
+       root = api_add_int(root, "hot_chip", &(sensors.high_temp_id), true);
+
+       root = api_add_int(root, "flush_soft", &(stats.soft_flushes), true);
+       root = api_add_int(root, "flush_hard", &(stats.hard_flushes), true);
+       root = api_add_int(root, "flush_latency_ms", &(stats.flush_last_ms), true);
+       root = api_add_int(root, "flush_latency_max_ms", &(stats.flush_max_ms), true);
+       root = api_add_double(root, "flush_latency_avg_ms", &(stats.flush_avg_ms), true);
+
+       root = api_add_int(root, "nonce_rebalances", &(stats.nonce_rebalances), true);
+       for (int i = stats.last_chip; i < stats.num_chips; i++) {
+               struct btc08_chip_stats *chip = &chips[i];
+               char name[32];
+
+               snprintf(name, sizeof(name), "chip%d_nonce_start", i + 1);
+               root = api_add_hex32(root, name, &(chip->start_nonce), true);
+               snprintf(name, sizeof(name), "chip%d_nonce_end", i + 1);
+               root = api_add_hex32(root, name, &(chip->end_nonce), true);
+               snprintf(name, sizeof(name), "chip%d_rate_mhs", i + 1);
+               root = api_add_mhs(root, name, &(chip->rate_mhs), true);
+               snprintf(name, sizeof(name), "chip%d_mhz", i + 1);
+               root = api_add_uint64(root, name, &(chip->mhz), true);
+       }
+       free(chips);
 
        root = api_add_int(root, "chain_id_end", &(btc08->chain_id), false);
 
        return root;
 }
 
+static bool btc08_get_chip_metrics(struct cgpu_info *cgpu, int chip, struct chip_metrics *metrics)
+{
+	struct btc08_chain *btc08 = cgpu->device_data;
+	struct btc08_chip_stats cs;
+	struct btc08_chip *c;
+	int last_chip, i;
+
+	if (!read_chip_stats(btc08, chip, &last_chip, &cs))
+		return false;
+
+	/* the nonce counters are atomics, safe to read live */
+	i = last_chip + chip;
+	c = &btc08->chips[i];
+	metrics->chip_id = i + 1;
+	if (last_chip)
+		metrics->chip_id += 1 - last_chip;
+	metrics->nonces = atomic_load(&c->nonces_found);
+	metrics->hw_errors = atomic_load(&c->hw_errors);
+	metrics->stales = cs.stales;
+	metrics->mhz = cs.mhz;
+	metrics->disabled = cs.disabled;
+	return true;
+}
+
 struct device_drv btc08_drv = {
 	.drv_id = DRIVER_btc08,
 	.dname = "BTC08",
 	.name = "BTC08",
 	.drv_detect = btc08_detect,
 
+	.thread_prepare = btc08_thread_prepare,
+	.thread_shutdown = btc08_thread_shutdown,
 	.hash_work = hash_queued_work,
 	.scanwork = btc08_scanwork,
 	.queue_full = btc08_queue_full,
 	.flush_work = btc08_flush_work,
 	.get_api_stats = btc08_api_stats,
+	.get_chip_metrics = btc08_get_chip_metrics,
 	.get_statline_before = btc08_get_statline_before,
 };
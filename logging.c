@@ -21,6 +21,30 @@ bool opt_log_output = false;
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
 
+/* Once start_log_writer() has run, logging threads only copy their message
+ * into a slot of this bounded MPSC ring and log_writer_thread() does the
+ * timestamp formatting and the writes. Each slot's seq says whose turn it
+ * is: pos when free for the producer claiming position pos, pos + 1 once
+ * that producer has filled it. A full ring drops the message and counts it
+ * in log_dropped rather than stall the caller. */
+#define LOG_RING_SIZE 1024
+#define LOG_REC_SIZ 512
+
+struct log_rec {
+	atomic_uint_fast64_t seq;
+	int prio;
+	bool simple;
+	struct timeval tv;
+	char str[LOG_REC_SIZ];
+};
+
+static struct log_rec *log_ring;
+static atomic_uint_fast64_t log_tail;
+static uint64_t log_head;
+static atomic_bool log_writer_sleeping;
+static cgsem_t log_sem;
+atomic_uint_fast64_t log_dropped;
+
 static void my_log_curses(int prio, const char *datetime, const char *str, bool force)
 {
 	if (opt_quiet && prio != LOG_ERR)
@@ -45,12 +69,31 @@ static void my_log_curses(int prio, const char *datetime, const char *str, bool
 	}
 }
 
-/* high-level logging function, based on global opt_log_level */
+/* The broken down time is cached per thread for the current second, which
+ * in practice means for the writer thread */
+static void log_datetime(char *datetime, size_t siz, struct timeval *tv)
+{
+	static _Thread_local time_t last_sec = -1;
+	static _Thread_local char last_prefix[96];
 
-/*
- * log function
- */
-void _applog(int prio, const char *str, bool force)
+	if (tv->tv_sec != last_sec) {
+		const time_t tmp_time = tv->tv_sec;
+		struct tm tm;
+
+		localtime_r(&tmp_time, &tm);
+		snprintf(last_prefix, sizeof(last_prefix), "%d-%02d-%02d %02d:%02d:%02d",
+			tm.tm_year + 1900,
+			tm.tm_mon + 1,
+			tm.tm_mday,
+			tm.tm_hour,
+			tm.tm_min,
+			tm.tm_sec);
+		last_sec = tv->tv_sec;
+	}
+	snprintf(datetime, siz, " [%s.%03d] ", last_prefix, (int)(tv->tv_usec / 1000));
+}
+
+static void log_output(int prio, bool simple, struct timeval *tv, const char *str, bool force)
 {
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
@@ -60,23 +103,12 @@ void _applog(int prio, const char *str, bool force)
 	if (0) {}
 #endif
 	else {
-		char datetime[64];
-		struct timeval tv = {0, 0};
-		struct tm *tm;
-
-		cgtime_real(&tv);
-
-		const time_t tmp_time = tv.tv_sec;
-		int ms = (int)(tv.tv_usec / 1000);
-		tm = localtime(&tmp_time);
+		char datetime[128];
 
-		snprintf(datetime, sizeof(datetime), " [%d-%02d-%02d %02d:%02d:%02d.%03d] ",
-			tm->tm_year + 1900,
-			tm->tm_mon + 1,
-			tm->tm_mday,
-			tm->tm_hour,
-			tm->tm_min,
-			tm->tm_sec, ms);
+		if (simple)
+			datetime[0] = '\0';
+		else
+			log_datetime(datetime, sizeof(datetime), tv);
 
 		/* Only output to stderr if it's not going to the screen as well */
 		if (!isatty(fileno((FILE *)stderr))) {
@@ -88,22 +120,168 @@ void _applog(int prio, const char *str, bool force)
 	}
 }
 
-void _simplelog(int prio, const char *str, bool force)
+/* Returns false when the message has to be written directly instead */
+static bool log_queue(int prio, bool simple, struct timeval *tv, const char *str)
 {
-#ifdef HAVE_SYSLOG_H
-	if (use_syslog) {
-		syslog(LOG_LOCAL0 | prio, "%s", str);
+	uint64_t pos, seq;
+	struct log_rec *rec;
+	size_t len;
+
+	len = strlen(str);
+	if (len >= LOG_REC_SIZ)
+		return false;
+
+	pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+	while (42) {
+		rec = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&log_tail, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if ((int64_t)(seq - pos) < 0) {
+			atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+			return true;
+		} else
+			pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
 	}
-#else
-	if (0) {}
-#endif
-	else {
-		/* Only output to stderr if it's not going to the screen as well */
-		if (!isatty(fileno((FILE *)stderr))) {
-			fprintf(stderr, "%s\n", str);	/* atomic write to stderr */
-			fflush(stderr);
+
+	rec->prio = prio;
+	rec->simple = simple;
+	rec->tv = *tv;
+	memcpy(rec->str, str, len + 1);
+	atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+
+	if (atomic_exchange(&log_writer_sleeping, false))
+		cgsem_post(&log_sem);
+	return true;
+}
+
+/* Write out every record that is ready, returns false if there were none */
+static bool log_drain(void)
+{
+	bool did = false;
+
+	while (42) {
+		struct log_rec *rec = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+
+		if (atomic_load_explicit(&rec->seq, memory_order_acquire) != log_head + 1)
+			break;
+		log_output(rec->prio, rec->simple, &rec->tv, rec->str, false);
+		atomic_store_explicit(&rec->seq, log_head + LOG_RING_SIZE, memory_order_release);
+		log_head++;
+		did = true;
+	}
+	return did;
+}
+
+static void *log_writer_thread(__maybe_unused void *userdata)
+{
+	uint64_t dropped, reported = 0;
+
+	RenameThread("LogWriter");
+
+	while (42) {
+		if (log_drain())
+			continue;
+
+		dropped = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+		if (dropped != reported) {
+			struct timeval tv;
+			char buf[64];
+
+			cgtime_real(&tv);
+			snprintf(buf, sizeof(buf), "Log ring full, dropped %"PRIu64" messages",
+				 dropped - reported);
+			log_output(LOG_WARNING, false, &tv, buf, false);
+			reported = dropped;
+		}
+
+		/* Producers only post the semaphore once they see this set, so
+		 * look again after setting it for anything queued meanwhile */
+		atomic_store(&log_writer_sleeping, true);
+		if (log_drain()) {
+			atomic_store(&log_writer_sleeping, false);
+			continue;
 		}
+		cgsem_mswait(&log_sem, 1000);
+		atomic_store(&log_writer_sleeping, false);
+	}
+
+	return NULL;
+}
+
+/* Wait up to a second for the writer to output everything queued so far */
+void log_flush(void)
+{
+	uint64_t tail;
+	int i;
 
-		my_log_curses(prio, "", str, force);
+	if (!log_ring)
+		return;
+
+	tail = atomic_load(&log_tail);
+	for (i = 0; i < 1000; i++) {
+		struct log_rec *rec = &log_ring[(tail - 1) & (LOG_RING_SIZE - 1)];
+
+		/* The last claimed record has been written once its slot is
+		 * free for the next lap */
+		if (!tail || (int64_t)(atomic_load_explicit(&rec->seq, memory_order_acquire) -
+				       (tail - 1 + LOG_RING_SIZE)) >= 0)
+			return;
+		if (atomic_exchange(&log_writer_sleeping, false))
+			cgsem_post(&log_sem);
+		cgsleep_ms(1);
+	}
+}
+
+void start_log_writer(void)
+{
+	pthread_t pth;
+	uint64_t i;
+
+	log_ring = cgcalloc(LOG_RING_SIZE, sizeof(*log_ring));
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		atomic_init(&log_ring[i].seq, i);
+	cgsem_init(&log_sem);
+
+	if (unlikely(pthread_create(&pth, NULL, log_writer_thread, NULL))) {
+		free(log_ring);
+		log_ring = NULL;
+		applog(LOG_ERR, "Failed to create log writer thread, logging synchronously");
+		return;
 	}
+	pthread_detach(pth);
+	atexit(log_flush);
+}
+
+static void log_msg(int prio, bool simple, const char *str, bool force)
+{
+	struct timeval tv = {0, 0};
+
+	cgtime_real(&tv);
+
+	/* Forced messages come from quit paths that may never give the writer
+	 * another chance to run, so they go out directly after the queue */
+	if (log_ring && !force && log_queue(prio, simple, &tv, str))
+		return;
+
+	log_flush();
+	log_output(prio, simple, &tv, str, force);
+}
+
+/* high-level logging function, based on global opt_log_level */
+
+/*
+ * log function
+ */
+void _applog(int prio, const char *str, bool force)
+{
+	log_msg(prio, false, str, force);
+}
+
+void _simplelog(int prio, const char *str, bool force)
+{
+	log_msg(prio, true, str, force);
 }
@@ -31,46 +31,46 @@ extern int opt_log_level;
 
 extern void _applog(int prio, const char *str, bool force);
 extern void _simplelog(int prio, const char *str, bool force);
+extern void start_log_writer(void);
+extern void log_flush(void);
 
 #define IN_FMT_FFL " in %s %s():%d"
 
+/* Whether applog(prio, ...) would output anything, for callers that have to
+ * build a message before they can log it */
+#define log_enabled(prio) \
+	((opt_debug || (prio) != LOG_DEBUG) && \
+	 (use_syslog || opt_log_output || (prio) <= opt_log_level))
+
 #define applog(prio, fmt, ...) do { \
-	if (opt_debug || prio != LOG_DEBUG) { \
-		if (use_syslog || opt_log_output || prio <= opt_log_level) { \
-			char tmp42[LOGBUFSIZ]; \
-			snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
-			_applog(prio, tmp42, false); \
-		} \
+	if (log_enabled(prio)) { \
+		char tmp42[LOGBUFSIZ]; \
+		snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
+		_applog(prio, tmp42, false); \
 	} \
 } while (0)
 
 #define simplelog(prio, fmt, ...) do { \
-	if (opt_debug || prio != LOG_DEBUG) { \
-		if (use_syslog || opt_log_output || prio <= opt_log_level) { \
-			char tmp42[LOGBUFSIZ]; \
-			snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
-			_simplelog(prio, tmp42, false); \
-		} \
+	if (log_enabled(prio)) { \
+		char tmp42[LOGBUFSIZ]; \
+		snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
+		_simplelog(prio, tmp42, false); \
 	} \
 } while (0)
 
 #define applogsiz(prio, _SIZ, fmt, ...) do { \
-	if (opt_debug || prio != LOG_DEBUG) { \
-		if (use_syslog || opt_log_output || prio <= opt_log_level) { \
-			char tmp42[_SIZ]; \
-			snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
-			_applog(prio, tmp42, false); \
-		} \
+	if (log_enabled(prio)) { \
+		char tmp42[_SIZ]; \
+		snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
+		_applog(prio, tmp42, false); \
 	} \
 } while (0)
 
 #define forcelog(prio, fmt, ...) do { \
-	if (opt_debug || prio != LOG_DEBUG) { \
-		if (use_syslog || opt_log_output || prio <= opt_log_level) { \
-			char tmp42[LOGBUFSIZ]; \
-			snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
-			_applog(prio, tmp42, true); \
-		} \
+	if (log_enabled(prio)) { \
+		char tmp42[LOGBUFSIZ]; \
+		snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
+		_applog(prio, tmp42, true); \
 	} \
 } while (0)
 
@@ -5,6 +5,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <jansson.h>
@@ -32,6 +33,11 @@
 #include <semaphore.h>
 #endif
 
+/* Receive from and send to all stratum pools in a single event loop thread */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_SYS_EVENTFD_H)
+# define USE_STRATUM_EPOLL
+#endif
+
 #ifdef STDC_HEADERS
 # include <stdlib.h>
 # include <stddef.h>
@@ -316,6 +322,16 @@ struct api_data;
 struct thr_info;
 struct work;
 
+/* One chip's counters as reported by a driver's get_chip_metrics() */
+struct chip_metrics {
+	int chip_id;
+	int nonces;
+	int hw_errors;
+	int stales;
+	uint64_t mhz;
+	bool disabled;
+};
+
 struct device_drv {
 	enum drv_driver drv_id;
 
@@ -331,6 +347,8 @@ struct device_drv {
 	void (*get_statline)(char *, size_t, struct cgpu_info *);
 	struct api_data *(*get_api_stats)(struct cgpu_info *);
 	struct api_data *(*get_api_debug)(struct cgpu_info *);
+	// Fill in the counters of the chip'th chip, false past the last one
+	bool (*get_chip_metrics)(struct cgpu_info *, int chip, struct chip_metrics *);
 	bool (*get_stats)(struct cgpu_info *);
 	void (*identify_device)(struct cgpu_info *); // e.g. to flash a led
 	char *(*set_device)(struct cgpu_info *, char *option, char *setting, char *replybuf);
@@ -421,6 +439,18 @@ struct cgminer_stats {
 	struct timeval getwork_wait_min;
 };
 
+/* Latency histogram updated lock free. Samples are in microseconds, counted
+ * exactly below 4us and in quarter octave buckets above, so any percentile
+ * read back is at most 25% high. */
+#define LAT_HIST_BUCKETS 112
+
+struct lat_hist {
+	atomic_uint_fast64_t bucket[LAT_HIST_BUCKETS];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum_us;
+	atomic_uint_fast64_t max_us;
+};
+
 // Just the actual network getworks to the pool
 struct cgminer_pool_stats {
 	uint32_t getwork_calls;
@@ -443,9 +473,38 @@ struct cgminer_pool_stats {
 	uint64_t net_bytes_sent;
 	uint64_t times_received;
 	uint64_t bytes_received;
+	uint64_t net_times_received;
 	uint64_t net_bytes_received;
+	struct lat_hist submit_latency;
+	struct lat_hist notify_latency;
 };
 
+/* Share counters bumped lock free on the hot paths and folded into the
+ * plain stats fields under stats_lock by fold_stats(). One cache line each so
+ * devices and pools never share one. */
+struct stats_shard {
+	atomic_int accepted;
+	atomic_int rejected;
+	atomic_int stale;
+	atomic_int hw_errors;
+	_Atomic double diff1;
+	_Atomic double diff_accepted;
+	_Atomic double diff_rejected;
+	_Atomic double diff_stale;
+} __attribute__((aligned(64)));
+
+/* Plain += on an atomic double needs libatomic for the FP exception
+ * handling, which we have no use for */
+static inline void shard_add_diff(_Atomic double *diff, double val)
+{
+	double old = atomic_load_explicit(diff, memory_order_relaxed);
+
+	while (!atomic_compare_exchange_weak_explicit(diff, &old, old + val,
+						      memory_order_relaxed,
+						      memory_order_relaxed))
+		;
+}
+
 struct cgpu_info {
 	int cgminer_id;
 	struct device_drv *drv;
@@ -526,6 +585,7 @@ struct cgpu_info {
 	int64_t diff1;
 	double diff_accepted;
 	double diff_rejected;
+	struct stats_shard shard;
 	int last_share_pool;
 	time_t last_share_pool_time;
 	double last_share_diff;
@@ -1007,6 +1067,7 @@ extern bool have_longpoll;
 extern char *opt_kernel_path;
 extern char *opt_socks_proxy;
 extern int opt_suggest_diff;
+extern int opt_verify_threads;
 extern char *cgminer_path;
 extern bool opt_lowmem;
 extern bool opt_autofan;
@@ -1020,7 +1081,10 @@ extern char *opt_api_mcast_des;
 extern int opt_api_mcast_port;
 extern char *opt_api_groups;
 extern char *opt_api_description;
+extern int opt_api_metrics_port;
 extern int opt_api_port;
+extern int opt_api_snapshot;
+extern char *opt_trace_file;
 extern char *opt_api_host;
 extern bool opt_api_listen;
 extern bool opt_api_network;
@@ -1048,6 +1112,10 @@ extern char *opt_btc08_min_chips;
 extern char *opt_btc08_chiptest;
 extern char *opt_btc08_test;
 extern bool opt_btc08_dump;
+extern bool opt_btc08_hard_flush;
+extern char *opt_btc08_autotune;
+extern char *opt_btc08_pll_profile;
+extern char *opt_btc08_temp_sensor;
 #endif
 #ifdef USE_KLONDIKE
 extern char *opt_klondike_options;
@@ -1154,6 +1222,7 @@ extern const int max_scantime;
 
 extern cglock_t control_lock;
 extern pthread_mutex_t hash_lock;
+extern pthread_mutex_t stats_lock;
 extern pthread_mutex_t console_lock;
 extern cglock_t ch_lock;
 extern pthread_rwlock_t mining_thr_lock;
@@ -1205,6 +1274,7 @@ extern int total_devices;
 extern int zombie_devs;
 extern struct cgpu_info **devices;
 extern int total_pools;
+extern _Atomic uint64_t work_pool_hits, work_pool_misses;
 extern struct pool **pools;
 extern struct strategies strategies[];
 extern enum pool_strategy pool_strategy;
@@ -1212,12 +1282,12 @@ extern int opt_rotate_period;
 extern double rolling1, rolling5, rolling15;
 extern double total_rolling;
 extern double total_mhashes_done;
-extern unsigned int new_blocks;
+extern atomic_uint new_blocks;
 extern unsigned int found_blocks;
 extern int64_t total_accepted, total_rejected, total_diff1;
 extern int64_t total_getworks, total_stale, total_discarded;
 extern double total_diff_accepted, total_diff_rejected, total_diff_stale;
-extern unsigned int local_work;
+extern atomic_uint local_work;
 extern unsigned int total_go, total_ro;
 extern const int opt_cutofftemp;
 extern int opt_log_interval;
@@ -1247,9 +1317,30 @@ struct stratum_work {
 	unsigned char **merkle_bin;
 	bool clean;
 
+	/* Refcounted share submission strings handed out to each work */
+	char *work_job_id;
+	char *work_nonce1;
+	char *work_ntime;
+
+	// Bumped and stamped by each notify, copied into its works
+	unsigned int notify_seq;
+	struct timeval tv_notify;
+
 	double diff;
 };
 
+enum stratum_ev_type {
+	STRATUM_EV_SOCK,
+	STRATUM_EV_TIMER,
+	STRATUM_EV_SEND,
+};
+
+/* Identifies a pool's socket, timer or share queue in the stratum event loop */
+struct stratum_ev {
+	struct pool *pool;
+	enum stratum_ev_type type;
+};
+
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
@@ -1270,6 +1361,7 @@ struct pool {
 	double diff_accepted;
 	double diff_rejected;
 	double diff_stale;
+	struct stats_shard shard;
 
 	/* Vmask data */
 	bool vmask; /* Supports vmask */
@@ -1335,8 +1427,14 @@ struct pool {
 	char *stratum_url;
 	char *stratum_port;
 	SOCKETTYPE sock;
+	/* Received data not yet parsed is held in sockbuf between
+	 * sockbuf_head and sockbuf_tail, and has been searched for a newline
+	 * up to sockbuf_scan */
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_head;
+	size_t sockbuf_tail;
+	size_t sockbuf_scan;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *sockaddr_proxy_url;
 	char *sockaddr_proxy_port;
@@ -1351,10 +1449,28 @@ struct pool {
 	bool stratum_init;
 	bool stratum_notify;
 	struct stratum_work swork;
+	// Last notify_seq whose first work reached a device
+	atomic_uint notify_job_seq;
 	pthread_t stratum_sthread;
 	pthread_t stratum_rthread;
 	pthread_mutex_t stratum_lock;
+	/* Stratum event loop state. stratum_evsock is the socket currently
+	 * registered, 0 if none, and only changes under stratum_lock */
+	struct stratum_ev sock_ev;
+	struct stratum_ev timer_ev;
+	struct stratum_ev send_ev;
+	int stratum_timerfd;
+	int stratum_sendfd;
+	SOCKETTYPE stratum_evsock;
+	bool stratum_wantout;
+	bool stratum_reconnecting;
+	bool stratum_parked;	/* idle until we switch to it */
+	time_t stratum_last_rx;
 	struct thread_q *stratum_q;
+	/* Shares waiting to be sent or retried and the last one prepared */
+	struct list_head stratum_pending;
+	uint32_t stratum_last_nonce;
+	uint64_t stratum_last_nonce2;
 	int sshares; /* stratum shares submitted waiting on response */
 
 	/* GBT  variables */
@@ -1388,6 +1504,8 @@ struct pool {
 	unsigned char *coinbase;
 	int coinbase_len;
 	int nonce2_offset;
+	/* SHA-256 state over the coinbase up to nonce2_offset, set per notify */
+	struct sha256_ctx *coinbase_prefix;
 	unsigned char header_bin[128];
 	int merkles;
 	char prev_hash[68];
@@ -1412,10 +1530,19 @@ struct pool {
 
 struct work {
 	unsigned char	data[128];
+	/* The midstates sit in the order SPI hashing chips take a job, so a
+	 * driver can send the job from here as calc_midstate() left it: its
+	 * command bytes at the end of job_head, the midstate, the header bytes
+	 * past the first block in job_data, the ASICBoost midstates and
+	 * job_dummy. job_data is the driver's to fill in from data, as ntime
+	 * rolling changes those after calc_midstate(). */
+	unsigned char	job_head[4];
 	unsigned char	midstate[32];
+	unsigned char	job_data[12];
 	unsigned char   midstate1[32];
 	unsigned char   midstate2[32];
 	unsigned char   midstate3[32];
+	unsigned char	job_dummy[4];
 	unsigned char	target[32];
 	unsigned char	hash[32];
 
@@ -1458,7 +1585,11 @@ struct work {
 
 	unsigned int	work_block;
 	uint32_t	id;
+	/* id of the work this one was copied from, for event traces */
+	uint32_t	trace_id;
 	UT_hash_handle	hh;
+	/* a staged_bucket while staged, the work cache once freed */
+	struct list_head list;
 
 	/* This is the diff work we're aiming to submit and should match the
 	 * work->target binary */
@@ -1476,9 +1607,27 @@ struct work {
 	struct timeval	tv_cloned;
 	struct timeval	tv_work_start;
 	struct timeval	tv_work_found;
+	unsigned int	notify_seq;
+	struct timeval	tv_notify;
 	char		getwork_mode;
 };
 
+#define MAX_BATCH_NONCES 8
+
+/* Nonces found on one work, handed to submit_nonces_async(). data, chip_id
+ * and job_id are the driver's own and passed back untouched. */
+struct nonce_batch {
+	void *data;
+	int chip_id;
+	int job_id;
+	int count;
+	int micro_job_ids[MAX_BATCH_NONCES];
+	uint32_t nonces[MAX_BATCH_NONCES];
+	bool valid[MAX_BATCH_NONCES];
+};
+
+typedef void (*nonce_batch_done_fn)(struct thr_info *thr, struct nonce_batch *batch);
+
 #ifdef USE_MODMINER
 struct modminer_fpga_state {
 	bool work_running;
@@ -1521,10 +1670,19 @@ struct modminer_fpga_state {
 
 extern void get_datestamp(char *, size_t, struct timeval *);
 extern void inc_hw_errors(struct thr_info *thr);
+extern void fold_stats(void);
+extern atomic_uint_fast64_t log_dropped;
+extern struct lat_hist work_nonce_latency;
+extern struct lat_hist spi_xfer_latency;
+extern void work_started(struct work *work);
 extern bool test_nonce(struct work *work, uint32_t nonce);
 extern bool test_nonce_diff(struct work *work, uint32_t nonce, double diff);
 extern bool submit_tested_work(struct thr_info *thr, struct work *work);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
+extern int submit_nonces(struct thr_info *thr, struct work *work, const int *micro_job_ids,
+			 const uint32_t *nonces, bool *valid, int count);
+extern void submit_nonces_async(struct thr_info *thr, struct work *work,
+				struct nonce_batch *batch, nonce_batch_done_fn done);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
 extern int share_work_tdiff(struct cgpu_info *cgpu);
@@ -1570,6 +1728,11 @@ extern struct thread_q *tq_new(void);
 extern void tq_free(struct thread_q *tq);
 extern bool tq_push(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq);
+extern int tq_pop_batch(struct thread_q *tq, void **data, int max, int ms);
+extern void lat_hist_add(struct lat_hist *hist, uint64_t us);
+extern void __stratum_ev_del(struct pool *pool);
+extern uint64_t lat_hist_bound(int bucket);
+extern uint64_t lat_hist_percentile(struct lat_hist *hist, double pct);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
 extern bool successful_connect;
@@ -0,0 +1,144 @@
+/*
+ * Test of the multi-buffer SHA-256 against the scalar code
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Every lane count of sha256d_80_mb() and sha256_transf_mb() has to match
+ * sha256() over the bench_block.h vectors, on the vector lanes and on the
+ * sha256_mb_scalar path alike. Each hidiff block also has to meet diff 1 at
+ * its stored nonce. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "sha2.h"
+#include "bench_block.h"
+
+#define BLOCKS		32
+
+static int failures;
+
+#define check(cond, fmt, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+		failures++; \
+	} \
+} while (0)
+
+static unsigned char bins[BLOCKS][160];
+
+static void unhex(unsigned char *p, const char *hexstr, size_t len)
+{
+	unsigned int byte;
+
+	while (len--) {
+		sscanf(hexstr, "%2x", &byte);
+		*p++ = byte;
+		hexstr += 2;
+	}
+}
+
+/* byte swap every 32 bit word, as flip80()/flip64() in util.c */
+static void flip(unsigned char *dest, const unsigned char *src, int words)
+{
+	for (int i = 0; i < words; i++) {
+		dest[i * 4 + 0] = src[i * 4 + 3];
+		dest[i * 4 + 1] = src[i * 4 + 2];
+		dest[i * 4 + 2] = src[i * 4 + 1];
+		dest[i * 4 + 3] = src[i * 4 + 0];
+	}
+}
+
+static void test_sha256d_80(const char *path)
+{
+	unsigned char swap[BLOCKS][80], hashes[BLOCKS][32];
+	unsigned char hash1[32], hash[32];
+	const unsigned char *msg[SHA256_MB_LANES];
+	unsigned char *digest[SHA256_MB_LANES];
+	int i, j, lanes;
+
+	for (i = 0; i < BLOCKS; i++)
+		flip(swap[i], bins[i], 20);
+
+	for (lanes = 1; lanes <= SHA256_MB_LANES; lanes++) {
+		memset(hashes, 0, sizeof(hashes));
+		for (i = 0; i < BLOCKS; i += lanes) {
+			int count = BLOCKS - i < lanes ? BLOCKS - i : lanes;
+
+			for (j = 0; j < count; j++) {
+				msg[j] = swap[i + j];
+				digest[j] = hashes[i + j];
+			}
+			sha256d_80_mb(msg, digest, count);
+		}
+		for (i = 0; i < BLOCKS; i++) {
+			uint32_t top;
+
+			sha256(swap[i], 80, hash1);
+			sha256(hash1, 32, hash);
+			check(!memcmp(hash, hashes[i], 32), "%s: sha256d_80_mb block %d, %d lanes",
+			      path, i, lanes);
+			memcpy(&top, hashes[i] + 28, sizeof(top));
+			check(i >= 16 || !top, "%s: hidiff block %d below diff 1", path, i);
+		}
+	}
+}
+
+static void test_transf(const char *path)
+{
+	unsigned char data[SHA256_MB_LANES][64];
+	const unsigned char *blocks[SHA256_MB_LANES];
+	uint32_t state[SHA256_MB_LANES][8];
+	sha256_ctx ctx;
+	int i, j, lanes;
+
+	for (lanes = 1; lanes <= SHA256_MB_LANES; lanes++) {
+		for (i = 0; i < BLOCKS; i += lanes) {
+			int count = BLOCKS - i < lanes ? BLOCKS - i : lanes;
+
+			for (j = 0; j < count; j++) {
+				flip(data[j], bins[i + j], 16);
+				memcpy(state[j], sha256_h0, sizeof(state[j]));
+				blocks[j] = data[j];
+			}
+			sha256_transf_mb(state, blocks, count);
+			for (j = 0; j < count; j++) {
+				sha256_init(&ctx);
+				sha256_update(&ctx, data[j], 64);
+				check(!memcmp(ctx.h, state[j], 32), "%s: sha256_transf_mb block %d, %d lanes",
+				      path, i + j, lanes);
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	for (int i = 0; i < 16; i++) {
+		unhex(bins[i], bench_hidiffs[i], 160);
+		unhex(bins[16 + i], bench_lodiffs[i], 160);
+	}
+
+	sha256_mb_scalar = false;
+	test_sha256d_80("lanes");
+	test_transf("lanes");
+
+	sha256_mb_scalar = true;
+	test_sha256d_80("scalar");
+	test_transf("scalar");
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	printf("multi-buffer sha256: all checks passed\n");
+	return 0;
+}
@@ -509,3 +509,164 @@ void sha256_final(sha256_ctx *ctx, unsigned char *digest)
     }
 }
 #endif
+
+/* Multi-buffer SHA-256: compresses up to SHA256_MB_LANES independent blocks
+ * at once with one 32 bit lane per block in a GCC vector, which builds as
+ * NEON on ARM and SSE on x86 with an AVX2 variant picked at runtime for 8
+ * lanes. With the ARMv8 Cryptography Extension one block at a time through
+ * the SHA instructions is faster than any software lanes so it is used
+ * instead. */
+
+bool sha256_mb_scalar;
+
+#define MB_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define MB_F1(x) (MB_ROTR(x,  2) ^ MB_ROTR(x, 13) ^ MB_ROTR(x, 22))
+#define MB_F2(x) (MB_ROTR(x,  6) ^ MB_ROTR(x, 11) ^ MB_ROTR(x, 25))
+#define MB_F3(x) (MB_ROTR(x,  7) ^ MB_ROTR(x, 18) ^ ((x) >>  3))
+#define MB_F4(x) (MB_ROTR(x, 17) ^ MB_ROTR(x, 19) ^ ((x) >> 10))
+
+/* Unused lanes hash a copy of lane 0 and are never stored back */
+#define SHA256_MB_TRANSF(VEC, LANES)                                          \
+{                                                                             \
+    VEC w[16], wv[8], h[8], t1, t2;                                           \
+    int i, j;                                                                 \
+                                                                              \
+    for (i = 0; i < LANES; i++) {                                             \
+        int l = i < count ? i : 0;                                            \
+                                                                              \
+        for (j = 0; j < 16; j++) {                                            \
+            uint32_t x;                                                       \
+                                                                              \
+            PACK32(&block[l][j << 2], &x);                                    \
+            w[j][i] = x;                                                      \
+        }                                                                     \
+        for (j = 0; j < 8; j++)                                               \
+            h[j][i] = state[l][j];                                            \
+    }                                                                         \
+                                                                              \
+    for (j = 0; j < 8; j++)                                                   \
+        wv[j] = h[j];                                                         \
+                                                                              \
+    for (j = 0; j < 64; j++) {                                                \
+        if (j >= 16)                                                          \
+            w[j & 15] += MB_F4(w[(j - 2) & 15]) + w[(j - 7) & 15]             \
+                       + MB_F3(w[(j - 15) & 15]);                             \
+        t1 = wv[7] + MB_F2(wv[4]) + CH(wv[4], wv[5], wv[6])                   \
+            + sha256_k[j] + w[j & 15];                                        \
+        t2 = MB_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);                         \
+        wv[7] = wv[6];                                                        \
+        wv[6] = wv[5];                                                        \
+        wv[5] = wv[4];                                                        \
+        wv[4] = wv[3] + t1;                                                   \
+        wv[3] = wv[2];                                                        \
+        wv[2] = wv[1];                                                        \
+        wv[1] = wv[0];                                                        \
+        wv[0] = t1 + t2;                                                      \
+    }                                                                         \
+                                                                              \
+    for (i = 0; i < count; i++) {                                             \
+        for (j = 0; j < 8; j++)                                               \
+            state[i][j] = h[j][i] + wv[j][i];                                 \
+    }                                                                         \
+}
+
+#ifndef USE_CRYPTO_EXT
+typedef uint32_t v4u32 __attribute__ ((vector_size (16)));
+
+static void sha256_transf_x4(uint32_t state[][8],
+                             const unsigned char *const block[], int count)
+SHA256_MB_TRANSF(v4u32, 4)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SHA256_X8
+typedef uint32_t v8u32 __attribute__ ((vector_size (32)));
+
+static __attribute__ ((target("avx2")))
+void sha256_transf_x8(uint32_t state[][8],
+                      const unsigned char *const block[], int count)
+SHA256_MB_TRANSF(v8u32, 8)
+#endif
+#endif /* !USE_CRYPTO_EXT */
+
+static void sha256_transf_one(uint32_t state[8], const unsigned char *block)
+{
+#ifdef USE_CRYPTO_EXT
+    uint32_t tmp32[64 + 8];
+
+    SHA256_Transform(state, block, &tmp32[0], &tmp32[64]);
+#else
+    sha256_ctx ctx;
+
+    memcpy(ctx.h, state, sizeof(ctx.h));
+    sha256_transf(&ctx, block, 1);
+    memcpy(state, ctx.h, sizeof(ctx.h));
+#endif
+}
+
+void sha256_transf_mb(uint32_t state[][8], const unsigned char *const block[],
+                      int count)
+{
+    int i;
+
+#ifndef USE_CRYPTO_EXT
+    if (!sha256_mb_scalar && count > 1) {
+#ifdef HAVE_SHA256_X8
+        static int avx2 = -1;
+
+        if (avx2 < 0)
+            avx2 = __builtin_cpu_supports("avx2");
+        if (avx2 && count > 4) {
+            sha256_transf_x8(state, block, count);
+            return;
+        }
+#endif
+        for (i = 0; i < count; i += 4)
+            sha256_transf_x4(state + i, block + i, count - i < 4 ? count - i : 4);
+        return;
+    }
+#endif
+    for (i = 0; i < count; i++)
+        sha256_transf_one(state[i], block[i]);
+}
+
+void sha256d_80_mb(const unsigned char *const msg[],
+                   unsigned char *const digest[], int count)
+{
+    unsigned char tail[SHA256_MB_LANES][SHA256_BLOCK_SIZE];
+    const unsigned char *block[SHA256_MB_LANES] = { NULL };
+    uint32_t state[SHA256_MB_LANES][8];
+    int i, j;
+
+    for (i = 0; i < count; i++) {
+        memcpy(state[i], sha256_h0, sizeof(state[i]));
+        block[i] = msg[i];
+    }
+    sha256_transf_mb(state, block, count);
+
+    /* Last 16 bytes of the header, padded to 640 bits */
+    for (i = 0; i < count; i++) {
+        memcpy(tail[i], msg[i] + 64, 16);
+        memset(tail[i] + 16, 0, SHA256_BLOCK_SIZE - 16);
+        tail[i][16] = 0x80;
+        tail[i][62] = 0x02;
+        tail[i][63] = 0x80;
+        block[i] = tail[i];
+    }
+    sha256_transf_mb(state, block, count);
+
+    /* The first digest, padded to 256 bits */
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < 8; j++)
+            UNPACK32(state[i][j], &tail[i][j << 2]);
+        memset(tail[i] + 32, 0, SHA256_BLOCK_SIZE - 32);
+        tail[i][32] = 0x80;
+        tail[i][62] = 0x01;
+        memcpy(state[i], sha256_h0, sizeof(state[i]));
+    }
+    sha256_transf_mb(state, block, count);
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < 8; j++)
+            UNPACK32(state[i][j], &digest[i][j << 2]);
+    }
+}
@@ -51,14 +51,19 @@
 #define SHA256_F3(x) (ROTR(x,  7) ^ ROTR(x, 18) ^ SHFR(x,  3))
 #define SHA256_F4(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ SHFR(x, 10))
 
-typedef struct {
+typedef struct sha256_ctx {
     unsigned int tot_len;
     unsigned int len;
     unsigned char block[2 * SHA256_BLOCK_SIZE];
     uint32_t h[8];
 } sha256_ctx;
 
+/* Most blocks sha256_transf_mb compresses in one call */
+#define SHA256_MB_LANES 8
+
+extern uint32_t sha256_h0[8];
 extern uint32_t sha256_k[64];
+extern bool sha256_mb_scalar;
 
 void sha256_init(sha256_ctx * ctx);
 void sha256_update(sha256_ctx *ctx, const unsigned char *message,
@@ -66,5 +71,12 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+/* Compresses count (at most SHA256_MB_LANES) independent 64 byte blocks,
+ * block[i] into state[i] */
+void sha256_transf_mb(uint32_t state[][8], const unsigned char *const block[],
+                      int count);
+/* Double SHA-256 of count (at most SHA256_MB_LANES) 80 byte messages */
+void sha256d_80_mb(const unsigned char *const msg[],
+                   unsigned char *const digest[], int count);
 
 #endif /* !SHA2_H */
@@ -66,6 +66,16 @@ struct spi_ctx *spi_init(struct spi_config *config)
 	return ctx;
 }
 
+/* Account the time an SPI_IOC_MESSAGE took since ts_start */
+static void spi_xfer_done(cgtimer_t *ts_start)
+{
+	cgtimer_t ts_now, ts_diff;
+
+	cgtimer_time(&ts_now);
+	cgtimer_sub(&ts_now, ts_start, &ts_diff);
+	lat_hist_add(&spi_xfer_latency, ts_diff.tv_sec * 1000000 + ts_diff.tv_nsec / 1000);
+}
+
 extern void spi_exit(struct spi_ctx *ctx)
 {
 	if (NULL == ctx)
@@ -79,6 +89,7 @@ extern bool spi_transfer(struct spi_ctx *ctx, uint8_t *txbuf,
 			 uint8_t *rxbuf, int len)
 {
 	struct spi_ioc_transfer xfr;
+	cgtimer_t ts_start;
 	int ret;
 
 	if (rxbuf != NULL)
@@ -97,7 +108,9 @@ extern bool spi_transfer(struct spi_ctx *ctx, uint8_t *txbuf,
 	xfr.rx_nbits = 0;
 	xfr.pad = 0;
 
+	cgtimer_time(&ts_start);
 	ret = ioctl(ctx->fd, SPI_IOC_MESSAGE(1), &xfr);
+	spi_xfer_done(&ts_start);
 	if (ret < 1)
 		applog(LOG_ERR, "SPI: ioctl error on SPI device: %d", ret);
 
@@ -108,6 +121,7 @@ extern bool spi_transfer_x20(struct spi_ctx *ctx, uint8_t *txbuf,
 			 uint8_t *rxbuf, int len)
 {
 	struct spi_ioc_transfer xfr;
+	cgtimer_t ts_start;
 	int ret;
 
 	if(len&0x3) {
@@ -130,7 +144,9 @@ extern bool spi_transfer_x20(struct spi_ctx *ctx, uint8_t *txbuf,
 	xfr.rx_nbits = 0;
 	xfr.pad = 0;
 
+	cgtimer_time(&ts_start);
 	ret = ioctl(ctx->fd, SPI_IOC_MESSAGE(1), &xfr);
+	spi_xfer_done(&ts_start);
 	if (ret < 1) {
 		applog(LOG_ERR, "SPIx20: ioctl error on SPI device: %d", ret);
 	}
@@ -141,9 +157,12 @@ extern bool spi_transfer_x20(struct spi_ctx *ctx, uint8_t *txbuf,
 extern bool spi_transfer_x20_a(struct spi_ctx *ctx, 
 		struct spi_ioc_transfer *xfr, int num)
 {
+	cgtimer_t ts_start;
 	int ret;
 
+	cgtimer_time(&ts_start);
 	ret = ioctl(ctx->fd, SPI_IOC_MESSAGE(num), xfr);
+	spi_xfer_done(&ts_start);
 	if (ret < 1) {
 		applog(LOG_ERR, "SPIx20_a: ioctl error on SPI device: %d", ret);
 	}
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation; either version 3 of the License, or (at your option) any later
+# version.  See COPYING for more details.
+#
+# Local mock stratum pool for exercising the stratum client without a real pool
+#
+# Usage: ./stratum-mock.py [options] port [port ...]
+#
+#   Every port listed is an independent pool, so one instance can stand in for
+#   a whole failover list, e.g. for 8 pools:
+#	./stratum-mock.py 3333 3334 3335 3336 3337 3338 3339 3340
+#	cgminer -o stratum+tcp://127.0.0.1:3333 -u x -p x \
+#		-o stratum+tcp://127.0.0.1:3334 -u x -p x ...
+#
+#   It answers mining.configure, mining.subscribe and mining.authorize, sends
+#   mining.set_difficulty and a mining.notify every --notify seconds and
+#   accepts every mining.submit. Each event is printed on stdout as
+#	<port> <connection> <event> [detail]
+#   so a test can follow what the client did.
+#
+#   --reconnect N	send client.reconnect to the same pool after N notifies
+#   --drop N		close the connection after N notifies
+#   --silent N		stop sending anything after N notifies, for receive
+#			timeouts
+#   --reject		reject every share instead
+#   --diff D		share difficulty, 1 by default
+
+import argparse
+import json
+import socket
+import sys
+import threading
+import time
+
+COINBASE1 = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008"
+COINBASE2 = "072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000"
+PREVHASH = "4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000"
+
+out_lock = threading.Lock()
+
+def event(port, conn, what, detail=""):
+	with out_lock:
+		print("%d %d %s %s" % (port, conn, what, detail))
+		sys.stdout.flush()
+
+class Connection(threading.Thread):
+	def __init__(self, args, port, conn, sock):
+		threading.Thread.__init__(self)
+		self.daemon = True
+		self.args = args
+		self.port = port
+		self.conn = conn
+		self.sock = sock
+		self.send_lock = threading.Lock()
+		self.authorized = threading.Event()
+		self.closed = False
+		self.submits = 0
+
+	def send(self, obj):
+		line = json.dumps(obj) + "\n"
+		with self.send_lock:
+			if self.closed:
+				return
+			try:
+				self.sock.sendall(line.encode())
+			except socket.error:
+				self.closed = True
+
+	def notify(self, job, clean):
+		self.send({"id": None, "method": "mining.notify",
+			   "params": ["%x" % job, PREVHASH, COINBASE1, COINBASE2, [],
+				      "20000000", "1c2ac4af", "%08x" % int(time.time()), clean]})
+
+	def notifier(self):
+		self.authorized.wait()
+		self.send({"id": None, "method": "mining.set_difficulty",
+			   "params": [self.args.diff]})
+		job = 0
+		while not self.closed:
+			self.notify(self.conn * 1000 + job, job == 0)
+			job += 1
+			event(self.port, self.conn, "notify", job)
+			if self.args.reconnect and job == self.args.reconnect:
+				self.send({"id": None, "method": "client.reconnect", "params": []})
+				event(self.port, self.conn, "reconnect")
+			if self.args.drop and job == self.args.drop:
+				event(self.port, self.conn, "drop")
+				self.close()
+				return
+			if self.args.silent and job == self.args.silent:
+				event(self.port, self.conn, "silent")
+				return
+			time.sleep(self.args.notify)
+
+	def close(self):
+		with self.send_lock:
+			self.closed = True
+			try:
+				self.sock.shutdown(socket.SHUT_RDWR)
+			except socket.error:
+				pass
+
+	def reply(self, req, result, error=None):
+		self.send({"id": req.get("id"), "result": result, "error": error})
+
+	def handle(self, req):
+		method = req.get("method")
+
+		if method == "mining.configure":
+			self.reply(req, {"version-rolling": True,
+					 "version-rolling.mask": "1fffe000"})
+		elif method == "mining.subscribe":
+			self.reply(req, [[["mining.notify", "%x" % self.conn]],
+					 "%08x" % self.conn, 4])
+		elif method == "mining.authorize":
+			self.reply(req, True)
+			event(self.port, self.conn, "authorized", req["params"][0])
+			self.authorized.set()
+		elif method == "mining.submit":
+			self.submits += 1
+			event(self.port, self.conn, "submit", self.submits)
+			if self.args.reject:
+				self.reply(req, False, [23, "Low difficulty share", None])
+			else:
+				self.reply(req, True)
+		else:
+			self.reply(req, None)
+
+	def run(self):
+		event(self.port, self.conn, "connect")
+		threading.Thread(target=self.notifier, daemon=True).start()
+		buf = b""
+		while True:
+			try:
+				data = self.sock.recv(4096)
+			except socket.error:
+				data = b""
+			if not data:
+				break
+			buf += data
+			while b"\n" in buf:
+				line, buf = buf.split(b"\n", 1)
+				if not line.strip():
+					continue
+				try:
+					req = json.loads(line.decode())
+				except ValueError:
+					event(self.port, self.conn, "badline", line[:80])
+					continue
+				self.handle(req)
+		self.closed = True
+		self.authorized.set()
+		self.sock.close()
+		event(self.port, self.conn, "disconnect", self.submits)
+
+def listen(args, port):
+	srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	srv.bind((args.host, port))
+	srv.listen(16)
+	conn = 0
+	while True:
+		sock, _ = srv.accept()
+		Connection(args, port, conn, sock).start()
+		conn += 1
+
+def main():
+	parser = argparse.ArgumentParser(description="Mock stratum pool")
+	parser.add_argument("ports", type=int, nargs="+")
+	parser.add_argument("--host", default="127.0.0.1")
+	parser.add_argument("--notify", type=float, default=30)
+	parser.add_argument("--reconnect", type=int, default=0)
+	parser.add_argument("--drop", type=int, default=0)
+	parser.add_argument("--silent", type=int, default=0)
+	parser.add_argument("--reject", action="store_true")
+	parser.add_argument("--diff", type=float, default=1)
+	args = parser.parse_args()
+
+	for port in args.ports:
+		threading.Thread(target=listen, args=(args, port), daemon=True).start()
+	event(0, 0, "listening", " ".join(str(p) for p in args.ports))
+	try:
+		while True:
+			time.sleep(3600)
+	except KeyboardInterrupt:
+		pass
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,220 @@
+/*
+ * Decoder for the pipeline event trace written by the API 'trace|dump'
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Compile on the host, the trace is in the byte order of the miner:
+ *   gcc trace-decode.c -o trace-decode
+ * Usage:
+ *   trace-decode [cgminer.trace]
+ *
+ * Events are matched up by work id and each stage is timed from the latest
+ * event of the stage before it on the same work, OON from the previous OON of
+ * the same chain. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+struct stage {
+	const char *name;
+	int type;
+	int from;
+};
+
+static const struct stage stages[] = {
+	{ "gen->staged",	TRACE_WORK_STAGED,	TRACE_WORK_GEN },
+	{ "staged->queued",	TRACE_WORK_QUEUED,	TRACE_WORK_STAGED },
+	{ "queued->write_parm",	TRACE_WRITE_PARM,	TRACE_WORK_QUEUED },
+	{ "write_parm->gn",	TRACE_GN,		TRACE_WRITE_PARM },
+	{ "gn->nonce_ok",	TRACE_NONCE_OK,		TRACE_GN },
+	{ "nonce_ok->submit",	TRACE_SHARE_SUBMIT,	TRACE_NONCE_OK },
+	{ "submit->accept",	TRACE_SHARE_ACCEPT,	TRACE_SHARE_SUBMIT },
+	{ "submit->reject",	TRACE_SHARE_REJECT,	TRACE_SHARE_SUBMIT },
+	{ "gen->accept",	TRACE_SHARE_ACCEPT,	TRACE_WORK_GEN },
+	{ "oon->oon",		TRACE_OON,		TRACE_OON },
+};
+
+#define STAGES (int)(sizeof(stages) / sizeof(stages[0]))
+
+struct samples {
+	uint64_t *ns;
+	size_t count, size;
+};
+
+static struct samples samples[STAGES];
+
+/* Latest time of every event type seen on one work id */
+struct work_slot {
+	uint32_t work_id;
+	uint64_t last[TRACE_TYPES];
+};
+
+static struct work_slot *slots;
+static size_t slot_mask;
+
+static struct work_slot *work_slot(uint32_t work_id)
+{
+	size_t i = (work_id * 2654435761u) & slot_mask;
+
+	while (slots[i].work_id && slots[i].work_id != work_id)
+		i = (i + 1) & slot_mask;
+	slots[i].work_id = work_id;
+	return &slots[i];
+}
+
+static void stage_add(struct samples *st, uint64_t ns)
+{
+	if (st->count == st->size) {
+		st->size = st->size ? st->size * 2 : 1024;
+		st->ns = realloc(st->ns, st->size * sizeof(*st->ns));
+		if (!st->ns) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	st->ns[st->count++] = ns;
+}
+
+static int cmp_event(const void *a, const void *b)
+{
+	const struct trace_event *ea = a, *eb = b;
+
+	if (ea->ns != eb->ns)
+		return ea->ns < eb->ns ? -1 : 1;
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	if (ua != ub)
+		return ua < ub ? -1 : 1;
+	return 0;
+}
+
+static double pct_ms(struct samples *st, double pct)
+{
+	size_t i = (size_t)(pct * (st->count - 1) / 100.0 + 0.5);
+
+	return st->ns[i] / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "cgminer.trace";
+	uint64_t oon_last[256] = { 0 };
+	uint64_t counts[TRACE_TYPES] = { 0 };
+	struct trace_header hdr;
+	struct trace_event *ev;
+	uint8_t threads[256] = { 0 };
+	int nthreads = 0;
+	size_t n, i;
+	FILE *fp;
+	int s;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    strncmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic))) {
+		fprintf(stderr, "%s: not a cgminer trace\n", path);
+		return 1;
+	}
+	if (hdr.version != TRACE_VERSION || hdr.event_size != sizeof(*ev)) {
+		fprintf(stderr, "%s: trace version %u event size %u, expected %u/%u\n",
+			path, hdr.version, hdr.event_size, TRACE_VERSION,
+			(unsigned)sizeof(*ev));
+		return 1;
+	}
+
+	n = hdr.events;
+	ev = malloc(n * sizeof(*ev) + 1);
+	if (!ev || fread(ev, sizeof(*ev), n, fp) != n) {
+		fprintf(stderr, "%s: truncated trace\n", path);
+		return 1;
+	}
+	fclose(fp);
+	if (!n) {
+		printf("%s: no events\n", path);
+		return 0;
+	}
+	qsort(ev, n, sizeof(*ev), cmp_event);
+
+	for (slot_mask = 1; slot_mask < n * 2; slot_mask <<= 1)
+		;
+	slots = calloc(slot_mask, sizeof(*slots));
+	if (!slots) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	slot_mask--;
+
+	for (i = 0; i < n; i++) {
+		struct trace_event *e = &ev[i];
+		struct work_slot *ws;
+
+		if (e->type == 0 || e->type >= TRACE_TYPES)
+			continue;
+		counts[e->type]++;
+		if (!threads[e->thread]) {
+			threads[e->thread] = 1;
+			nthreads++;
+		}
+
+		if (e->type == TRACE_OON) {
+			if (oon_last[e->chain])
+				stage_add(&samples[STAGES - 1], e->ns - oon_last[e->chain]);
+			oon_last[e->chain] = e->ns;
+			continue;
+		}
+		if (!e->work_id)
+			continue;
+
+		ws = work_slot(e->work_id);
+		for (s = 0; s < STAGES; s++) {
+			const struct stage *st = &stages[s];
+
+			if (st->type == e->type && ws->last[st->from])
+				stage_add(&samples[s], e->ns - ws->last[st->from]);
+		}
+		ws->last[e->type] = e->ns;
+	}
+
+	printf("%s: %zu events from %d threads over %.3fs\n", path, n, nthreads,
+	       (ev[n - 1].ns - ev[0].ns) / 1e9);
+	printf("%" PRIu64 " generated, %" PRIu64 " queued, %" PRIu64 " written, %"
+	       PRIu64 " OON, %" PRIu64 " GN, %" PRIu64 " nonces, %" PRIu64
+	       " submitted, %" PRIu64 " accepted, %" PRIu64 " rejected\n\n",
+	       counts[TRACE_WORK_GEN], counts[TRACE_WORK_QUEUED],
+	       counts[TRACE_WRITE_PARM], counts[TRACE_OON], counts[TRACE_GN],
+	       counts[TRACE_NONCE_OK], counts[TRACE_SHARE_SUBMIT],
+	       counts[TRACE_SHARE_ACCEPT], counts[TRACE_SHARE_REJECT]);
+
+	printf("%-20s %8s %10s %10s %10s %10s %10s %10s\n", "stage (ms)", "count",
+	       "min", "p50", "p90", "p99", "p99.9", "max");
+	for (s = 0; s < STAGES; s++) {
+		struct samples *st = &samples[s];
+
+		if (!st->count)
+			continue;
+		qsort(st->ns, st->count, sizeof(*st->ns), cmp_u64);
+		printf("%-20s %8zu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+		       stages[s].name, st->count, st->ns[0] / 1e6, pct_ms(st, 50),
+		       pct_ms(st, 90), pct_ms(st, 99), pct_ms(st, 99.9),
+		       st->ns[st->count - 1] / 1e6);
+	}
+
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * binary event trace of the mining pipeline
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include "miner.h"
+#include "trace.h"
+
+/* Only the owning thread writes a ring and publishes each event by moving
+ * head on. trace_dump() copies a ring from another thread and then discards
+ * whatever the owner may have overwritten meanwhile. A ring outlives its
+ * thread and is handed to the next new thread, so threads that come and go
+ * cost no more than one ring each at a time. */
+struct trace_ring {
+	atomic_uint_fast64_t head;
+	struct trace_ring *next;
+	bool inuse;
+	uint8_t index;
+	struct trace_event ev[TRACE_RING_EVENTS];
+};
+
+atomic_bool trace_on;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings;
+static int trace_nrings;
+static atomic_uint_fast64_t trace_begin;
+
+static _Thread_local struct trace_ring *trace_self;
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t trace_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The ring stays on the list, only give it up for reuse */
+static void trace_ring_release(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	mutex_lock(&trace_lock);
+	ring->inuse = false;
+	mutex_unlock(&trace_lock);
+}
+
+static void trace_key_init(void)
+{
+	pthread_key_create(&trace_key, trace_ring_release);
+}
+
+static struct trace_ring *trace_ring_alloc(void)
+{
+	struct trace_ring *ring;
+
+#ifndef WIN32
+	ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
+#else
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+#endif
+	atomic_init(&ring->head, 0);
+	return ring;
+}
+
+/* First event of this thread, reuse a ring of an exited one or map a new one */
+static struct trace_ring *trace_ring_get(void)
+{
+	struct trace_ring *ring;
+
+	pthread_once(&trace_key_once, trace_key_init);
+
+	mutex_lock(&trace_lock);
+	for (ring = trace_rings; ring; ring = ring->next) {
+		if (!ring->inuse)
+			break;
+	}
+	if (!ring && trace_nrings < TRACE_MAX_RINGS) {
+		ring = trace_ring_alloc();
+		if (ring) {
+			ring->index = trace_nrings++;
+			ring->next = trace_rings;
+			trace_rings = ring;
+		} else
+			applog(LOG_WARNING, "Failed to map a trace ring, thread not traced");
+	}
+	if (ring)
+		ring->inuse = true;
+	mutex_unlock(&trace_lock);
+
+	if (ring) {
+		pthread_setspecific(trace_key, ring);
+		trace_self = ring;
+	}
+	return ring;
+}
+
+void _trace_event(int type, uint32_t work_id, int chain, int chip,
+		  int job_id, uint32_t arg)
+{
+	struct trace_ring *ring = trace_self;
+	struct trace_event *ev;
+	uint_fast64_t head;
+
+	if (unlikely(!ring)) {
+		ring = trace_ring_get();
+		if (!ring)
+			return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	ev = &ring->ev[head & (TRACE_RING_EVENTS - 1)];
+	ev->ns = trace_ns();
+	ev->work_id = work_id;
+	ev->arg = arg;
+	ev->type = type;
+	ev->chain = chain;
+	ev->chip = chip;
+	ev->job_id = job_id;
+	ev->thread = ring->index;
+	ev->pad = 0;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void trace_start(void)
+{
+	atomic_store(&trace_begin, trace_ns());
+	atomic_store(&trace_on, true);
+}
+
+void trace_stop(void)
+{
+	atomic_store(&trace_on, false);
+}
+
+int trace_threads(void)
+{
+	int ret;
+
+	mutex_lock(&trace_lock);
+	ret = trace_nrings;
+	mutex_unlock(&trace_lock);
+	return ret;
+}
+
+/* Copies the events of ring recorded since begin to buf, returns how many */
+static int trace_ring_copy(struct trace_ring *ring, struct trace_event *buf,
+			   uint64_t begin)
+{
+	uint_fast64_t head, first, valid, skip = 0, i;
+	int n = 0;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+	for (i = first; i < head; i++)
+		buf[i - first] = ring->ev[i & (TRACE_RING_EVENTS - 1)];
+
+	/* By now the owner may be writing the slot of event
+	 * valid - TRACE_RING_EVENTS and has overwritten all before it */
+	atomic_thread_fence(memory_order_acquire);
+	valid = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (valid >= TRACE_RING_EVENTS && valid - TRACE_RING_EVENTS + 1 > first)
+		skip = valid - TRACE_RING_EVENTS + 1 - first;
+
+	for (i = skip; i < head - first; i++) {
+		if (buf[i].ns >= begin)
+			buf[n++] = buf[i];
+	}
+	return n;
+}
+
+/* Writes the events of every thread since tracing was last started to path.
+ * Returns the number of events written or -1 with errno set */
+int64_t trace_dump(const char *path)
+{
+	struct trace_header hdr;
+	struct trace_event *buf;
+	struct trace_ring *ring;
+	uint64_t begin;
+	int64_t total = 0;
+	FILE *fp;
+	int n;
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		return -1;
+
+	begin = atomic_load(&trace_begin);
+	memset(&hdr, 0, sizeof(hdr));
+	strcpy(hdr.magic, TRACE_MAGIC);
+	hdr.version = TRACE_VERSION;
+	hdr.event_size = sizeof(struct trace_event);
+	hdr.begin_ns = begin;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto err;
+
+	buf = cgmalloc(sizeof(*buf) * TRACE_RING_EVENTS);
+	/* Rings are only ever added at the head of the list */
+	mutex_lock(&trace_lock);
+	ring = trace_rings;
+	mutex_unlock(&trace_lock);
+	for (; ring; ring = ring->next) {
+		n = trace_ring_copy(ring, buf, begin);
+		if (n && fwrite(buf, sizeof(*buf), n, fp) != (size_t)n) {
+			free(buf);
+			goto err;
+		}
+		total += n;
+	}
+	free(buf);
+
+	hdr.events = total;
+	if (fseek(fp, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto err;
+	if (fclose(fp))
+		return -1;
+	return total;
+err:
+	fclose(fp);
+	return -1;
+}
@@ -0,0 +1,81 @@
+/*
+ * binary event trace of the mining pipeline
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Binary event trace of the mining pipeline. Every thread records fixed size
+ * events into its own mmap'd ring while tracing is on, and the API 'trace'
+ * command writes all rings out to --trace-file for trace-decode. The file is
+ * a struct trace_header followed by header.events struct trace_event in host
+ * byte order, unsorted. */
+
+#define TRACE_MAGIC		"CGTRACE"
+#define TRACE_VERSION		1
+/* Events each thread keeps, must be a power of 2 */
+#define TRACE_RING_EVENTS	8192
+#define TRACE_MAX_RINGS		255
+/* chain, chip or job_id an event has none of */
+#define TRACE_NONE		0xff
+
+enum trace_type {
+	TRACE_WORK_GEN = 1,	/* arg: notify sequence of the pool */
+	TRACE_WORK_STAGED,
+	TRACE_WORK_QUEUED,	/* handed to the device driver */
+	TRACE_WRITE_PARM,	/* job written to the chips */
+	TRACE_OON,		/* arg: nonce ranges finished */
+	TRACE_GN,		/* arg: micro job id mask */
+	TRACE_NONCE_OK,		/* arg: nonce */
+	TRACE_SHARE_SUBMIT,	/* arg: pool number */
+	TRACE_SHARE_ACCEPT,	/* arg: pool number */
+	TRACE_SHARE_REJECT,	/* arg: pool number */
+	TRACE_TYPES
+};
+
+struct trace_event {
+	uint64_t ns;		/* CLOCK_MONOTONIC */
+	uint32_t work_id;	/* work->trace_id, 0 if none */
+	uint32_t arg;
+	uint16_t type;
+	uint8_t chain;		/* cgpu device_id */
+	uint8_t chip;
+	uint8_t job_id;		/* device job id */
+	uint8_t thread;		/* ring that recorded it */
+	uint16_t pad;
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+	uint64_t events;
+	uint64_t begin_ns;	/* when tracing was last turned on */
+};
+
+extern atomic_bool trace_on;
+
+extern void _trace_event(int type, uint32_t work_id, int chain, int chip,
+			 int job_id, uint32_t arg);
+
+/* Costs one relaxed load while tracing is off */
+#define trace_event(type, work_id, chain, chip, job_id, arg) do { \
+	if (__builtin_expect(atomic_load_explicit(&trace_on, memory_order_relaxed), 0)) \
+		_trace_event(type, work_id, chain, chip, job_id, arg); \
+	} while (0)
+
+extern void trace_start(void);
+extern void trace_stop(void);
+extern int trace_threads(void);
+extern int64_t trace_dump(const char *path);
+
+#endif /* TRACE_H */
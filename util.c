@@ -16,6 +16,8 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
+#include <math.h>
+#include <stddef.h>
 #include <jansson.h>
 #ifdef HAVE_LIBCURL
 #include <curl/curl.h>
@@ -44,6 +46,7 @@
 #include "elist.h"
 #include "compat.h"
 #include "util.h"
+#include "sha2.h"
 
 #define DEFAULT_SOCKWAIT 60
 #ifndef STRATUM_USER_AGENT
@@ -495,6 +498,7 @@ static int curl_debug_cb(__maybe_unused CURL *handle, curl_infotype type,
 		case CURLINFO_HEADER_IN:
 		case CURLINFO_DATA_IN:
 		case CURLINFO_SSL_DATA_IN:
+			pool->cgminer_pool_stats.net_times_received++;
 			pool->cgminer_pool_stats.net_bytes_received += size;
 			break;
 		case CURLINFO_HEADER_OUT:
@@ -1221,6 +1225,98 @@ out:
 	return rval;
 }
 
+/* Pops up to max entries off tq into data without blocking between them,
+ * waiting up to ms for the first one, indefinitely if ms is negative. Returns
+ * the number of entries popped. */
+int tq_pop_batch(struct thread_q *tq, void **data, int max, int ms)
+{
+	struct tq_ent *ent, *iter;
+	int n = 0;
+
+	mutex_lock(&tq->mutex);
+	if (list_empty(&tq->q) && ms) {
+		if (ms < 0)
+			pthread_cond_wait(&tq->cond, &tq->mutex);
+		else {
+			struct timespec abstime, tdiff;
+
+			cgcond_time(&abstime);
+			ms_to_timespec(&tdiff, ms);
+			timeraddspec(&abstime, &tdiff);
+			pthread_cond_timedwait(&tq->cond, &tq->mutex, &abstime);
+		}
+	}
+	list_for_each_entry_safe(ent, iter, &tq->q, q_node) {
+		if (n >= max)
+			break;
+		data[n++] = ent->data;
+		list_del(&ent->q_node);
+		free(ent);
+	}
+	mutex_unlock(&tq->mutex);
+
+	return n;
+}
+
+static int lat_hist_index(uint64_t us)
+{
+	int msb, idx;
+
+	if (us < 4)
+		return us;
+	msb = 63 - __builtin_clzll(us);
+	idx = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+	return MIN(idx, LAT_HIST_BUCKETS - 1);
+}
+
+/* The largest sample in microseconds counted in bucket */
+uint64_t lat_hist_bound(int bucket)
+{
+	int msb;
+
+	if (bucket < 4)
+		return bucket;
+	msb = bucket / 4 + 1;
+	return ((uint64_t)(5 + bucket % 4) << (msb - 2)) - 1;
+}
+
+void lat_hist_add(struct lat_hist *hist, uint64_t us)
+{
+	uint64_t max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+
+	atomic_fetch_add_explicit(&hist->bucket[lat_hist_index(us)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum_us, us, memory_order_relaxed);
+	while (us > max && !atomic_compare_exchange_weak_explicit(&hist->max_us, &max, us,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+		;
+}
+
+/* Returns the upper bound in microseconds of the bucket holding the pct
+ * percentile sample, or 0 with no samples */
+uint64_t lat_hist_percentile(struct lat_hist *hist, double pct)
+{
+	uint64_t counts[LAT_HIST_BUCKETS], total = 0, rank, seen = 0;
+	int i;
+
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		counts[i] = atomic_load_explicit(&hist->bucket[i], memory_order_relaxed);
+		total += counts[i];
+	}
+	if (!total)
+		return 0;
+	rank = ceil(total * pct / 100);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= rank)
+			break;
+	}
+	return lat_hist_bound(MIN(i, LAT_HIST_BUCKETS - 1));
+}
+
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
 	cgsem_init(&thr->sem);
@@ -1839,6 +1935,136 @@ bool stratum_send(struct pool *pool, char *s, ssize_t len)
 	return (ret == SEND_OK);
 }
 
+/* Maximum number of lines coalesced into a single sendmsg */
+#define STRATUM_SENDV_MAX 64
+
+#ifndef WIN32
+
+/* Send count \n terminated commands across a socket coalesced into as few
+ * writes as possible, adding the number of lines sent in full to
+ * *sent_lines. Must be done under stratum lock. */
+static enum send_ret __stratum_sendv(struct pool *pool, char **lines, const int *lens, int count,
+				     int *sent_lines)
+{
+	struct iovec iovs[STRATUM_SENDV_MAX], *iov = iovs;
+	SOCKETTYPE sock = pool->sock;
+	ssize_t ssent = 0;
+	int i, iovcnt;
+
+	iovcnt = MIN(count, STRATUM_SENDV_MAX);
+	for (i = 0; i < iovcnt; i++) {
+		iovs[i].iov_base = lines[i];
+		iovs[i].iov_len = lens[i];
+	}
+
+	while (iovcnt > 0) {
+		struct timeval timeout = {1, 0};
+		struct msghdr msg;
+		ssize_t sent;
+		fd_set wd;
+retry:
+		FD_ZERO(&wd);
+		FD_SET(sock, &wd);
+		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1) {
+			if (interrupted())
+				goto retry;
+			return SEND_SELECTFAIL;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+#ifdef __APPLE__
+		sent = sendmsg(sock, &msg, SO_NOSIGPIPE);
+#else
+		sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+#endif
+		if (sent < 0) {
+			if (!sock_blocks())
+				return SEND_SENDFAIL;
+			sent = 0;
+		}
+		ssent += sent;
+		/* Skip past what was sent, including any partial line */
+		while (iovcnt && sent >= (ssize_t)iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			iovcnt--;
+			(*sent_lines)++;
+		}
+		if (iovcnt && sent) {
+			iov->iov_base = (char *)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+
+	pool->cgminer_pool_stats.times_sent += MIN(count, STRATUM_SENDV_MAX);
+	pool->cgminer_pool_stats.bytes_sent += ssent;
+	pool->cgminer_pool_stats.net_bytes_sent += ssent;
+	return SEND_OK;
+}
+#else
+static enum send_ret __stratum_sendv(struct pool *pool, char **lines, const int *lens, int count,
+				     int *sent_lines)
+{
+	enum send_ret ret = SEND_OK;
+	int i;
+
+	/* __stratum_send appends the \n itself */
+	for (i = 0; i < MIN(count, STRATUM_SENDV_MAX) && ret == SEND_OK; i++) {
+		char s[RBUFSIZE];
+
+		snprintf(s, sizeof(s) - 1, "%.*s", lens[i] - 1, lines[i]);
+		ret = __stratum_send(pool, s, strlen(s));
+		if (ret == SEND_OK)
+			(*sent_lines)++;
+	}
+	return ret;
+}
+#endif
+
+/* Sends count already \n terminated commands of lens bytes each in one go.
+ * Returns how many of them, from the first, were sent in full, which is
+ * count on success. */
+int stratum_sendv(struct pool *pool, char **lines, const int *lens, int count)
+{
+	enum send_ret ret = SEND_INACTIVE;
+	int i, sent = 0;
+
+	if (opt_protocol) {
+		for (i = 0; i < count; i++)
+			applog(LOG_DEBUG, "SEND: %.*s", lens[i] - 1, lines[i]);
+	}
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_active) {
+		for (i = 0; i < count; i += STRATUM_SENDV_MAX) {
+			ret = __stratum_sendv(pool, lines + i, lens + i, count - i, &sent);
+			if (ret != SEND_OK)
+				break;
+		}
+	}
+	mutex_unlock(&pool->stratum_lock);
+
+	/* This is to avoid doing applog under stratum_lock */
+	switch (ret) {
+		default:
+		case SEND_OK:
+			break;
+		case SEND_SELECTFAIL:
+			applog(LOG_DEBUG, "Write select failed on pool %d sock", pool->pool_no);
+			suspend_stratum(pool);
+			break;
+		case SEND_SENDFAIL:
+			applog(LOG_DEBUG, "Failed to send in stratum_sendv");
+			suspend_stratum(pool);
+			break;
+		case SEND_INACTIVE:
+			applog(LOG_DEBUG, "Stratum send failed due to no pool stratum_active");
+			break;
+	}
+	return sent;
+}
+
 static bool socket_full(struct pool *pool, int wait)
 {
 	SOCKETTYPE sock = pool->sock;
@@ -1859,7 +2085,7 @@ static bool socket_full(struct pool *pool, int wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_tail > pool->sockbuf_head)
 		return true;
 
 	return (socket_full(pool, 0));
@@ -1867,8 +2093,7 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-	if (likely(pool->sockbuf))
-		strcpy(pool->sockbuf, "");
+	pool->sockbuf_head = pool->sockbuf_tail = pool->sockbuf_scan = 0;
 }
 
 static void clear_sock(struct pool *pool)
@@ -1897,94 +2122,190 @@ void ckrecalloc(void **ptr, size_t old, size_t new, const char *file, const char
 		memset(*ptr + old, 0, new - old);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make room for at least RECVSIZE bytes to be received directly after the
+ * tail of the pool sockbuf. Lines already handed out ahead of sockbuf_head
+ * are reclaimed first by moving the partial line left over to the front, so
+ * only an incomplete line is ever moved. The buffer only grows, to a multiple
+ * of RBUFSIZE, when a single line does not fit to cope with any coinbase
+ * size. */
+static void sockbuf_reserve(struct pool *pool)
 {
-	size_t old, new;
+	size_t used = pool->sockbuf_tail - pool->sockbuf_head;
+	size_t new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (pool->sockbuf_size - pool->sockbuf_tail > RECVSIZE)
 		return;
+	if (pool->sockbuf_head) {
+		memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_head, used);
+		pool->sockbuf_scan -= pool->sockbuf_head;
+		pool->sockbuf_head = 0;
+		pool->sockbuf_tail = used;
+	}
+	if (pool->sockbuf_size - used > RECVSIZE)
+		return;
+	new = used + RECVSIZE + 1;
 	new = new + (RBUFSIZE - (new % RBUFSIZE));
 	// Avoid potentially recursive locking
-	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %d", new);
+	// applog(LOG_DEBUG, "Reallocing pool sockbuf to %d", new);
 	pool->sockbuf = cgrealloc(pool->sockbuf, new);
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
-char *recv_line(struct pool *pool)
+/* Returns the offset of the first \n in the pool sockbuf's unparsed data or
+ * -1 if there is none yet. Data already searched is never searched again. */
+static ssize_t sockbuf_eol(struct pool *pool)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
-	int waited = 0;
+	char *eol;
 
-	if (!strstr(pool->sockbuf, "\n")) {
-		struct timeval rstart, now;
+	eol = memchr(pool->sockbuf + pool->sockbuf_scan, '\n',
+		     pool->sockbuf_tail - pool->sockbuf_scan);
+	if (!eol) {
+		pool->sockbuf_scan = pool->sockbuf_tail;
+		return -1;
+	}
+	return eol - pool->sockbuf;
+}
 
-		cgtime(&rstart);
-		if (!socket_full(pool, DEFAULT_SOCKWAIT)) {
-			applog(LOG_DEBUG, "Timed out waiting for data on socket_full");
-			goto out;
-		}
+/* Frames the line in the pool sockbuf ending at the \n at eol in place */
+static char *sockbuf_take_line(struct pool *pool, ssize_t eol, size_t *len)
+{
+	char *sret = pool->sockbuf + pool->sockbuf_head;
 
-		do {
-			char s[RBUFSIZE];
-			size_t slen;
-			ssize_t n;
+	*len = eol - pool->sockbuf_head;
+	sret[*len] = '\0';
+	pool->sockbuf_head = pool->sockbuf_scan = eol + 1;
+	/* Rewind an empty buffer so it never needs compacting */
+	if (pool->sockbuf_head == pool->sockbuf_tail)
+		clear_sockbuf(pool);
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
-			if (!n) {
-				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
-				suspend_stratum(pool);
-				break;
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += *len;
+	if (opt_protocol)
+		applog(LOG_DEBUG, "RECVD: %s", sret);
+	return sret;
+}
+
+/* Returns the next line already received into the pool sockbuf, framed in
+ * place as recv_line_inplace does, or NULL if there is no complete line yet.
+ * Never touches the socket. */
+char *sockbuf_line(struct pool *pool, size_t *len)
+{
+	ssize_t eol;
+
+	while ((eol = sockbuf_eol(pool)) >= 0) {
+		if ((size_t)eol > pool->sockbuf_head)
+			return sockbuf_take_line(pool, eol, len);
+		/* Skip blank lines */
+		pool->sockbuf_head = pool->sockbuf_scan = eol + 1;
+	}
+	return NULL;
+}
+
+#ifdef USE_STRATUM_EPOLL
+/* Receives whatever is waiting on the pool socket into the sockbuf without
+ * blocking. Returns false if the socket has been closed or failed. */
+bool recv_sockbuf(struct pool *pool)
+{
+	ssize_t n;
+
+	sockbuf_reserve(pool);
+	n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+		 pool->sockbuf_size - pool->sockbuf_tail - 1, MSG_DONTWAIT);
+	if (!n) {
+		applog(LOG_DEBUG, "Socket closed on pool %d", pool->pool_no);
+		return false;
+	}
+	if (n < 0) {
+		if (sock_blocks())
+			return true;
+		applog(LOG_DEBUG, "Failed to recv sock on pool %d", pool->pool_no);
+		return false;
+	}
+	pool->sockbuf_tail += n;
+	pool->cgminer_pool_stats.net_times_received++;
+	pool->cgminer_pool_stats.net_bytes_received += n;
+	return true;
+}
+#endif
+
+/* Returns the next \n terminated line from the pool without copying it. The
+ * line is framed in place in the pool sockbuf with its \n replaced by a \0
+ * and its length returned in len. It is only valid until the next receive on
+ * the pool. Data is received straight into the free space of the sockbuf. */
+char *recv_line_inplace(struct pool *pool, size_t *len)
+{
+	char *sret = NULL;
+	int waited = 0;
+	ssize_t eol;
+
+	while (42) {
+		eol = sockbuf_eol(pool);
+		if (eol < 0) {
+			struct timeval rstart, now;
+
+			cgtime(&rstart);
+			if (!socket_full(pool, DEFAULT_SOCKWAIT)) {
+				applog(LOG_DEBUG, "Timed out waiting for data on socket_full");
+				goto out;
 			}
-			cgtime(&now);
-			waited = tdiff(&now, &rstart);
-			if (n < 0) {
-				if (!sock_blocks() || !socket_full(pool, DEFAULT_SOCKWAIT - waited)) {
-					applog(LOG_DEBUG, "Failed to recv sock in recv_line");
+
+			do {
+				ssize_t n;
+
+				sockbuf_reserve(pool);
+				n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+					 pool->sockbuf_size - pool->sockbuf_tail - 1, 0);
+				if (!n) {
+					applog(LOG_DEBUG, "Socket closed waiting in recv_line");
 					suspend_stratum(pool);
 					break;
 				}
-			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
+				cgtime(&now);
+				waited = tdiff(&now, &rstart);
+				if (n < 0) {
+					if (!sock_blocks() || !socket_full(pool, DEFAULT_SOCKWAIT - waited)) {
+						applog(LOG_DEBUG, "Failed to recv sock in recv_line");
+						suspend_stratum(pool);
+						break;
+					}
+				} else {
+					pool->sockbuf_tail += n;
+					pool->cgminer_pool_stats.net_times_received++;
+					pool->cgminer_pool_stats.net_bytes_received += n;
+					eol = sockbuf_eol(pool);
+				}
+			} while (waited < DEFAULT_SOCKWAIT && eol < 0);
+
+			if (eol < 0) {
+				applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
+				goto out;
 			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
-	}
+		}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
-		goto out;
+		/* Skip blank lines */
+		if ((size_t)eol > pool->sockbuf_head)
+			break;
+		pool->sockbuf_head = pool->sockbuf_scan = eol + 1;
 	}
-	sret = strdup(tok);
-	len = strlen(sret);
 
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
-	pool->cgminer_pool_stats.times_received++;
-	pool->cgminer_pool_stats.bytes_received += len;
-	pool->cgminer_pool_stats.net_bytes_received += len;
+	sret = sockbuf_take_line(pool, eol, len);
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "RECVD: %s", sret);
+	return sret;
+}
+
+/* As recv_line_inplace but returns the line as a malloced char */
+char *recv_line(struct pool *pool)
+{
+	char *buf, *sret;
+	size_t len;
+
+	buf = recv_line_inplace(pool, &len);
+	if (!buf)
+		return NULL;
+	sret = cgmalloc(len + 1);
+	cg_memcpy(sret, buf, len + 1);
 	return sret;
 }
 
@@ -2313,6 +2634,8 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	cg_wlock(&pool->data_lock);
 	free(pool->swork.job_id);
 	pool->swork.job_id = job_id;
+	pool->swork.notify_seq++;
+	cgtime(&pool->swork.tv_notify);
 	if (memcmp(pool->prev_hash, prev_hash, 64)) {
 		pool->swork.clean = true;
 	} else {
@@ -2399,6 +2722,12 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	if (pool->n1_len)
 		cg_memcpy(pool->coinbase + cb1_len, pool->nonce1bin, pool->n1_len);
 	cg_memcpy(pool->coinbase + cb1_len + pool->n1_len + pool->n2size, cb2, cb2_len);
+	/* Everything before nonce2 is fixed until the next notify, so hash it
+	 * once here and let gen_stratum_work resume from this state */
+	if (!pool->coinbase_prefix)
+		pool->coinbase_prefix = cgmalloc(sizeof(sha256_ctx));
+	sha256_init(pool->coinbase_prefix);
+	sha256_update(pool->coinbase_prefix, pool->coinbase, pool->nonce2_offset);
 	if (opt_debug || opt_decode) {
 		char *cb = bin2hex(pool->coinbase, pool->coinbase_len);
 
@@ -2468,7 +2797,9 @@ static bool parse_diff(struct pool *pool, json_t *val)
 
 static void __suspend_stratum(struct pool *pool)
 {
-	clear_sockbuf(pool);
+#ifdef USE_STRATUM_EPOLL
+	__stratum_ev_del(pool);
+#endif
 	pool->stratum_active = pool->stratum_notify = false;
 	if (pool->sock)
 		CLOSESOCKET(pool->sock);
@@ -2536,7 +2867,13 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 	free(tmp);
 	mutex_unlock(&pool->stratum_lock);
 
+#ifdef USE_STRATUM_EPOLL
+	/* The event loop sees the socket gone and connects on a thread of its
+	 * own rather than stall every other pool */
+	return true;
+#else
 	return restart_stratum(pool);
+#endif
 }
 
 static bool send_version(struct pool *pool, json_t *val)
@@ -2608,17 +2945,20 @@ out:
 	return ret;
 }
 
-bool parse_method(struct pool *pool, char *s)
+/* Parses a method received from the pool in the len bytes at s, which must
+ * also be \0 terminated for logging. */
+enum stratum_method parse_method_len(struct pool *pool, char *s, size_t len)
 {
 	json_t *val = NULL, *method, *err_val, *params;
+	enum stratum_method ret = STRATUM_NOT_METHOD;
 	json_error_t err;
-	bool ret = false;
+	bool handled = false;
 	char *buf;
 
 	if (!s)
 		goto out;
 
-	val = JSON_LOADS(s, &err);
+	val = JSON_LOADB(s, len, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -2627,6 +2967,7 @@ bool parse_method(struct pool *pool, char *s)
 	method = json_object_get(val, "method");
 	if (!method)
 		goto out_decref;
+	ret = STRATUM_METHOD_FAILED;
 	err_val = json_object_get(val, "error");
 	params = json_object_get(val, "params");
 
@@ -2648,50 +2989,58 @@ bool parse_method(struct pool *pool, char *s)
 		goto out_decref;
 
 	if (!strncasecmp(buf, "mining.notify", 13)) {
-		if (parse_notify(pool, params))
-			pool->stratum_notify = ret = true;
-		else
-			pool->stratum_notify = ret = false;
-		goto out_decref;
+		pool->stratum_notify = handled = parse_notify(pool, params);
+		goto out_handled;
 	}
 
 	if (!strncasecmp(buf, "mining.set_difficulty", 21)) {
-		ret = parse_diff(pool, params);
-		goto out_decref;
+		handled = parse_diff(pool, params);
+		goto out_handled;
 	}
 
 	if (!strncasecmp(buf, "client.reconnect", 16)) {
-		ret = parse_reconnect(pool, params);
-		goto out_decref;
+		handled = parse_reconnect(pool, params);
+		goto out_handled;
 	}
 
 	if (!strncasecmp(buf, "client.get_version", 18)) {
-		ret =  send_version(pool, val);
-		goto out_decref;
+		handled = send_version(pool, val);
+		goto out_handled;
 	}
 
 	if (!strncasecmp(buf, "client.show_message", 19)) {
-		ret = show_message(pool, params);
-		goto out_decref;
+		handled = show_message(pool, params);
+		goto out_handled;
 	}
 
 	if (!strncasecmp(buf, "mining.ping", 11)) {
 		applog(LOG_INFO, "Pool %d ping", pool->pool_no);
-		ret = send_pong(pool, val);
-		goto out_decref;
+		handled = send_pong(pool, val);
+		goto out_handled;
 	}
 
 	if (!strncasecmp(buf, "mining.set_version_mask", 23)) {
-		ret = parse_vmask(pool, params);
-		goto out_decref;
+		handled = parse_vmask(pool, params);
+		goto out_handled;
 	}
 	applog(LOG_INFO, "Unknown JSON-RPC from pool %d: %s", pool->pool_no, s);
+	goto out_decref;
+out_handled:
+	if (handled)
+		ret = STRATUM_METHOD_OK;
 out_decref:
 	json_decref(val);
 out:
 	return ret;
 }
 
+bool parse_method(struct pool *pool, char *s)
+{
+	if (!s)
+		return false;
+	return parse_method_len(pool, s, strlen(s)) == STRATUM_METHOD_OK;
+}
+
 bool auth_stratum(struct pool *pool)
 {
 	json_t *val = NULL, *res_val, *err_val;
@@ -3120,6 +3469,9 @@ retry:
 		pool->sockbuf = cgcalloc(RBUFSIZE, 1);
 		pool->sockbuf_size = RBUFSIZE;
 	}
+	/* Only the thread receiving from the pool gets here, suspending it from
+	 * a sending thread leaves the sockbuf alone */
+	clear_sockbuf(pool);
 
 	pool->sock = sockd;
 	keep_sockalive(sockd);
@@ -3385,6 +3737,65 @@ void dev_error(struct cgpu_info *dev, enum dev_reason reason)
 	}
 }
 
+/* Refcounted strings. The count lives in a header ahead of the characters so
+ * the pointer handed out is still an ordinary nul terminated string that can
+ * be read anywhere a char * is expected, but it must only be released with
+ * rcstr_put. All functions accept NULL. */
+struct rcstr {
+	atomic_int refs;
+	char str[];
+};
+
+static inline struct rcstr *rcstr_hdr(char *s)
+{
+	return (struct rcstr *)(s - offsetof(struct rcstr, str));
+}
+
+char *rcstr_new(const char *s)
+{
+	struct rcstr *rc;
+	size_t len;
+
+	if (!s)
+		return NULL;
+	len = strlen(s) + 1;
+	rc = cgmalloc(sizeof(struct rcstr) + len);
+	atomic_init(&rc->refs, 1);
+	cg_memcpy(rc->str, s, len);
+	return rc->str;
+}
+
+char *rcstr_get(char *s)
+{
+	if (s)
+		atomic_fetch_add_explicit(&rcstr_hdr(s)->refs, 1, memory_order_relaxed);
+	return s;
+}
+
+void rcstr_put(char *s)
+{
+	struct rcstr *rc;
+
+	if (!s)
+		return;
+	rc = rcstr_hdr(s);
+	if (atomic_fetch_sub_explicit(&rc->refs, 1, memory_order_acq_rel) == 1)
+		free(rc);
+}
+
+/* Returns a reference to s that the caller may modify in place, copying it
+ * if it is currently shared. The caller's reference to s is consumed. */
+char *rcstr_unshare(char *s)
+{
+	char *ret;
+
+	if (!s || atomic_load_explicit(&rcstr_hdr(s)->refs, memory_order_acquire) == 1)
+		return s;
+	ret = rcstr_new(s);
+	rcstr_put(s);
+	return ret;
+}
+
 /* Realloc an existing string to fit an extra string s, appending s to it. */
 void *realloc_strcat(char *ptr, char *s)
 {
@@ -70,6 +70,7 @@
 #endif
 
 #define JSON_LOADS(str, err_ptr) json_loads((str), 0, (err_ptr))
+#define JSON_LOADB(str, len, err_ptr) json_loadb((str), (len), 0, (err_ptr))
 
 #ifdef HAVE_LIBCURL
 #include <curl/curl.h>
@@ -149,10 +150,23 @@ double us_tdiff(struct timeval *end, struct timeval *start);
 int ms_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
 bool stratum_send(struct pool *pool, char *s, ssize_t len);
+int stratum_sendv(struct pool *pool, char **lines, const int *lens, int count);
 bool sock_full(struct pool *pool);
 void ckrecalloc(void **ptr, size_t old, size_t new, const char *file, const char *func, const int line);
 #define recalloc(ptr, old, new) ckrecalloc((void *)&(ptr), old, new, __FILE__, __func__, __LINE__)
+char *sockbuf_line(struct pool *pool, size_t *len);
+bool recv_sockbuf(struct pool *pool);
+char *recv_line_inplace(struct pool *pool, size_t *len);
 char *recv_line(struct pool *pool);
+/* What parse_method_len() made of a line. The line may no longer be valid
+ * once a method was handled or failed since client.reconnect replaces the
+ * pool socket. */
+enum stratum_method {
+	STRATUM_NOT_METHOD,	/* not a method call, may be a response */
+	STRATUM_METHOD_OK,
+	STRATUM_METHOD_FAILED,	/* a method call that failed or is unknown */
+};
+enum stratum_method parse_method_len(struct pool *pool, char *s, size_t len);
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
 bool auth_stratum(struct pool *pool);
@@ -160,6 +174,10 @@ bool initiate_stratum(struct pool *pool);
 bool restart_stratum(struct pool *pool);
 void suspend_stratum(struct pool *pool);
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);
+char *rcstr_new(const char *s);
+char *rcstr_get(char *s);
+void rcstr_put(char *s);
+char *rcstr_unshare(char *s);
 void *realloc_strcat(char *ptr, char *s);
 void *str_text(char *ptr);
 void RenameThread(const char* name);